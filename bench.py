@@ -0,0 +1,85 @@
+#!/bin/env python
+import os
+import sys
+import time
+from subprocess import Popen, PIPE
+
+sandbox_executable = "./build/sandbox/sandbox"
+common_options = ''
+
+
+def run_zygote(options, commands):
+    cmd = f'{sandbox_executable} {common_options} --zygote 4 {options}'
+    start = time.monotonic()
+    with Popen(cmd, shell=True, stdin=PIPE, stdout=PIPE, stderr=PIPE) as proc:
+        _, stderr = proc.communicate(commands.encode('utf-8'))
+    elapsed = time.monotonic() - start
+    return elapsed, stderr.decode('utf-8').count("Task exec'd in")
+
+
+def bench_cgroup_pool(tasks):
+    """tasks/sec of the zygote with a cgroup created and deleted per task vs reused ones"""
+    commands = '/bin/true\n' * tasks
+    results = {}
+    for name, options in [('no pool', ''), ('cgroup pool', '--cgroup-pool 8')]:
+        elapsed, done = run_zygote(options, commands)
+        if done != tasks:
+            print(f'{name}: only {done} of {tasks} tasks ran', file=sys.stderr)
+        results[name] = done / elapsed
+        print(f'{name:>12}: {done} tasks in {elapsed:.2f}s, {results[name]:.1f} tasks/sec')
+    print(f'     speedup: {results["cgroup pool"] / results["no pool"]:.2f}x')
+
+
+def bench_zygote_latency(tasks):
+    """start-to-exec latency percentiles of the zygote, as it reports them"""
+    with Popen(f'{sandbox_executable} {common_options} --zygote 4', shell=True, stdin=PIPE, stdout=PIPE, stderr=PIPE) as proc:
+        _, stderr = proc.communicate(('/bin/true\n' * tasks).encode('utf-8'))
+    report = [line for line in stderr.decode('utf-8').splitlines() if 'Start-to-exec latency' in line]
+    print(report[-1].split('(Sandbox) ')[-1].split('\x1b')[0] if report else 'no latency reported')
+
+
+def bench_sampler(iterations=2000000, runs=3):
+    """wall time of a fixed amount of CPU-bound work with and without --sample, and the sampler's own accounting"""
+    loop = f'-c "i=0; while [ \\$i -lt {iterations} ]; do i=\\$((i + 1)); done"'
+    for name, options in [('no sampler', ''),
+                          ('100ms', '--sample bench_samples.csv'),
+                          ('1ms', '--sample bench_samples.csv --sample-interval 1')]:
+        walls, report = [], []
+        for _ in range(runs):
+            cmd = f'{sandbox_executable} {common_options} {options} -- /bin/sh {loop}'
+            start = time.monotonic()
+            with Popen(cmd, shell=True, stdout=PIPE, stderr=PIPE) as proc:
+                _, stderr = proc.communicate()
+            walls.append(time.monotonic() - start)
+            report = [line for line in stderr.decode('utf-8').splitlines() if 'Sampler:' in line] or report
+        # the fastest run is the one least disturbed by everything else on the host
+        sampler = report[-1].split('Sampler: ')[-1] if report else 'not sampled'
+        print(f'{name:>12}: {min(walls):.2f}s wall (best of {runs}), {sampler}')
+    if os.path.exists('bench_samples.csv'):
+        os.remove('bench_samples.csv')
+
+
+def bench_io(neighbours=3, limit=20 * 1024 * 1024):
+    """wall time of an I/O-bound task alone, next to I/O-hammering neighbours, and next to neighbours under --io-max"""
+    hammer = './build/examples/iohammer/iohammer'
+    alone = None
+    for name, options in [('alone', None), ('unlimited', ''), ('io-max', f'--io-max wbps={limit},rbps={limit}')]:
+        others = [] if options is None else [
+            Popen(f'{sandbox_executable} {common_options} {options} -- {hammer} 200', shell=True, stdout=PIPE, stderr=PIPE)
+            for _ in range(neighbours)]
+        time.sleep(0.5 if others else 0)
+        start = time.monotonic()
+        with Popen(f'{sandbox_executable} {common_options} -- {hammer} 50', shell=True, stdout=PIPE, stderr=PIPE) as proc:
+            output, _ = proc.communicate()
+        elapsed = time.monotonic() - start
+        for other in others:
+            other.communicate()
+        alone = alone or elapsed
+        print(f'{name:>12}: {elapsed:.2f}s ({elapsed / alone:.2f}x), {output.decode("utf-8").strip()}')
+
+
+if __name__ == '__main__':
+    bench_cgroup_pool(int(sys.argv[1]) if len(sys.argv) > 1 else 500)
+    bench_zygote_latency(int(sys.argv[1]) if len(sys.argv) > 1 else 500)
+    bench_sampler()
+    bench_io()
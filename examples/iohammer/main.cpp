@@ -0,0 +1,46 @@
+#include <bits/stdc++.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// writes <MB> (100 by default) to iohammer.tmp in the working directory, syncing every megabyte,
+// then drops it from the page cache and reads it back
+int main(int argc, char* argv[]) {
+    const std::size_t mb = argc > 1 ? std::stoul(argv[1]) : 100;
+    const std::size_t chunk = 1024 * 1024;
+    std::vector<char> data(chunk);
+    for (std::size_t i = 0; i < chunk; i++) {
+        data[i] = (i * 12412 + 12421) % 337 * 293;
+    }
+
+    int fd = open("iohammer.tmp", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        std::cout << "Failed to open iohammer.tmp: " << strerror(errno) << std::endl;
+        return 1;
+    }
+    unlink("iohammer.tmp");
+
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < mb; i++) {
+        if (write(fd, data.data(), chunk) != static_cast<ssize_t>(chunk) || fdatasync(fd)) {
+            std::cout << "Failed to write: " << strerror(errno) << std::endl;
+            return 1;
+        }
+    }
+    auto written = std::chrono::steady_clock::now();
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    for (std::size_t i = 0; i < mb; i++) {
+        if (pread(fd, data.data(), chunk, i * chunk) != static_cast<ssize_t>(chunk)) {
+            std::cout << "Failed to read: " << strerror(errno) << std::endl;
+            return 1;
+        }
+    }
+    auto read = std::chrono::steady_clock::now();
+
+    auto rate = [&](auto from, auto to) {
+        return mb / std::max(std::chrono::duration<double>(to - from).count(), 1e-6);
+    };
+    std::cout << "wrote " << mb << " MB at " << rate(start, written) << " MB/s, read at "
+        << rate(written, read) << " MB/s" << std::endl;
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,82 @@
+#ifndef SANDBOX_CGROUP_FREEZER_H
+#define SANDBOX_CGROUP_FREEZER_H
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <utility>
+#include <optional>
+#include <cstdint>
+#include <sys/types.h>
+
+namespace sandbox
+{
+
+/*
+ * Freezes or thaws many cgroup v2 groups at once through their cgroup.freeze.
+ *
+ * Every group is asked first, then the freezer sleeps on an inotify fd until the "frozen" key in
+ * the cgroup.events of each group follows; the kernel touches the file the moment the last process
+ * of a group is stopped (or let go). Nothing is polled and no process is spawned per group, so the
+ * cost is a few syscalls per group plus however long its slowest process takes to stop.
+ *
+ * A frozen group can also give up its memory: reclaim() pushes its anonymous and file pages out
+ * through memory.reclaim (to swap or zswap), and prefetch() asks for them back with MADV_WILLNEED
+ * on every mapping of its processes before they are thawed. A group with memory.swap.max 0, which
+ * is what a task with a memory limit gets by default, only gives up its page cache.
+ */
+class CGroupFreezer {
+public:
+    CGroupFreezer();
+    ~CGroupFreezer();
+    CGroupFreezer(const CGroupFreezer&) = delete;
+    CGroupFreezer& operator=(const CGroupFreezer&) = delete;
+
+    // takes over `dirFd`, the O_PATH fd of the group's directory (see CGroupHandler::openDir)
+    void add(const std::string &name, int dirFd);
+    // returns the groups that didn't get there within `timeout`, with the reason
+    std::vector<std::pair<std::string, std::string>> apply(bool frozen, std::chrono::milliseconds timeout);
+
+    // memory.current of a group before and after reclaim() or prefetch()
+    struct MemoryReport {
+        std::string name;
+        std::uint64_t before;
+        std::uint64_t after;
+        std::chrono::microseconds took;
+        std::string error;
+    };
+
+    // reclaims the memory of every group that is frozen down to `keepBytes`, as far as the kernel manages
+    std::vector<MemoryReport> reclaim(std::uint64_t keepBytes);
+    // reads the reclaimed pages back in and waits, at most `timeout`, until the memory.current of
+    // every group stops growing; `took` is the time until a group's last growth
+    std::vector<MemoryReport> prefetch(std::chrono::milliseconds timeout);
+
+    std::size_t size() const;
+
+private:
+    struct Group {
+        std::string name;
+        int dirFd;
+        int freezeFd;
+        int eventsFd;
+        int wd;
+        // -1 without the memory controller
+        int memoryCurrentFd = -1;
+        int reclaimFd = -1;
+    };
+
+    static int frozen_(const Group &g);
+    static std::optional<std::uint64_t> memoryCurrent_(const Group &g);
+    static bool swapDisabled_(const Group &g);
+    // MADV_WILLNEED on every mapping of `pid`, returns 0 or the errno of the mapping that failed
+    static int prefetchProcess_(pid_t pid);
+
+    int inotifyFd_;
+    std::vector<Group> groups_;
+};
+
+} // namespace sandbox
+
+
+#endif
@@ -2,41 +2,124 @@
 #define SANDBOX_CGROUP_HANDLER_H
 
 #include <cstddef>
+#include <string>
+#include <vector>
+#include <utility>
+#include <optional>
+#include <cstdint>
+#include <set>
+#include <map>
+#include <filesystem>
+#include <sys/types.h>
 #include <libcgroup.h>
 
 namespace sandbox
 {
 
+class CGroupPool;
+
 void setLibCGroupLoggerLevel(int level = -1);
 
+/*
+ * A cgroup named after a task, right under the group of the process (the root of the hierarchy for libcgroup).
+ *
+ * The native backend works on cgroup v2 directly: the group the process runs in, from /proc/self/cgroup,
+ * is opened once per process and every group file is written with openat/write relative to cached dirfds,
+ * so a systemd service or a user with a delegated subtree keeps its tasks within it. A group can't hand
+ * controllers down while it has processes of its own, so the process moves into a `sandbox-main` leaf
+ * if that's what stops it.
+ * libcgroup is the fallback for hosts without a usable cgroup v2 hierarchy.
+ * Limits set before create() are staged and written when the group is created.
+ */
 class CGroupHandler {
 public:
+    enum class Backend {
+        Auto,       // native if cgroup v2 with memory and pids controllers is mounted, libcgroup otherwise
+        Native,
+        LibCGroup
+    };
+
     CGroupHandler(const char *name, bool owning = true);
     ~CGroupHandler();
 
-    static void libinit();
+    static void libinit(Backend preferred = Backend::Auto);
+    static Backend backend();
+    // the group of the process on the unified hierarchy, under which the native backend creates its groups
+    static const std::filesystem::path& root();
     static void setLibCGroupLoggerLevel(int level);
 
-    void limitMemory(std::size_t bytes);
+    // memory.max and memory.swap.max, `swapBytes` empty for max
+    void limitMemory(std::size_t bytes, std::optional<std::size_t> swapBytes);
     void limitProcesses(std::size_t maxProcesses);
+    // cpuset.cpus, a cpuset list like "0-3,8"
+    void limitCpus(const std::string &cpus);
+    // cpu.max
+    void limitCpuBandwidth(std::uint64_t quotaUs, std::uint64_t periodUs);
+    // cpu.weight, from [1, 10000], 100 is the default
+    void setCpuWeight(unsigned weight);
+    // a line of io.max for one disk, `limits` like "wbps=1048576 riops=100"; the libcgroup backend
+    // writes it to the group's cgroup v2 directory, so only after create()
+    void limitIo(dev_t disk, const std::string &limits);
+    // io.weight, from [1, 10000], 100 is the default; same as limitIo() for libcgroup
+    void setIoWeight(unsigned weight);
+    // the whole disk holding `path` (io.max rejects partitions), empty if there is no block device behind it
+    static std::optional<dev_t> blockDevice(const std::filesystem::path &path);
 
     void addFreezerController();
     void freeze();
     void thaw();
+    // asks memory.reclaim for `bytes`, returns how much memory.current went down; native backend only
+    std::uint64_t reclaimMemory(std::uint64_t bytes);
 
     void create();
     void attach();
     void attachTask(pid_t pid);
+    // O_PATH fd of the cgroup v2 directory, for clone3(CLONE_INTO_CGROUP); -1 if there is none
+    int openDir();
 
     void loadFromKernel();
     void propagateToKernel();
 
     void disown();
 
+    const std::string& name() const;
+
+    // reads a single value file (key is null) or the value of `key` in a flat keyed file like cpu.stat;
+    // native backend only
+    std::optional<std::uint64_t> readStat(const char *file, const char *key = nullptr);
+    // rbytes and wbytes of io.stat summed over devices, empty without the io controller
+    std::optional<std::pair<std::uint64_t, std::uint64_t>> readIoBytes();
+    // makes memory.peak of this handler start over (per open file, kernel 6.12+), false if the kernel can't
+    bool resetPeak();
+    // the value a reused group had when it was handed out ("<file>:<key>", e.g. "cpu.stat:usage_usec"), 0 for a fresh one
+    std::uint64_t baseline(const std::string &stat) const;
+
 private:
+    friend class CGroupPool;
+
     cgroup_controller* getController_(const char* name);
 
+    static int rootFd_();
+    void set_(const char *file, const std::string &value);
+    void writeFile_(const char *file, const std::string &value);
+    std::optional<std::string> readFile_(const char *file);
+    // libcgroup backend: writes a file of the group's cgroup v2 directory, false if it has none
+    bool writeUnified_(const char *file, const std::string &value);
+
+    const bool native_;
+    const std::string name_;
     cgroup* cg_;
+    int dirFd_;
+    // file -> value, written once the group exists
+    std::vector<std::pair<std::string, std::string>> pending_;
+    // files written so far, a pool resets them before the group is reused
+    std::set<std::string> written_;
+    std::map<std::string, std::uint64_t> baseline_;
+    CGroupPool *pool_;
+    // memory.peak opened by resetPeak()
+    int peakFd_;
+    // memory.peak of a reused group that couldn't be reset tells about an earlier task
+    bool stalePeak_;
     bool owning_;
 };
 
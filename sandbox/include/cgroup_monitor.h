@@ -0,0 +1,66 @@
+#ifndef SANDBOX_CGROUP_MONITOR_H
+#define SANDBOX_CGROUP_MONITOR_H
+
+#include <map>
+#include <set>
+#include <optional>
+#include <cstdint>
+#include <sys/types.h>
+
+namespace sandbox
+{
+
+/*
+ * Learns of the exit, OOM kills and emptied cgroups of all tasks of the process from a single
+ * epoll set, without waiting in waitpid.
+ *
+ * The set holds the pidfds of the tasks' watchers and an inotify fd watching the cgroup.events
+ * and memory.events of their groups; the kernel touches those files the moment a group becomes
+ * empty ("populated 0") or the OOM killer strikes in it. A task that had a process OOM killed is
+ * torn down right away instead of running on crippled. Like TimeLimiter, the epoll fd is meant to
+ * be polled by whatever loop waits for the tasks, which then calls dispatch().
+ */
+class CGroupMonitor {
+public:
+    static CGroupMonitor& instance();
+    ~CGroupMonitor();
+
+    // both fds are borrowed and may be -1 (no pidfds, no cgroup v2 group); returns false if there's nothing to watch
+    bool add(pid_t pid, int pidFd, int cgroupDirFd);
+    void remove(pid_t pid);
+    // whether the task is known to be over (its watcher exited or its group is empty)
+    bool exited(pid_t pid) const;
+    // whether the task was torn down after an OOM kill; forgets it
+    bool takeOomKill(pid_t pid);
+
+    int fd() const;
+    // handles the events that are due, doesn't block
+    void dispatch();
+
+private:
+    CGroupMonitor();
+
+    struct Watched {
+        int pidFd = -1;
+        int eventsFd = -1;
+        int memoryEventsFd = -1;
+        int eventsWd = -1;
+        int memoryEventsWd = -1;
+        std::uint64_t oomKills = 0;
+        bool exited = false;
+    };
+
+    void onCGroupEvent_(pid_t pid, Watched &w);
+    static std::optional<std::uint64_t> readKey_(int fd, const char *key);
+
+    int epollFd_;
+    int inotifyFd_;
+    std::map<pid_t, Watched> watched_;
+    std::map<int, pid_t> watches_;
+    std::set<pid_t> oomKilled_;
+};
+
+} // namespace sandbox
+
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef SANDBOX_CGROUP_POOL_H
+#define SANDBOX_CGROUP_POOL_H
+
+#include <cstddef>
+#include <string>
+#include <deque>
+#include <vector>
+#include <memory>
+
+#include "cgroup_handler.h"
+
+namespace sandbox
+{
+
+/*
+ * Leaf cgroups reused across the tasks of a process, so that task churn doesn't cost a
+ * mkdir/rmdir on cgroupfs each. Native cgroup v2 backend only.
+ *
+ * A released group goes back to the pool once cgroup.events reports "populated 0", with the
+ * limits the task had set reset to "max". Counters can't be reset, so a handed out group
+ * records their values as its baseline (see CGroupHandler::baseline); memory.peak is reset
+ * where the kernel allows it.
+ *
+ * Groups are named sandbox-pool-<pid>-<n>; those of processes that are gone are removed the
+ * next time a pool is configured.
+ */
+class CGroupPool {
+public:
+    static CGroupPool& instance();
+
+    // keeps up to `size` idle groups, 0 disables pooling
+    void configure(std::size_t size);
+    bool enabled() const;
+
+    std::unique_ptr<CGroupHandler> acquire();
+    void release(CGroupHandler &handler);
+    // removes the idle groups, call before exit
+    void clear();
+
+private:
+    CGroupPool() = default;
+
+    void collectStale_();
+    void drain_();
+    bool populated_(const std::string &name);
+    bool remove_(const std::string &name);
+
+    std::size_t size_ = 0;
+    std::size_t created_ = 0;
+    std::deque<std::string> idle_;
+    // released, but some processes of the last task may still be exiting
+    std::vector<std::string> draining_;
+    // failed to reset, never handed out again
+    std::vector<std::string> retired_;
+};
+
+} // namespace sandbox
+
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef SANDBOX_CORE_ALLOCATOR_H
+#define SANDBOX_CORE_ALLOCATOR_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <map>
+#include <functional>
+
+namespace sandbox
+{
+
+/*
+ * Hands out whole physical cores to the tasks of the process, for their cpuset.cpus.
+ *
+ * A core comes with all of its SMT siblings. Only CPUs in our own affinity mask are used; the
+ * topology comes from /sys/devices/system/cpu/cpu<N>/topology/thread_siblings_list.
+ *
+ * The other tasks of the process register with share() and keep off the leased cores:
+ *  - a task without a cpuset of its own runs on the CPUs no lease holds; its cpuset is rewritten
+ *    whenever a lease comes or goes, and left alone while there are no leases at all;
+ *  - the CPUs of a task with an explicit cpuset (or pinned to a CPU) are never leased while it
+ *    runs, and leased CPUs are dropped from such a cpuset when the task starts;
+ *  - the last free core is never leased while some task runs on the unleased CPUs alone.
+ * So a leased core runs no other task of this process. Processes outside of it, other sandboxd or
+ * sandbox-batch instances included, don't know about the leases.
+ */
+class CoreAllocator {
+public:
+    // Cores held by a task, or the registration of a task that shares CPUs; given back when the lease goes away.
+    class Lease {
+    public:
+        Lease(CoreAllocator &allocator, std::vector<std::size_t> cores, std::size_t sharer = 0);
+        Lease(Lease &&other) noexcept;
+        Lease(const Lease&) = delete;
+        ~Lease();
+
+        // cpuset list of all CPUs of the cores, e.g. "2,6" or "2-3"; for a sharer, the CPUs it may use
+        // now, empty for any
+        const std::string& cpus() const;
+
+    private:
+        friend class CoreAllocator;
+
+        CoreAllocator *allocator_;
+        std::vector<std::size_t> cores_;
+        std::size_t sharer_;
+        std::string cpus_;
+    };
+
+    static CoreAllocator& instance();
+
+    // throws if fewer than `count` cores are free
+    Lease allocate(std::size_t count);
+    // `cpus` empty follows the unleased CPUs through `update`; otherwise they are kept out of leases.
+    // Throws if none of the CPUs are left
+    Lease share(const std::vector<int> &cpus, std::function<void(const std::string&)> update = nullptr);
+    // how many cores allocate() could hand out now
+    std::size_t freeCores();
+    bool leased(int cpu);
+
+    // "0-2,5" -> {0, 1, 2, 5}
+    static std::vector<int> parseCpuList(const std::string &list);
+    static std::string formatCpuList(std::vector<int> cpus);
+
+private:
+    struct Sharer {
+        std::vector<int> cpus;
+        std::function<void(const std::string&)> update;
+    };
+
+    CoreAllocator();
+
+    void release_(const std::vector<std::size_t> &cores, std::size_t sharer);
+    // the cores allocate() may take, with the lock held
+    std::vector<std::size_t> freeCores_();
+    std::vector<int> unleasedCpus_();
+    // tells the sharers that follow the unleased CPUs about a change
+    void updateSharers_();
+
+    std::mutex mutex_;
+    // CPUs of each core
+    std::vector<std::vector<int>> cores_;
+    std::vector<bool> busy_;
+    std::map<std::size_t, Sharer> sharers_;
+    std::size_t nextSharer_ = 1;
+};
+
+} // namespace sandbox
+
+
+#endif
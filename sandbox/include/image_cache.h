@@ -0,0 +1,67 @@
+#ifndef SANDBOX_IMAGE_CACHE_H
+#define SANDBOX_IMAGE_CACHE_H
+
+#include <cstddef>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <map>
+
+namespace sandbox
+{
+
+/*
+ * Keeps read-only snapshots of fs images, one per image version.
+ *
+ * A version is identified by a fingerprint of the image tree (paths, types, modes,
+ * sizes and mtimes of all entries), so an unchanged image is recognized by a single
+ * metadata walk and its snapshot is reused as is. A new version of an image is built
+ * incrementally from the latest snapshot of the same image: unchanged files are
+ * hardlinked, only changed ones are copied.
+ *
+ * Snapshots are evicted in LRU order once the cache grows beyond the size cap.
+ * Snapshots that are in use by some task are never evicted.
+ *
+ * Layout: <dir>/<fingerprint>/{root/,manifest,source,lock}
+ */
+class ImageCache {
+public:
+    // Holds a snapshot in use; the snapshot can't be evicted while the lease is alive.
+    class Lease {
+    public:
+        Lease(std::filesystem::path root, int lockFd);
+        Lease(Lease &&other) noexcept;
+        Lease(const Lease&) = delete;
+        ~Lease();
+
+        const std::filesystem::path& root() const;
+
+    private:
+        std::filesystem::path root_;
+        int lockFd_;
+    };
+
+    ImageCache(std::filesystem::path dir, std::optional<std::size_t> maxBytes);
+
+    Lease acquire(const std::filesystem::path &image);
+
+private:
+    // relative path -> manifest line
+    using Manifest = std::map<std::string, std::string>;
+
+    static Manifest scan_(const std::filesystem::path &image);
+    static std::string fingerprint_(const Manifest &manifest);
+    static Manifest loadManifest_(const std::filesystem::path &entry);
+
+    std::optional<std::filesystem::path> findBase_(const std::filesystem::path &image);
+    void build_(const std::filesystem::path &image, const Manifest &manifest, const std::filesystem::path &entry);
+    void evict_(const std::filesystem::path &keep);
+
+    std::filesystem::path dir_;
+    std::optional<std::size_t> maxBytes_;
+};
+
+} // namespace sandbox
+
+
+#endif
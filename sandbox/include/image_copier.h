@@ -0,0 +1,86 @@
+#ifndef SANDBOX_IMAGE_COPIER_H
+#define SANDBOX_IMAGE_COPIER_H
+
+#include <cstddef>
+#include <filesystem>
+#include <exception>
+#include <condition_variable>
+#include <mutex>
+#include <deque>
+#include <map>
+#include <vector>
+#include <atomic>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+namespace sandbox
+{
+
+/*
+ * Copies an image tree into a private writable directory using a pool of threads.
+ *
+ * Directories are the unit of work: a worker lists one directory, creates its subdirectories
+ * and queues them for the other workers, then copies the files it found. File data is
+ * reflinked (FICLONE) when the filesystem supports it, otherwise copied in the kernel with
+ * copy_file_range, falling back to read/write across filesystems that reject both.
+ *
+ * Ownership, modes, timestamps, symlinks, device nodes and hardlinks are preserved.
+ */
+class ImageCopier {
+public:
+    struct Stats {
+        std::size_t files = 0;
+        std::size_t dirs = 0;
+        std::size_t links = 0;
+        std::size_t bytesCloned = 0;
+        std::size_t bytesCopied = 0;
+        double seconds = 0;
+    };
+
+    explicit ImageCopier(unsigned threads = 0);
+
+    // copies the contents of `from` into the existing directory `to`
+    Stats copy(const std::filesystem::path &from, const std::filesystem::path &to);
+
+    enum class FileCopyMethod { Clone, CopyFileRange, ReadWrite };
+    // copies the data of a regular file, `to` must not exist
+    static FileCopyMethod copyFile(const std::filesystem::path &from, const std::filesystem::path &to, mode_t mode);
+
+private:
+    struct DirAttrs {
+        std::filesystem::path path;
+        struct stat st;
+    };
+
+    void worker_();
+    void copyDir_(const std::filesystem::path &rel);
+    void copyEntry_(const std::filesystem::path &rel, const struct stat &st);
+    void applyAttrs_(const std::filesystem::path &dst, const struct stat &st);
+
+    const unsigned threads_;
+    std::filesystem::path from_;
+    std::filesystem::path to_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::filesystem::path> queue_;
+    std::size_t busy_ = 0;
+    std::exception_ptr error_;
+
+    // (dev, ino) of a multiply linked source file -> its first copy
+    std::map<std::pair<dev_t, ino_t>, std::filesystem::path> inodes_;
+    // hardlinks whose first copy may not exist yet, created after the walk
+    std::vector<std::pair<std::filesystem::path, std::filesystem::path>> pendingLinks_;
+    // directory attributes are applied last, so that restrictive modes don't block the copy
+    std::vector<DirAttrs> dirs_;
+
+    std::atomic<std::size_t> files_ = 0;
+    std::atomic<std::size_t> bytesCloned_ = 0;
+    std::atomic<std::size_t> bytesCopied_ = 0;
+};
+
+} // namespace sandbox
+
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef SANDBOX_LOOP_IMAGE_H
+#define SANDBOX_LOOP_IMAGE_H
+
+#include <filesystem>
+#include <string>
+
+namespace sandbox
+{
+
+/*
+ * An fs image packed into a single file (squashfs, erofs or ext2/3/4).
+ *
+ * The image is attached read-only to a loop device and mounted nosuid and nodev, once per image
+ * version, under <dir>/.sandbox-images/; every task using the same file shares that mount, its loop
+ * device and its page cache. The directory is bind-mounted onto itself as a private mount first, so
+ * the image mounts don't propagate to the peers of the host's mount tree.
+ *
+ * A mount stays while some lease on it is alive. The last lease to go unmounts it, and mount()
+ * unmounts whatever leases of crashed processes left behind. Tasks that already set up their mount
+ * namespace keep their own copy of the mount, so unmounting never pulls the image from under them.
+ * The loop device is set to autoclear, so it is released when the last mount goes away.
+ *
+ * Layout: <dir>/.sandbox-images/{.lock,<version>/,<version>.lock}
+ */
+class LoopImage {
+public:
+    // Holds a mount in use
+    class Lease {
+    public:
+        Lease(std::filesystem::path root, int lockFd);
+        Lease(Lease &&other) noexcept;
+        Lease(const Lease&) = delete;
+        ~Lease();
+
+        const std::filesystem::path& root() const;
+
+    private:
+        std::filesystem::path root_;
+        int lockFd_;
+    };
+
+    explicit LoopImage(std::filesystem::path image);
+
+    // mounts the image unless it is already mounted
+    Lease mount(const std::filesystem::path &dir);
+
+    static bool isImageFile(const std::filesystem::path &path);
+
+private:
+    std::string detectFsType_();
+    std::string attachLoopDevice_(int &loopFd);
+    std::string mountName_();
+
+    // returns the locked fd of <mountsDir>/.lock, or -1 with errno set
+    static int lockMountsDir_(const std::filesystem::path &mountsDir);
+    static void makePrivate_(const std::filesystem::path &mountsDir);
+    // unmounts and removes the mounts under `mountsDir` nobody holds a lease on, except `keep`
+    static void collect_(const std::filesystem::path &mountsDir, const std::filesystem::path &keep);
+    static void unmount_(const std::filesystem::path &target);
+
+    std::filesystem::path image_;
+};
+
+} // namespace sandbox
+
+
+#endif
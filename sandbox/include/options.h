@@ -0,0 +1,119 @@
+#ifndef SANDBOX_OPTIONS_H
+#define SANDBOX_OPTIONS_H
+
+#include <string>
+#include <vector>
+#include <optional>
+#include <filesystem>
+#include <chrono>
+
+#include "task_constraints.h"
+
+namespace sandbox
+{
+
+// Command line options of a task, shared by the sandbox CLI and the task specs sent to sandboxd.
+struct Options {
+    static constexpr const char* HELP = "" 
+    "Arguments format:"
+    "[options]... -- <executable> <arguments...>\n"
+    "[options]... --zygote <pool size> [--zygote-refill-rate <tasks per second>]\n"
+    "   (runs commands read from stdin, one per line and quoted like a shell's, in prepared sandboxes)\n"
+    "   [--cgroup-pool <size>] (reuse up to <size> idle cgroups across the tasks of --zygote)\n"
+    "Options:\n"
+    "   [-t|--time-limit <seconds>]\n"
+    "   [--cpu-time-limit <seconds> (CPU time of all processes of the task, cgroup v2 only)]\n"
+    "   [-m|--memory-limit <bytes>]\n"
+    "   [--memory-swap <bytes|max> (memory.swap.max along with --memory-limit, 0 by default; freezer --reclaim\n"
+    "       and memory preemption can only drop the page cache of a task that may not swap)]\n"
+    "   [-s|--stack-size <bytes> (8MB by default)]\n"
+    "   [-f|--max-forks <count>]\n"
+    "   [-n|--niceness <value from [-20, 19]>]\n"
+    "   [--cpus <cpuset list, e.g. 0-3,8 | auto[:<cores>] (whole cores with SMT siblings no other task of the process runs on, 1 by default)>]\n"
+    "   [--cpu-max <quota us>[/<period us> (100000 by default)]]\n"
+    "   [--cpu-weight <value from [1, 10000]>]\n"
+    "   [--io-max <rbps|wbps|riops|wiops>=<value>[,...]] (io.max of the disks behind the image, the work dir\n"
+    "       and the mapped files, e.g. wbps=10485760,wiops=100)\n"
+    "   [--io-weight <value from [1, 10000]>]\n"
+    "   [--priority <batch|normal|latency> (normal by default; sandboxd freezes lower classes\n"
+    "       in favour of higher ones while the host is saturated)]\n"
+    "   [--no-freezer]\n"
+    "   [--new-network]\n"
+    "   [--preserve-capabilities]\n"
+    "   [--libcgroup-verbose]\n"
+    "   [--libcgroup] (manage cgroups through libcgroup even if cgroup v2 can be used directly)\n"
+    "   [--watcher-verbose]\n"
+    "   [--audit <path>] (appends resource usage and termination cause of each task as a JSON line)\n"
+    "   [--sample <path> [--sample-interval <ms> (100 by default)]] (appends memory, CPU, I/O and pids\n"
+    "       of the task's cgroup as CSV lines while it runs, cgroup v2 only)\n"
+    "   [-i|--fs-image <dir or squashfs/erofs/ext4 image file> [-a|--add <path-from>:<path-to>[:rw]]...]\n"
+    "   [--image-mode <copy|overlay|overlay-tmpfs> (copy by default, overlay for image files)]\n"
+    "   [--image-cache <dir> [--image-cache-size <bytes>]]\n"
+    "   [--scratch <path> (tmpfs mounted inside the task; without --fs-image the directory must exist,\n"
+    "       it is mounted over in the task's mount namespace only)]\n"
+    "   [--tmpfs-size <bytes>] [--tmpfs-inodes <count>] (caps for --scratch and overlay-tmpfs,\n"
+    "       the tmpfs memory counts towards --memory-limit)\n"
+    "   [-r|--cleanup-fs-image-dir]\n"
+    "   [-w|--work-dir <path>]\n"
+    "   [-u|--uid <uid> (1000 by default)]\n"
+    "   [-g|--gid <gid> (1000 by default)]\n";
+
+    std::string executable;
+    std::vector<std::string> args;
+    std::optional<double> timeLimit;
+    std::optional<double> cpuTimeLimit;
+    std::optional<std::size_t> memoryLimit;
+    // empty for max
+    std::optional<std::size_t> swapLimit = 0;
+    std::size_t stackSize = 8*1024*1024;
+    std::optional<int> niceness;
+    std::optional<std::string> cpus;
+    std::optional<std::size_t> exclusiveCores;
+    std::optional<TaskConstraints::CpuBandwidth> cpuBandwidth;
+    std::optional<unsigned> cpuWeight;
+    std::optional<TaskConstraints::IoLimit> ioMax;
+    std::optional<unsigned> ioWeight;
+    TaskConstraints::Priority priority = TaskConstraints::Priority::Normal;
+    std::optional<std::size_t> maxForks;
+    bool newNetwork = false;
+    bool libcgroupVerbose = false;
+    bool forceLibCGroup = false;
+    bool watcherVerbose = false;
+    bool enableFreezer = true;
+    bool preserveCapabilities = false;
+    bool cleanupImageDir = false;
+    std::optional<std::filesystem::path> fsImage;
+    std::optional<TaskConstraints::ImageMode> imageMode;
+    std::optional<std::filesystem::path> imageCacheDir;
+    std::optional<std::size_t> imageCacheMaxBytes;
+    std::optional<std::filesystem::path> scratchDir;
+    std::optional<std::size_t> tmpfsMaxBytes;
+    std::optional<std::size_t> tmpfsMaxInodes;
+    std::filesystem::path workDir = ".";
+    std::vector<TaskConstraints::FileMapping> fileMapping;
+    uid_t uid = 1000;
+    gid_t gid = 1000;
+    std::optional<std::size_t> zygoteSize;
+    std::optional<double> zygoteRefillRate;
+    std::size_t cgroupPoolSize = 0;
+    std::optional<std::filesystem::path> auditPath;
+    std::optional<std::filesystem::path> sampleFile;
+    std::chrono::milliseconds sampleInterval{100};
+
+    static Options fromSysArgs(int argc, char *argv[]);
+    // makes the paths given relative to `base` absolute, for a process that runs elsewhere;
+    // the working and scratch directories are left alone with an image, they are paths inside of it then
+    void resolvePaths(const std::filesystem::path &base);
+
+    TaskConstraints constraints() const;
+};
+
+// splits a command line into words like a shell without any expansion: whitespace separates words, '...'
+// quotes everything literally, "..." everything but \" and \\, and a backslash outside quotes escapes
+// the next character; throws on an unterminated quote or a trailing backslash
+std::vector<std::string> splitWords(const std::string &line);
+
+} // namespace sandbox
+
+
+#endif
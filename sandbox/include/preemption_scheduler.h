@@ -0,0 +1,91 @@
+#ifndef SANDBOX_PREEMPTION_SCHEDULER_H
+#define SANDBOX_PREEMPTION_SCHEDULER_H
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "task.h"
+
+namespace sandbox
+{
+
+/*
+ * Freezes lower priority tasks while the host is saturated and higher priority ones run.
+ *
+ * The CPUs are saturated when the running (not frozen) tasks keep more CPUs busy than there are,
+ * memory when MemAvailable of the host drops below a floor; the memory of tasks preempted for the
+ * latter is pushed out to swap through memory.reclaim. A task that may not swap (a memory limit
+ * without --memory-swap) only gives up its page cache; once such a preemption frees nothing, the
+ * victim is thawed again unless the CPUs need it frozen, and no more tasks are frozen for memory
+ * until a task comes or goes or MemAvailable recovers. A task's CPU demand is the usage_usec its
+ * cpu.stat gained over the last period while it ran, capped by the CPUs it could use; a new task counts
+ * as one CPU until it is measured. Victims are taken from the lowest class, the most recently added
+ * first, and only ever in favour of a running task of a higher class, never a cancelled one.
+ *
+ * Frozen tasks are thawed, highest class first, once nothing above them runs, or once they fit again
+ * after being frozen for at least a period: with their last measured demand for the CPUs, and with
+ * MemAvailable above the floor by the memory they gave up. A task is never thawed by the decision
+ * that froze it. No task stays frozen longer than the starvation limit at once; it then runs for at
+ * least as long before it can be preempted again. The decisions are made when a task is added or
+ * removed and every period, on the timer behind fd(), which the owner's loop is meant to poll.
+ */
+class PreemptionScheduler {
+public:
+    // `cpus` 0 means the online CPUs, `minAvailableMemory` 0 never preempts for memory
+    PreemptionScheduler(double cpus, std::uint64_t minAvailableMemory, std::chrono::milliseconds maxPreemption);
+    ~PreemptionScheduler();
+
+    // the task must be running and outlive its removal
+    void add(Task &task);
+    void remove(Task &task);
+
+    int fd() const;
+    // measures the tasks and handles starvation limits that are due, doesn't block
+    void dispatch();
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Entry {
+        Task *task;
+        TaskConstraints::Priority priority;
+        // the most CPUs it can keep busy
+        double maxCpus;
+        // how many it kept busy over the last measured period it ran through
+        double cpus;
+        // cpu.stat usage_usec at the start of the current period, empty while frozen or unknown
+        std::optional<std::uint64_t> usageUs;
+        Clock::time_point measuredAt;
+        // set while frozen
+        std::optional<Clock::time_point> preemptedAt;
+        // can't be preempted before this, after being starved
+        Clock::time_point immuneUntil;
+        // bytes reclaimed when it was frozen, they come back when it runs
+        std::uint64_t reclaimed = 0;
+    };
+
+    void measure_();
+    void rebalance_();
+    bool cpuSaturated_(double extraCpus) const;
+    // MemAvailable is below the floor plus `extraBytes`
+    bool memorySaturated_(std::uint64_t extraBytes = 0) const;
+    void preempt_(Entry &e, bool forMemory);
+    void resume_(Entry &e, const char *why);
+    void armTimer_();
+
+    double cpus_;
+    std::uint64_t minAvailableMemory_;
+    // a preemption for memory freed nothing, see above
+    bool reclaimFutile_ = false;
+    std::chrono::milliseconds maxPreemption_;
+    // in the order of addition
+    std::vector<Entry> entries_;
+    Clock::time_point nextPeriod_;
+    int timerFd_;
+};
+
+} // namespace sandbox
+
+
+#endif
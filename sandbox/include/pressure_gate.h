@@ -0,0 +1,81 @@
+#ifndef SANDBOX_PRESSURE_GATE_H
+#define SANDBOX_PRESSURE_GATE_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <optional>
+#include <filesystem>
+#include <poll.h>
+
+namespace sandbox
+{
+
+/*
+ * Limits how many tasks a launcher runs at once by the pressure stall information of the host
+ * (/proc/pressure/<resource>) or of a cgroup (<dir>/<resource>.pressure).
+ *
+ * A PSI trigger is registered for every watched resource, so the kernel reports when tasks stalled
+ * on it for more than the given share of a window. Every such report halves the limit (but never
+ * below one task, so the launcher keeps making progress); every window without one, with the measured
+ * stall share below all thresholds, raises it by an eighth of the maximum. Launches are queued rather
+ * than failed, and a host near thrashing settles at the concurrency it can sustain instead of piling
+ * up more tasks. The owner's loop polls the trigger fds and the window timer directly: the poll
+ * handler of a trigger consumes its report, which is lost when the fds are nested in an epoll set.
+ */
+class PressureGate {
+public:
+    struct Threshold {
+        // cpu, memory or io
+        std::string resource;
+        // of the window, (0, 100]
+        double percent;
+    };
+
+    // `cgroupDir` empty watches the whole host; without CAP_SYS_RESOURCE the window must be a multiple of 2s
+    PressureGate(const std::vector<Threshold> &thresholds, std::chrono::milliseconds window, std::size_t maxTasks,
+        const std::optional<std::filesystem::path> &cgroupDir = std::nullopt);
+    ~PressureGate();
+
+    // how many tasks may run at once now, at least 1
+    std::size_t limit() const;
+    // how long the limit stayed below the maximum in total
+    std::chrono::milliseconds throttledTime() const;
+
+    // the triggers and the window timer, for poll()
+    std::vector<pollfd> pollFds() const;
+    // `polled` is what pollFds() returned, after poll(); doesn't block. A report halves `running`,
+    // the number of tasks running now, which may be well below the limit
+    void dispatch(const pollfd *polled, std::size_t running);
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Source {
+        Threshold threshold;
+        int fd;
+        // "some" total of the previous window, us
+        std::uint64_t stallTotal;
+    };
+
+    std::uint64_t stallTotal_(const Source &s) const;
+    void tick_();
+    void setLimit_(std::size_t limit, const std::string &why);
+
+    std::vector<Source> sources_;
+    std::chrono::milliseconds window_;
+    std::size_t maxTasks_;
+    std::size_t limit_;
+    // a report came in this window
+    bool pressured_ = false;
+    Clock::time_point windowStart_;
+    std::optional<Clock::time_point> throttledSince_;
+    Clock::duration throttledTime_{0};
+    int timerFd_;
+};
+
+} // namespace sandbox
+
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef SANDBOX_REAPER_H
+#define SANDBOX_REAPER_H
+
+#include <filesystem>
+
+namespace sandbox
+{
+
+/*
+ * Deletes task directories in the background.
+ *
+ * A discarded directory is renamed into <dir>/.sandbox-trash, which is instant, and a detached
+ * reaper process with idle I/O priority empties the trash afterwards. The reaper also moves in
+ * the directories of tasks whose sandbox process died without cleaning up (its status file is
+ * still there, but the pid in it is gone).
+ */
+class Reaper {
+public:
+    explicit Reaper(std::filesystem::path dir);
+
+    void discard(const std::filesystem::path &path);
+    // starts a detached reaper process and returns immediately
+    void spawn();
+
+private:
+    void collectCrashed_();
+    void reap_();
+
+    std::filesystem::path dir_;
+    std::filesystem::path trash_;
+};
+
+} // namespace sandbox
+
+
+#endif
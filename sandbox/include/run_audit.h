@@ -1,14 +1,65 @@
 #ifndef SANDBOX_RUN_AUDIT_H
 #define SANDBOX_RUN_AUDIT_H
 
+#include <string>
+#include <optional>
+#include <chrono>
+#include <cstdint>
+
 namespace sandbox
 {
 
+/*
+ * Resource usage of a finished task and what ended it.
+ *
+ * rusage fields cover the watcher and every process it reaped, that is the whole task unless it
+ * was killed from outside. cgroup fields are empty where the backend or the kernel doesn't
+ * provide them; counters of a reused cgroup are relative to when the task got it.
+ */
 class RunAudit {
 public:
+    enum class Termination {
+        Exit,
+        Signal,
+        OomKill,
+        TimeLimit,
+        CpuTimeLimit,
+        PidsLimit       // exited with an error after a fork failed on pids.max
+    };
+
+    static const char* toString(Termination termination);
+
+    // a single line JSON object
+    std::string toJson() const;
+
+    std::string taskId;
+    Termination termination = Termination::Exit;
+    std::optional<int> exitCode;
+    std::optional<int> signal;
+    std::chrono::microseconds wallTime{0};
 
-private:
+    std::chrono::microseconds userTime{0};
+    std::chrono::microseconds systemTime{0};
+    // of the largest process
+    std::uint64_t maxRssBytes = 0;
+    std::uint64_t majorFaults = 0;
+    std::uint64_t minorFaults = 0;
+    std::uint64_t voluntaryContextSwitches = 0;
+    std::uint64_t involuntaryContextSwitches = 0;
 
+    std::optional<std::uint64_t> cgroupCpuUsageUs;
+    std::optional<std::uint64_t> cgroupUserUs;
+    std::optional<std::uint64_t> cgroupSystemUs;
+    std::optional<std::uint64_t> memoryPeakBytes;
+    std::optional<std::uint64_t> ioReadBytes;
+    std::optional<std::uint64_t> ioWriteBytes;
+    std::optional<std::uint64_t> oomKills;
+    std::optional<std::uint64_t> pidsLimitHits;
+    // processes started in the task's pid namespace, the watcher excluded
+    std::optional<std::uint64_t> pidsSpawned;
+    // time spent frozen by a PreemptionScheduler, part of wallTime
+    std::chrono::microseconds preemptedTime{0};
+    std::uint64_t preemptions = 0;
 };
 
 } // namespace sandbox
@@ -0,0 +1,62 @@
+#ifndef SANDBOX_SAMPLER_H
+#define SANDBOX_SAMPLER_H
+
+#include <chrono>
+#include <map>
+#include <array>
+#include <string>
+#include <filesystem>
+#include <sys/types.h>
+
+namespace sandbox
+{
+
+/*
+ * Samples the cgroups of running tasks at a fixed interval into CSV files, one line per sample:
+ *   task,t_us,memory_current,cpu_usage_us,cpu_user_us,cpu_system_us,io_rbytes,io_wbytes,pids_current
+ * t_us counts from the start of sampling; a field is empty if its file is missing (no io controller).
+ *
+ * The cgroup files stay open and are re-read with pread, so a sample costs a few syscalls and no
+ * path lookups. Every task has its own timerfd in a single epoll set, which is meant to be polled
+ * next to the TimeLimiter one. The time spent sampling is measured and reported when a task stops.
+ */
+class Sampler {
+public:
+    static Sampler& instance();
+    ~Sampler();
+
+    // `cgroupDirFd` is borrowed, lines are appended to `output` (with a header if it's empty)
+    void add(pid_t pid, const std::string &taskId, int cgroupDirFd, std::chrono::microseconds interval,
+        const std::filesystem::path &output);
+    // takes a last sample and closes the files
+    void remove(pid_t pid);
+
+    int fd() const;
+    // takes the samples that are due, doesn't block
+    void dispatch();
+
+private:
+    Sampler();
+
+    enum File { MemoryCurrent, CpuStat, IoStat, PidsCurrent, FileCount };
+
+    struct Sampled {
+        std::string taskId;
+        int timerFd;
+        int outFd;
+        std::array<int, FileCount> files;
+        std::chrono::steady_clock::time_point start;
+        std::size_t samples = 0;
+        std::chrono::nanoseconds spent{0};
+    };
+
+    void sample_(Sampled &s);
+
+    int epollFd_;
+    std::map<pid_t, Sampled> sampled_;
+};
+
+} // namespace sandbox
+
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef SANDBOX_STACK_POOL_H
+#define SANDBOX_STACK_POOL_H
+
+#include <cstddef>
+#include <map>
+#include <vector>
+#include <mutex>
+
+namespace sandbox
+{
+
+/*
+ * mmap'd stacks for clone(), with a PROT_NONE guard page below each one, so an overflow
+ * faults instead of running into a neighbouring mapping.
+ *
+ * Stacks are kept by size and reused; a Stack returns to the pool when it goes out of scope.
+ * Children cloned without CLONE_VM run on their own copy of the stack, so it can be returned
+ * as soon as clone() is done. Safe to use from several threads.
+ */
+class StackPool {
+public:
+    class Stack {
+    public:
+        Stack(StackPool &pool, char *base, std::size_t size);
+        Stack(Stack &&other) noexcept;
+        Stack(const Stack&) = delete;
+        ~Stack();
+
+        // the stack grows down, clone() takes its highest address
+        char* top() const;
+
+    private:
+        StackPool *pool_;
+        char *base_;
+        std::size_t size_;
+    };
+
+    static StackPool& instance();
+
+    Stack acquire(std::size_t size);
+
+private:
+    StackPool() = default;
+
+    void release_(char *base, std::size_t size);
+
+    static std::size_t pageSize_();
+
+    std::mutex mutex_;
+    // usable size -> unused stacks (base of the usable area, the guard page is right below)
+    std::map<std::size_t, std::vector<char*>> free_;
+};
+
+} // namespace sandbox
+
+
+#endif
@@ -2,6 +2,7 @@
 #define SANDBOX_STATUS_FILE_H
 
 #include <filesystem>
+#include <string>
 
 namespace sandbox
 {
@@ -12,6 +13,10 @@ public:
     StatusFile(std::filesystem::path path);
     ~StatusFile();
 
+    // adds the task's cgroup, the full path of its directory on the native backend; without it the
+    // group is named after the status file and lies under the root of the hierarchy
+    void recordCGroup(const std::string &name) const;
+
 private:
     std::filesystem::path path_;
 };
@@ -6,11 +6,20 @@
 #include <filesystem>
 #include <memory>
 #include <thread>
+#include <chrono>
+#include <array>
+#include <optional>
+#include <atomic>
+#include <sys/resource.h>
 
 #include "task_constraints.h"
 #include "run_audit.h"
 #include "cgroup_handler.h"
 #include "status_file.h"
+#include "image_cache.h"
+#include "loop_image.h"
+#include "core_allocator.h"
+#include "time_limiter.h"
 
 namespace sandbox
 {
@@ -24,29 +33,94 @@ class Task {
 public:
     Task() = delete;
     Task(std::filesystem::path executable, std::vector<std::string> args, TaskConstraints constraints, bool watcherVerbose=false);
-    virtual ~Task() = default;
+    Task(TaskConstraints constraints, bool watcherVerbose=false);
+    virtual ~Task();
 
     void start();
+    // copies the image or builds its cache snapshot, whatever prepare() would spend long on, in a child
+    // process; returns its pidfd, or -1 if there's nothing slow to do. Call awaitStagedImage() once it
+    // is readable, then prepare() or start() find the work done
+    int stageImage();
+    // reaps the staging child, throws if it failed
+    void awaitStagedImage();
+    // sets up everything but the command: namespaces, cgroup, image, a watcher and the exec child
+    // with its mount namespace, which then waits for the command
+    void prepare();
+    // hands the command to the prepared watcher, returns once it is exec'd; the command gets
+    // `env` as its environment, ours as of now by default
+    void launch(std::filesystem::path executable, std::vector<std::string> args,
+        std::optional<std::vector<std::string>> env = std::nullopt);
+    // stops a prepared task that was never launched
+    void dismiss();
+    std::chrono::microseconds launchLatency() const;
+    // SIGINT first, SIGKILL on the second call; kills a staging child right away
     void cancel();
     int await();
-
+    // like await(), but returns nothing if the task is still running
+    std::optional<int> tryAwait();
+    // the command gets these fds as its stdin, stdout and stderr instead of ours
+    void redirectStdio(int in, int out, int err);
+    // binds the prepared task to a single CPU, its processes inherit the affinity of the watcher
+    void pinToCpu(int cpu);
+    const std::string& id() const;
+    const TaskConstraints& constraints() const;
+    // how many CPUs the task can keep busy at once
+    double cpuParallelism();
+    // usage_usec of the task's cpu.stat, empty if it can't be read
+    std::optional<std::uint64_t> cpuUsage();
+
+    // freezes the running task's cgroup, optionally pushing its memory out to swap; returns the bytes reclaimed
+    std::uint64_t preempt(bool reclaimMemory = false);
+    // thaws a preempted task, its real time limit is extended by the time it spent frozen
+    void resume();
+    bool preempted() const;
+    // cancel() was called
+    bool cancelled() const;
+
+    // resource usage and termination cause, once the task is over
     RunAudit getAudit();
     void cleanupImageDir();
 
 protected:
     void exec_();
-    void unshare_();
     void prepareImage_();
     void startWatcher_();
     void watcher_();
+    // (watcher) waits until the command is there, true if it may have been interrupted since
+    bool awaitCommand_(int signalFd);
+    // (watcher) passes the command on to the exec child, which is set up and waiting for it by then
+    void forwardCommand_();
+    // (exec child)
+    void receiveCommand_();
     void clone_();
     void setNiceness_();
     void limitTime_();
+    // maps the memory shared with the watcher and opens what it needs to enforce the time limits itself
+    void shareLimits_();
+    // (watcher) kills the command once a time limit is exceeded, otherwise arms `timerFd` for the next check;
+    // `overrunUs` is how late the kill was, or how much CPU time past the limit
+    void enforceLimits_(int timerFd, std::chrono::steady_clock::time_point received,
+        std::optional<std::uint64_t> cpuBaselineUs, TimeLimiter::Kill &killed, std::int64_t &overrunUs);
+    // exit, OOM kills and the group going empty are reported through CGroupMonitor
+    void monitor_();
+    void startSampling_();
+    int onExit_(int status, const struct rusage &usage);
+    // `status` is the command's wait status
+    void collectAudit_(int status, const struct rusage &usage, TimeLimiter::Kill kill, bool oomKilled,
+        std::optional<std::uint64_t> pidsSpawned);
     void clearCapabilities_();
     void prepareMntns_();
+    void mountImage_();
+    void mountOverlay_();
+    void mountMappings_();
+    void mountScratch_();
+    std::string tmpfsOptions_(const char *mode);
+    void createMountPoint_(const std::filesystem::path &base, const TaskConstraints::FileMapping &m);
     void prepareProcfs_();
     void prepareUserns_(pid_t pid);
     void configureCGroup_();
+    // io.max and io.weight of the disks behind the image, the work dir and the mappings, once they are known
+    void limitIo_();
     void cleanup_();
 
     static std::string generateTaskId_();
@@ -56,20 +130,50 @@ protected:
 
     std::filesystem::path executable_;
     std::vector<std::string> args_;
+    std::vector<std::string> env_;
     TaskConstraints constraints_;
     std::filesystem::path root_;
+    std::filesystem::path imageSource_;
+    std::optional<ImageCache::Lease> imageLease_;
+    std::optional<LoopImage::Lease> loopLease_;
+    std::filesystem::path overlayDir_;
+    std::vector<TaskConstraints::FileMapping> mappings_;
+    // the staging child and whether it copied the image to root_
+    pid_t stagingPid_ = 0;
+    int stagingFd_ = -1;
+    bool imageStaged_ = false;
 
     std::unique_ptr<CGroupHandler> cgroupHandler_;
+    std::optional<CoreAllocator::Lease> coreLease_;
 
+    // a byte once the user namespace is set up, then the command
     int main2WatcherPipefd_[2];
+    // the command, passed on by the watcher
     int watcher2ExecPipefd_[2];
+    // close-on-exec, its read end gets a byte once the exec child is set up and EOF once the command is exec'd
+    int execPipefd_[2];
+    // close-on-exec, the watcher reports the command's wait status and the pids used through it before exiting
+    int watcher2MainPipefd_[2];
+    std::chrono::microseconds launchLatency_;
+    std::chrono::steady_clock::time_point launchedAt_;
+    std::optional<RunAudit> audit_;
+    std::optional<std::chrono::steady_clock::time_point> preemptedSince_;
+    std::chrono::microseconds preemptedTime_{0};
+    std::uint64_t preemptions_ = 0;
     pid_t initPid_;
     pid_t taskPid_;
+    // pidfd of the watcher, -1 if the kernel has no pidfds
+    int pidFd_;
+    // time the task spent frozen, shared with the watcher, which pushes its real time deadline back by it
+    std::atomic<std::int64_t> *frozenNs_ = nullptr;
+    // cpu.stat of the group, opened before the watcher starts so that it has a copy to check the CPU time limit
+    int cpuStatFd_ = -1;
+    // whether CGroupMonitor reports the exit of the task, otherwise await() has to look every few ms
+    bool monitored_;
+    std::optional<std::array<int, 3>> stdio_;
     const bool watcherVerbose_;
     bool interrupted_;
 
-    std::unique_ptr<std::thread> timeLimitKillerThread_;
-
     friend int impl::execCmd(void*);
     friend int impl::execWatcher(void*);
 };
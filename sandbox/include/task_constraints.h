@@ -5,6 +5,9 @@
 #include <optional>
 #include <filesystem>
 #include <vector>
+#include <string>
+#include <cstdint>
+#include <chrono>
 
 namespace sandbox
 {
@@ -14,37 +17,108 @@ public:
     struct FileMapping {
         std::filesystem::path from;
         std::filesystem::path to;
+        bool writable = false;
+    };
+
+    // cpu.max: the group may run `quotaUs` of CPU time in every `periodUs`
+    struct CpuBandwidth {
+        std::uint64_t quotaUs;
+        std::uint64_t periodUs = 100000;
+    };
+
+    // io.max of every disk behind the task's files, an empty field is unlimited
+    struct IoLimit {
+        std::optional<std::uint64_t> rbps;
+        std::optional<std::uint64_t> wbps;
+        std::optional<std::uint64_t> riops;
+        std::optional<std::uint64_t> wiops;
+    };
+
+    // classes of a PreemptionScheduler, a task may be preempted in favour of a higher one
+    enum class Priority {
+        Batch,
+        Normal,
+        Latency
+    };
+
+    enum class ImageMode {
+        Copy,           // private recursive copy of the image per task
+        Overlay,        // image is a read-only overlayfs lower layer, writes go to an on-disk upper dir
+        OverlayTmpfs    // same as Overlay, but the upper layer lives in a per-task tmpfs
     };
 
     TaskConstraints(
         std::optional<double> maxRealTimeSeconds,
+        std::optional<double> maxCpuTimeSeconds,
         std::optional<std::size_t> maxMemoryBytes, 
+        std::optional<std::size_t> maxSwapBytes,
         std::size_t stackSize,
         std::optional<std::size_t> maxForks,
         std::optional<int> niceness,
+        std::optional<std::string> cpus,
+        std::optional<std::size_t> exclusiveCores,
+        std::optional<CpuBandwidth> cpuBandwidth,
+        std::optional<unsigned> cpuWeight,
+        std::optional<IoLimit> ioMax,
+        std::optional<unsigned> ioWeight,
+        Priority priority,
         bool newNetwork,
         bool freezable,
         bool preserveCapabilities,
         std::optional<std::filesystem::path> fsImage,
+        ImageMode imageMode,
+        std::optional<std::filesystem::path> imageCacheDir,
+        std::optional<std::size_t> imageCacheMaxBytes,
+        std::optional<std::filesystem::path> scratchDir,
+        std::optional<std::size_t> tmpfsMaxBytes,
+        std::optional<std::size_t> tmpfsMaxInodes,
         std::filesystem::path workDir,
         std::vector<FileMapping> fileMapping,
+        std::optional<std::filesystem::path> sampleFile,
+        std::chrono::milliseconds sampleInterval,
         uid_t uid,
         gid_t gid
     );
 
     const std::optional<double> maxRealTimeSeconds;
+    // CPU time of all processes of the task, from its cgroup's cpu.stat
+    const std::optional<double> maxCpuTimeSeconds;
     const std::optional<std::size_t> maxMemoryBytes;
+    // memory.swap.max of a task with maxMemoryBytes, empty for no limit
+    const std::optional<std::size_t> maxSwapBytes;
     const std::size_t stackSize;
     const std::optional<std::size_t> maxForks;
     const std::optional<int> niceness;
+    // cpuset.cpus of the task
+    const std::optional<std::string> cpus;
+    // whole cores (with their SMT siblings) picked by CoreAllocator, not shared with other tasks of the process
+    const std::optional<std::size_t> exclusiveCores;
+    const std::optional<CpuBandwidth> cpuBandwidth;
+    const std::optional<unsigned> cpuWeight;
+    // applied to the disks of the image, the work dir and the mapped files, see CGroupHandler::blockDevice
+    const std::optional<IoLimit> ioMax;
+    // io.weight, from [1, 10000]; only the io.cost or BFQ controllers of a disk honour it
+    const std::optional<unsigned> ioWeight;
+    const Priority priority;
 
     const bool newNetwork;
     const bool freezable;
     const bool preserveCapabilities;
 
     const std::optional<std::filesystem::path> fsImage;
+    const ImageMode imageMode;
+    const std::optional<std::filesystem::path> imageCacheDir;
+    const std::optional<std::size_t> imageCacheMaxBytes;
+    // tmpfs mounted inside the task; its pages are charged to the task's memory cgroup
+    const std::optional<std::filesystem::path> scratchDir;
+    // caps for the scratch tmpfs and the overlay-tmpfs upper layer
+    const std::optional<std::size_t> tmpfsMaxBytes;
+    const std::optional<std::size_t> tmpfsMaxInodes;
     const std::filesystem::path workDir;
     const std::vector<FileMapping> fileMapping;
+    // CSV of periodic cgroup readings, see Sampler
+    const std::optional<std::filesystem::path> sampleFile;
+    const std::chrono::milliseconds sampleInterval;
 
     const uid_t uid;
     const gid_t gid;
@@ -0,0 +1,48 @@
+#ifndef SANDBOX_TASK_POOL_H
+#define SANDBOX_TASK_POOL_H
+
+#include <cstddef>
+#include <optional>
+#include <memory>
+#include <deque>
+#include <chrono>
+
+#include "task.h"
+#include "task_constraints.h"
+
+namespace sandbox
+{
+
+/*
+ * Keeps up to `size` prepared tasks (see Task::prepare) with the same constraints, so that
+ * running a command only costs handing it to a waiting watcher and the exec.
+ *
+ * refill() prepares at most `refillRate` tasks per second on average, so that refilling an
+ * emptied pool doesn't compete with the tasks that were just launched.
+ */
+class TaskPool {
+public:
+    TaskPool(TaskConstraints constraints, std::size_t size, std::optional<double> refillRate, bool watcherVerbose=false);
+    ~TaskPool();
+
+    // takes a prepared task, prepares one right away if the pool is empty
+    std::unique_ptr<Task> acquire();
+    void refill();
+
+    std::size_t idle() const;
+
+private:
+    TaskConstraints constraints_;
+    const std::size_t size_;
+    const std::optional<double> refillRate_;
+    const bool watcherVerbose_;
+
+    std::deque<std::unique_ptr<Task>> idle_;
+    double refillBudget_;
+    std::chrono::steady_clock::time_point lastRefill_;
+};
+
+} // namespace sandbox
+
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef SANDBOX_TIME_LIMITER_H
+#define SANDBOX_TIME_LIMITER_H
+
+#include <chrono>
+#include <map>
+#include <optional>
+#include <cstdint>
+#include <sys/types.h>
+
+namespace sandbox
+{
+
+/*
+ * Enforces real time and CPU time limits of all tasks of the process from a single epoll set.
+ *
+ * Every deadline is a timerfd, paired with a pidfd of the task's watcher, so a deadline is
+ * dropped the moment its task exits and a late kill can never hit a reused pid.
+ * CPU time is read from the usage_usec of the task's cpu.stat. The next check is due when the
+ * rest of the limit could be used up with all of the task's CPUs busy, so checks get more frequent
+ * as the limit approaches, down to one per millisecond.
+ * The epoll fd is meant to be polled by whatever loop waits for the tasks (Task::await, sandboxd),
+ * which then calls dispatch(). The watcher of every task enforces the same limits from its own loop,
+ * so they hold while ours is busy elsewhere; the kills seen here are reported sooner and logged.
+ */
+class TimeLimiter {
+public:
+    enum class Kill {
+        None,
+        RealTime,
+        CpuTime
+    };
+
+    static TimeLimiter& instance();
+    ~TimeLimiter();
+
+    // SIGKILLs the task once `limit` passes, `pidFd` may be -1 where pidfds are not supported
+    void add(pid_t pid, int pidFd, std::chrono::duration<double> limit);
+    // SIGKILLs the task once its cgroup has used `limit` of CPU time from now on; takes over `cpuStatFd`,
+    // `parallelism` is how many CPUs the task can keep busy at once
+    void addCpuLimit(pid_t pid, int pidFd, int cpuStatFd, std::chrono::duration<double> limit, double parallelism);
+    void remove(pid_t pid);
+    // pushes the real time deadline of the task back, for time it couldn't run (frozen)
+    void postpone(pid_t pid, std::chrono::nanoseconds by);
+    // which limit, if any, killed the task; forgets it
+    Kill takeKill(pid_t pid);
+    // usage_usec of a cpu.stat
+    static std::optional<std::uint64_t> readUsage(int cpuStatFd);
+
+    // readable when dispatch() has something to do
+    int fd() const;
+    // kills the tasks whose deadlines have passed and forgets the exited ones, doesn't block
+    void dispatch();
+
+private:
+    TimeLimiter();
+
+    // limits of a task, -1 for fds of limits it doesn't have
+    struct Limits {
+        int pidFd = -1;
+        int timerFd = -1;
+        std::chrono::steady_clock::time_point at;
+        int cpuTimerFd = -1;
+        int cpuStatFd = -1;
+        std::chrono::microseconds cpuLimit{0};
+        std::uint64_t cpuBaselineUs = 0;
+        double parallelism = 1;
+    };
+
+    Limits& limitsOf_(pid_t pid, int pidFd);
+    // a timerfd in the epoll set, reported with `eventData`
+    int newTimer_(std::uint64_t eventData);
+    void kill_(pid_t pid, const Limits &l);
+
+    int epollFd_;
+    std::map<pid_t, Limits> limits_;
+    std::map<pid_t, Kill> killed_;
+};
+
+} // namespace sandbox
+
+
+#endif
@@ -0,0 +1,289 @@
+#include "cgroup_freezer.h"
+#include "exceptions.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <syscall.h>
+#include <cstring>
+#include <map>
+#include <iterator>
+#include <sstream>
+#include <fstream>
+#include <cstdlib>
+
+using namespace std::string_literals;
+
+namespace sandbox
+{
+
+// prefetch() checks memory.current this often, and takes it as settled after so many checks without growth
+static constexpr useconds_t PREFETCH_SETTLE_CHECK_US = 5000;
+static constexpr int PREFETCH_SETTLE_CHECKS = 3;
+
+CGroupFreezer::CGroupFreezer() {
+    inotifyFd_ = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (inotifyFd_ < 0) {
+        throw SandboxError("failed to watch cgroup events: "s + std::strerror(errno));
+    }
+}
+
+CGroupFreezer::~CGroupFreezer() {
+    for (auto &g : groups_) {
+        for (int fd : {g.dirFd, g.freezeFd, g.eventsFd, g.memoryCurrentFd, g.reclaimFd}) {
+            if (fd >= 0) close(fd);
+        }
+    }
+    close(inotifyFd_);
+}
+
+void CGroupFreezer::add(const std::string &name, int dirFd) {
+    Group g{name, dirFd, -1, -1, -1};
+    g.freezeFd = openat(dirFd, "cgroup.freeze", O_WRONLY | O_CLOEXEC);
+    g.eventsFd = openat(dirFd, "cgroup.events", O_RDONLY | O_CLOEXEC);
+    // kernfs notifies the watches of a file, which need a path; the fd of the group stands in for it
+    auto events = "/proc/self/fd/" + std::to_string(dirFd) + "/cgroup.events";
+    if (g.freezeFd >= 0 && g.eventsFd >= 0) {
+        g.wd = inotify_add_watch(inotifyFd_, events.c_str(), IN_MODIFY);
+    }
+    if (g.wd < 0) {
+        auto err = errno;
+        for (int fd : {g.dirFd, g.freezeFd, g.eventsFd}) {
+            if (fd >= 0) close(fd);
+        }
+        throw SandboxError("failed to open cgroup.freeze and cgroup.events of " + name + ": " + std::strerror(err));
+    }
+    g.memoryCurrentFd = openat(dirFd, "memory.current", O_RDONLY | O_CLOEXEC);
+    g.reclaimFd = openat(dirFd, "memory.reclaim", O_WRONLY | O_CLOEXEC);
+    groups_.push_back(g);
+}
+
+std::vector<std::pair<std::string, std::string>> CGroupFreezer::apply(bool frozen, std::chrono::milliseconds timeout) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    std::vector<std::pair<std::string, std::string>> failed;
+    // wd -> index of a group that is not there yet
+    std::map<int, std::size_t> pending;
+    for (std::size_t i = 0; i < groups_.size(); i++) {
+        if (write(groups_[i].freezeFd, frozen ? "1" : "0", 1) != 1) {
+            failed.emplace_back(groups_[i].name, "failed to write cgroup.freeze: "s + std::strerror(errno));
+            continue;
+        }
+        pending[groups_[i].wd] = i;
+    }
+    // the watches are older than the writes, a group is either there already or about to be reported
+    for (auto it = pending.begin(); it != pending.end();) {
+        it = frozen_(groups_[it->second]) == frozen ? pending.erase(it) : std::next(it);
+    }
+    while (!pending.empty()) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        pollfd pfd{inotifyFd_, POLLIN, 0};
+        int res = left.count() > 0 ? poll(&pfd, 1, left.count()) : 0;
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res < 0)
+            throw SandboxError("failed to wait for cgroup events: "s + std::strerror(errno));
+        if (res == 0)
+            break;
+        alignas(inotify_event) char buf[4096];
+        ssize_t len;
+        while ((len = read(inotifyFd_, buf, sizeof(buf))) > 0) {
+            for (char *p = buf; p < buf + len; p += sizeof(inotify_event) + reinterpret_cast<inotify_event*>(p)->len) {
+                auto it = pending.find(reinterpret_cast<inotify_event*>(p)->wd);
+                if (it != pending.end() && frozen_(groups_[it->second]) == frozen) {
+                    pending.erase(it);
+                }
+            }
+        }
+    }
+    for (auto &[wd, i] : pending) {
+        failed.emplace_back(groups_[i].name, frozen ? "not frozen in time" : "not thawed in time");
+    }
+    return failed;
+}
+
+std::vector<CGroupFreezer::MemoryReport> CGroupFreezer::reclaim(std::uint64_t keepBytes) {
+    std::vector<MemoryReport> reports;
+    for (auto &g : groups_) {
+        auto startTime = std::chrono::steady_clock::now();
+        auto &r = reports.emplace_back(MemoryReport{g.name, 0, 0, {}, {}});
+        // a running group would fault its pages straight back in; also covers groups apply() gave up on
+        if (frozen_(g) != 1) {
+            r.error = "not frozen, its memory is left alone";
+            continue;
+        }
+        auto current = memoryCurrent_(g);
+        if (!current || g.reclaimFd < 0) {
+            r.error = "no memory.reclaim (kernel 5.19+ with the memory controller)";
+            continue;
+        }
+        r.before = *current;
+        // a task with --memory-limit can't swap unless it also got --memory-swap
+        if (swapDisabled_(g)) {
+            r.error = "memory.swap.max is 0, only its page cache can be reclaimed (see --memory-swap)";
+        }
+        // EAGAIN means the kernel got less than asked for; ask again while it still makes progress
+        for (int attempt = 0; attempt < 4 && *current > keepBytes; attempt++) {
+            auto request = std::to_string(*current - keepBytes);
+            if (write(g.reclaimFd, request.data(), request.size()) >= 0) {
+                current = memoryCurrent_(g);
+                break;
+            }
+            if (errno != EAGAIN) {
+                r.error = "failed to write memory.reclaim: "s + std::strerror(errno);
+                break;
+            }
+            auto previous = *current;
+            current = memoryCurrent_(g);
+            if (!current || *current >= previous) {
+                break;
+            }
+        }
+        r.after = current.value_or(r.before);
+        r.took = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime);
+    }
+    return reports;
+}
+
+std::vector<CGroupFreezer::MemoryReport> CGroupFreezer::prefetch(std::chrono::milliseconds timeout) {
+    auto startTime = std::chrono::steady_clock::now();
+    std::vector<MemoryReport> reports;
+    // groups whose reads are still coming in
+    std::vector<std::size_t> pending;
+    for (auto &g : groups_) {
+        auto &r = reports.emplace_back(MemoryReport{g.name, 0, 0, {}, {}});
+        auto current = memoryCurrent_(g);
+        if (!current) {
+            r.error = "no memory.current";
+            continue;
+        }
+        r.before = r.after = *current;
+        int procsFd = openat(g.dirFd, "cgroup.procs", O_RDONLY | O_CLOEXEC);
+        if (procsFd < 0) {
+            r.error = "failed to open cgroup.procs: "s + std::strerror(errno);
+            continue;
+        }
+        std::string procs;
+        char buf[4096];
+        for (ssize_t n; (n = read(procsFd, buf, sizeof(buf))) > 0;) {
+            procs.append(buf, n);
+        }
+        close(procsFd);
+        std::stringstream ss(procs);
+        std::size_t failed = 0;
+        int err = 0;
+        for (pid_t pid; ss >> pid;) {
+            if (int res = prefetchProcess_(pid)) {
+                failed++;
+                err = res;
+            }
+        }
+        if (failed) {
+            r.error = std::to_string(failed) + " processes couldn't be advised: " + std::strerror(err);
+        }
+        pending.push_back(reports.size() - 1);
+    }
+    // MADV_WILLNEED only queues the reads. Every group is advised first so that they overlap, then
+    // a group counts as read back once its memory.current stops growing for a few checks in a row
+    auto deadline = startTime + timeout;
+    std::vector<int> quietChecks(reports.size(), 0);
+    while (!pending.empty()) {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline) {
+            for (auto i : pending) {
+                reports[i].error += (reports[i].error.empty() ? "" : "; ") + "memory.current still growing after "s
+                    + std::to_string(timeout.count()) + "ms";
+                reports[i].took = std::chrono::duration_cast<std::chrono::microseconds>(now - startTime);
+            }
+            break;
+        }
+        usleep(PREFETCH_SETTLE_CHECK_US);
+        now = std::chrono::steady_clock::now();
+        std::erase_if(pending, [&](std::size_t i) {
+            auto &r = reports[i];
+            auto current = memoryCurrent_(groups_[i]).value_or(r.after);
+            if (current > r.after) {
+                r.after = current;
+                r.took = std::chrono::duration_cast<std::chrono::microseconds>(now - startTime);
+                quietChecks[i] = 0;
+                return false;
+            }
+            return ++quietChecks[i] >= PREFETCH_SETTLE_CHECKS;
+        });
+    }
+    return reports;
+}
+
+int CGroupFreezer::prefetchProcess_(pid_t pid) {
+    int pidFd = syscall(SYS_pidfd_open, pid, 0);
+    if (pidFd < 0) {
+        // gone in the meantime, nothing to bring back
+        return errno == ESRCH ? 0 : errno;
+    }
+    std::ifstream maps("/proc/" + std::to_string(pid) + "/maps");
+    std::vector<iovec> ranges;
+    std::string line;
+    while (std::getline(maps, line)) {
+        std::uintptr_t start, end;
+        char dash;
+        std::stringstream ls(line);
+        if (!(ls >> std::hex >> start >> dash >> end))
+            continue;
+        // [vvar], [vdso] and [vsyscall] can't be advised, they are never reclaimed either
+        if (line.ends_with("]") && !line.ends_with("[heap]") && !line.ends_with("[stack]"))
+            continue;
+        ranges.push_back({reinterpret_cast<void*>(start), end - start});
+    }
+    int err = 0;
+    // one range at a time, so that a mapping the kernel refuses doesn't cut the rest short
+    for (auto &range : ranges) {
+        if (syscall(SYS_process_madvise, pidFd, &range, 1, MADV_WILLNEED, 0) < 0 && errno != ENOMEM && errno != EINVAL) {
+            err = errno;
+            break;
+        }
+    }
+    close(pidFd);
+    return err;
+}
+
+std::optional<std::uint64_t> CGroupFreezer::memoryCurrent_(const Group &g) {
+    char buf[64];
+    auto n = g.memoryCurrentFd >= 0 ? pread(g.memoryCurrentFd, buf, sizeof(buf) - 1, 0) : -1;
+    if (n <= 0) {
+        return std::nullopt;
+    }
+    buf[n] = '\0';
+    return std::strtoull(buf, nullptr, 10);
+}
+
+bool CGroupFreezer::swapDisabled_(const Group &g) {
+    char buf[64];
+    int fd = openat(g.dirFd, "memory.swap.max", O_RDONLY | O_CLOEXEC);
+    auto n = fd >= 0 ? pread(fd, buf, sizeof(buf) - 1, 0) : -1;
+    if (fd >= 0) close(fd);
+    // no swap controller reads as no file
+    return n > 0 && buf[0] == '0' && (n == 1 || buf[1] == '\n');
+}
+
+std::size_t CGroupFreezer::size() const {
+    return groups_.size();
+}
+
+int CGroupFreezer::frozen_(const Group &g) {
+    char buf[256];
+    auto n = pread(g.eventsFd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) {
+        return -1;
+    }
+    std::stringstream ss(std::string(buf, n));
+    std::string key;
+    int value;
+    while (ss >> key >> value) {
+        if (key == "frozen") return value;
+    }
+    return -1;
+}
+
+} // namespace sandbox
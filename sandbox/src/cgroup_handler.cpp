@@ -1,20 +1,114 @@
 #include "cgroup_handler.h"
+#include "cgroup_pool.h"
 #include "exceptions.h"
 #include "msg.h"
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <cstring>
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+using namespace std::string_literals;
 
 namespace sandbox
 {
 
+static CGroupHandler::Backend activeBackend = CGroupHandler::Backend::Auto;
+static int nativeRootFd = -1;
+static std::filesystem::path nativeRoot;
+
 static void libcgroup_logger_(void *userdata, int level, const char *fmt, va_list ap)
 {
     auto m = impl::Message("(Sandbox) LIBCGROUP: ");
     vfprintf(stderr, fmt, ap);
 }
 
-CGroupHandler::CGroupHandler(const char *name, bool owning) : owning_{owning} {
+static std::string unifiedMountPoint_() {
+    std::ifstream mounts("/proc/self/mounts");
+    std::string device, mountPoint, type, rest;
+    while (mounts >> device >> mountPoint >> type && std::getline(mounts, rest)) {
+        if (type == "cgroup2") {
+            return mountPoint;
+        }
+    }
+    return {};
+}
+
+// the group of this process on the unified hierarchy, "0::<path>" in /proc/self/cgroup; a service
+// or a user with a delegated subtree keeps its tasks within it
+static std::string ownGroup_() {
+    std::ifstream cgroup("/proc/self/cgroup");
+    for (std::string line; std::getline(cgroup, line);) {
+        if (line.starts_with("0::")) {
+            return line.substr(3);
+        }
+    }
+    return "/";
+}
+
+// moves this process into a leaf of the root, which may only hand controllers down without processes of its own
+static bool moveToLeaf_(int rootFd) {
+    if (mkdirat(rootFd, "sandbox-main", 0755) && errno != EEXIST) {
+        return false;
+    }
+    int fd = openat(rootFd, "sandbox-main/cgroup.procs", O_WRONLY | O_CLOEXEC);
+    bool moved = fd >= 0 && write(fd, "0", 1) == 1;
+    auto err = errno;
+    if (fd >= 0) close(fd);
+    errno = err;
+    return moved;
+}
+
+// whether a cgroup v1 hierarchy with the freezer controller is mounted
+static bool v1FreezerMounted_() {
+    std::ifstream mounts("/proc/self/mounts");
+    std::string device, mountPoint, type, options, rest;
+    while (mounts >> device >> mountPoint >> type >> options && std::getline(mounts, rest)) {
+        if (type == "cgroup" && ("," + options + ",").find(",freezer,") != std::string::npos) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// the block device a filesystem without one of its own (btrfs, for one) is mounted from, 0 if none
+static dev_t mountSource_(dev_t anonymous) {
+    std::ifstream mountinfo("/proc/self/mountinfo");
+    auto wanted = std::to_string(major(anonymous)) + ":" + std::to_string(minor(anonymous));
+    // "<id> <parent> <major:minor> <root> <mount point> <options> [<optional>...] - <type> <source> <options>"
+    for (std::string line; std::getline(mountinfo, line);) {
+        std::stringstream ss(line);
+        std::string id, parent, device, word;
+        if (!(ss >> id >> parent >> device) || device != wanted)
+            continue;
+        while (ss >> word && word != "-");
+        std::string type, source;
+        struct stat st;
+        if (ss >> type >> source && !stat(source.c_str(), &st) && S_ISBLK(st.st_mode)) {
+            return st.st_rdev;
+        }
+    }
+    return 0;
+}
+
+CGroupHandler::CGroupHandler(const char *name, bool owning)
+    : native_{(libinit(), activeBackend == Backend::Native)}
+    , name_{name}
+    , cg_{nullptr}
+    , dirFd_{-1}
+    , pool_{nullptr}
+    , peakFd_{-1}
+    , stalePeak_{false}
+    , owning_{owning}
+{
+    if (native_) {
+        return;
+    }
     cg_ = cgroup_new_cgroup(name);
     if (!cg_) {
         throw SandboxError("failed to make new cgroup");
@@ -22,6 +116,21 @@ CGroupHandler::CGroupHandler(const char *name, bool owning) : owning_{owning} {
 }
 
 CGroupHandler::~CGroupHandler() {
+    if (native_) {
+        if (pool_ && owning_) {
+            pool_->release(*this);
+        }
+        if (dirFd_ >= 0) {
+            close(dirFd_);
+        }
+        if (peakFd_ >= 0) {
+            close(peakFd_);
+        }
+        if (owning_ && !pool_ && unlinkat(rootFd_(), name_.c_str(), AT_REMOVEDIR) && errno != ENOENT) {
+            impl::Message() << "Warning: failed to delete cgroup: " << std::strerror(errno);
+        }
+        return;
+    }
     if (owning_ && cg_) {
         if (int ret = cgroup_delete_cgroup(cg_, 0); ret) {
             impl::Message() << "Warning: failed to delete cgroup: " << cgroup_strerror(ret);
@@ -30,20 +139,173 @@ CGroupHandler::~CGroupHandler() {
     }
 }
 
-void CGroupHandler::libinit() {
+void CGroupHandler::libinit(Backend preferred) {
     static bool inited = 0;
     if (inited) return;
+    inited = true;
+    if (preferred != Backend::LibCGroup) {
+        auto root = unifiedMountPoint_();
+        if (auto group = ownGroup_(); !root.empty() && group != "/") {
+            root += group;
+        }
+        std::string controllers;
+        std::getline(std::ifstream(root + "/cgroup.controllers"), controllers);
+        std::stringstream ss(controllers);
+        bool memory = false, pids = false;
+        for (std::string c; ss >> c;) {
+            memory |= c == "memory";
+            pids |= c == "pids";
+        }
+        if (!root.empty() && memory && pids) {
+            nativeRootFd = open(root.c_str(), O_DIRECTORY | O_RDONLY | O_CLOEXEC);
+            if (nativeRootFd >= 0) {
+                nativeRoot = root;
+                activeBackend = Backend::Native;
+                return;
+            }
+        }
+        if (preferred == Backend::Native) {
+            impl::Message() << "Warning: cgroup v2 with memory and pids controllers is not available, falling back to libcgroup";
+        }
+    }
+    activeBackend = Backend::LibCGroup;
     if (int ret = cgroup_init(); ret != 0) {
         impl::Message() << "failed to initialize libcgroup: " << cgroup_strerror(ret);
     }
-    inited = true;
+}
+
+CGroupHandler::Backend CGroupHandler::backend() {
+    return activeBackend;
 }
 
 void CGroupHandler::setLibCGroupLoggerLevel(int level) {
     cgroup_set_logger(libcgroup_logger_, level, NULL);
 }
 
-void CGroupHandler::limitMemory(std::size_t bytes) {
+const std::filesystem::path& CGroupHandler::root() {
+    return nativeRoot;
+}
+
+int CGroupHandler::rootFd_() {
+    return nativeRootFd;
+}
+
+const std::string& CGroupHandler::name() const {
+    return name_;
+}
+
+std::optional<std::string> CGroupHandler::readFile_(const char *file) {
+    if (!native_ || dirFd_ < 0) {
+        return std::nullopt;
+    }
+    bool peak = peakFd_ >= 0 && std::strcmp(file, "memory.peak") == 0;
+    int fd = peak ? peakFd_ : openat(dirFd_, file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return std::nullopt;
+    }
+    char buf[4096];
+    auto n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (!peak) {
+        close(fd);
+    }
+    if (n <= 0) {
+        return std::nullopt;
+    }
+    return std::string(buf, n);
+}
+
+std::optional<std::uint64_t> CGroupHandler::readStat(const char *file, const char *key) {
+    if (stalePeak_ && std::strcmp(file, "memory.peak") == 0) {
+        return std::nullopt;
+    }
+    auto content = readFile_(file);
+    if (!content) {
+        return std::nullopt;
+    }
+    std::stringstream ss(*content);
+    if (!key) {
+        std::uint64_t value;
+        if (ss >> value) return value;
+        return std::nullopt;
+    }
+    std::string k;
+    std::uint64_t value;
+    while (ss >> k >> value) {
+        if (k == key) return value;
+    }
+    return std::nullopt;
+}
+
+std::optional<std::pair<std::uint64_t, std::uint64_t>> CGroupHandler::readIoBytes() {
+    auto content = readFile_("io.stat");
+    if (!content) {
+        return std::nullopt;
+    }
+    // "<major>:<minor> rbytes=1 wbytes=2 rios=3 ..." per device
+    std::pair<std::uint64_t, std::uint64_t> bytes{0, 0};
+    std::stringstream ss(*content);
+    for (std::string word; ss >> word;) {
+        if (word.starts_with("rbytes=")) {
+            bytes.first += std::stoull(word.substr(7));
+        } else if (word.starts_with("wbytes=")) {
+            bytes.second += std::stoull(word.substr(7));
+        }
+    }
+    return bytes;
+}
+
+bool CGroupHandler::resetPeak() {
+    if (!native_ || dirFd_ < 0) {
+        return false;
+    }
+    if (peakFd_ < 0) {
+        peakFd_ = openat(dirFd_, "memory.peak", O_RDWR | O_CLOEXEC);
+    }
+    if (peakFd_ >= 0 && write(peakFd_, "0", 1) == 1) {
+        stalePeak_ = false;
+        return true;
+    }
+    if (peakFd_ >= 0) {
+        close(peakFd_);
+        peakFd_ = -1;
+    }
+    return false;
+}
+
+std::uint64_t CGroupHandler::baseline(const std::string &stat) const {
+    auto it = baseline_.find(stat);
+    return it == baseline_.end() ? 0 : it->second;
+}
+
+void CGroupHandler::set_(const char *file, const std::string &value) {
+    if (dirFd_ >= 0) {
+        writeFile_(file, value);
+    } else {
+        pending_.emplace_back(file, value);
+    }
+}
+
+void CGroupHandler::writeFile_(const char *file, const std::string &value) {
+    int fd = openat(dirFd_, file, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw SandboxError("failed to open " + name_ + "/" + file + ": " + std::strerror(errno));
+    }
+    if (write(fd, value.data(), value.size()) != static_cast<ssize_t>(value.size())) {
+        auto err = errno;
+        close(fd);
+        throw SandboxError("failed to write " + value + " to " + name_ + "/" + file + ": " + std::strerror(err));
+    }
+    close(fd);
+    written_.insert(file);
+}
+
+void CGroupHandler::limitMemory(std::size_t bytes, std::optional<std::size_t> swapBytes) {
+    auto swap = swapBytes ? std::to_string(*swapBytes) : "max";
+    if (native_) {
+        set_("memory.max", std::to_string(bytes));
+        set_("memory.swap.max", swap);
+        return;
+    }
     auto memory = cgroup_add_controller(cg_, "memory");
     if (!memory) {
         throw SandboxError("failed to initialize cgroup controller \"memory\"");
@@ -51,12 +313,16 @@ void CGroupHandler::limitMemory(std::size_t bytes) {
     if (auto ret = cgroup_set_value_uint64(memory, "memory.max", bytes); ret) {
         throw SandboxError("failed to set memory limit: " + cgroup_strerror(ret));
     }
-    if (auto ret = cgroup_set_value_uint64(memory, "memory.swap.max", 0); ret) { // disable swap
-        throw SandboxError("failed to disable swap: " + cgroup_strerror(ret));
+    if (auto ret = cgroup_set_value_string(memory, "memory.swap.max", swap.c_str()); ret) {
+        throw SandboxError("failed to limit swap: " + cgroup_strerror(ret));
     }
 }
 
 void CGroupHandler::limitProcesses(std::size_t maxProcesses) {
+    if (native_) {
+        set_("pids.max", std::to_string(maxProcesses));
+        return;
+    }
     auto pids = cgroup_add_controller(cg_, "pids");
     if (!pids) {
         throw SandboxError("failed to initialize cgroup controller \"pids\"");
@@ -66,13 +332,126 @@ void CGroupHandler::limitProcesses(std::size_t maxProcesses) {
     }
 }
 
+void CGroupHandler::limitCpus(const std::string &cpus) {
+    if (native_) {
+        set_("cpuset.cpus", cpus);
+        return;
+    }
+    auto cpuset = cgroup_add_controller(cg_, "cpuset");
+    if (!cpuset) {
+        throw SandboxError("failed to initialize cgroup controller \"cpuset\"");
+    }
+    if (auto ret = cgroup_set_value_string(cpuset, "cpuset.cpus", cpus.c_str()); ret) {
+        throw SandboxError("failed to set cpuset: " + cgroup_strerror(ret));
+    }
+}
+
+void CGroupHandler::limitCpuBandwidth(std::uint64_t quotaUs, std::uint64_t periodUs) {
+    auto value = std::to_string(quotaUs) + " " + std::to_string(periodUs);
+    if (native_) {
+        set_("cpu.max", value);
+        return;
+    }
+    // cpu.weight may have added the controller already
+    auto cpu = getController_("cpu");
+    if (!cpu) {
+        cpu = cgroup_add_controller(cg_, "cpu");
+    }
+    if (!cpu) {
+        throw SandboxError("failed to initialize cgroup controller \"cpu\"");
+    }
+    if (auto ret = cgroup_set_value_string(cpu, "cpu.max", value.c_str()); ret) {
+        throw SandboxError("failed to set cpu bandwidth limit: " + cgroup_strerror(ret));
+    }
+}
+
+void CGroupHandler::setCpuWeight(unsigned weight) {
+    if (native_) {
+        set_("cpu.weight", std::to_string(weight));
+        return;
+    }
+    auto cpu = getController_("cpu");
+    if (!cpu) {
+        cpu = cgroup_add_controller(cg_, "cpu");
+    }
+    if (!cpu) {
+        throw SandboxError("failed to initialize cgroup controller \"cpu\"");
+    }
+    if (auto ret = cgroup_set_value_uint64(cpu, "cpu.weight", weight); ret) {
+        throw SandboxError("failed to set cpu weight: " + cgroup_strerror(ret));
+    }
+}
+
+void CGroupHandler::limitIo(dev_t disk, const std::string &limits) {
+    auto value = std::to_string(major(disk)) + ":" + std::to_string(minor(disk)) + " " + limits;
+    if (native_) {
+        set_("io.max", value);
+        return;
+    }
+    // io.max takes a line per disk, which libcgroup can't stage for one file
+    if (!writeUnified_("io.max", value)) {
+        throw SandboxError("failed to set io.max: the group has no cgroup v2 directory with the io controller");
+    }
+}
+
+void CGroupHandler::setIoWeight(unsigned weight) {
+    auto value = "default " + std::to_string(weight);
+    if (native_) {
+        set_("io.weight", value);
+        return;
+    }
+    if (!writeUnified_("io.weight", value)) {
+        throw SandboxError("failed to set io.weight: the group has no cgroup v2 directory with the io controller");
+    }
+}
+
+std::optional<dev_t> CGroupHandler::blockDevice(const std::filesystem::path &path) {
+    struct stat st;
+    if (stat(path.c_str(), &st)) {
+        return std::nullopt;
+    }
+    dev_t dev = major(st.st_dev) ? st.st_dev : mountSource_(st.st_dev);
+    if (!dev) {
+        return std::nullopt;
+    }
+    std::error_code ec;
+    auto sys = std::filesystem::canonical("/sys/dev/block/" + std::to_string(major(dev)) + ":" + std::to_string(minor(dev)), ec);
+    if (ec) {
+        return std::nullopt;
+    }
+    if (std::filesystem::exists(sys / "partition")) {
+        // the disk's directory holds the ones of its partitions
+        unsigned maj, min;
+        char colon;
+        if (!(std::ifstream(sys.parent_path() / "dev") >> maj >> colon >> min)) {
+            return std::nullopt;
+        }
+        dev = makedev(maj, min);
+    }
+    return dev;
+}
+
 void CGroupHandler::addFreezerController() {
+    // every non-root cgroup v2 group has cgroup.freeze, the v1 controller is only a fallback for libcgroup
+    if (native_ || !v1FreezerMounted_()) {
+        return;
+    }
     if (!cgroup_add_controller(cg_, "freezer")) {
         throw SandboxError("failed to initialize cgroup controller \"freezer\"");
     }
 }
 
 void CGroupHandler::freeze() {
+    if (native_) {
+        if (dirFd_ < 0) {
+            throw SandboxError("failed to freeze: cgroup is not loaded");
+        }
+        writeFile_("cgroup.freeze", "1");
+        return;
+    }
+    if (writeUnified_("cgroup.freeze", "1")) {
+        return;
+    }
     auto freezeController = getController_("freezer");
     if (!freezeController) {
         throw SandboxError("failed to freeze: freezer controller is not available");
@@ -83,6 +462,16 @@ void CGroupHandler::freeze() {
 }
 
 void CGroupHandler::thaw() {
+    if (native_) {
+        if (dirFd_ < 0) {
+            throw SandboxError("failed to thaw: cgroup is not loaded");
+        }
+        writeFile_("cgroup.freeze", "0");
+        return;
+    }
+    if (writeUnified_("cgroup.freeze", "0")) {
+        return;
+    }
     auto freezeController = getController_("freezer");
     if (!freezeController) {
         throw SandboxError("failed to thaw: freezer controller is not available");
@@ -92,36 +481,140 @@ void CGroupHandler::thaw() {
     }
 }
 
+std::uint64_t CGroupHandler::reclaimMemory(std::uint64_t bytes) {
+    auto before = readStat("memory.current");
+    if (!before || dirFd_ < 0) {
+        return 0;
+    }
+    int fd = openat(dirFd_, "memory.reclaim", O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    // EAGAIN only means that less than `bytes` could be reclaimed
+    auto request = std::to_string(bytes);
+    if (write(fd, request.data(), request.size()) < 0 && errno != EAGAIN) {
+        impl::Message() << "Warning: failed to reclaim memory: " << std::strerror(errno);
+    }
+    close(fd);
+    auto after = readStat("memory.current").value_or(*before);
+    return *before > after ? *before - after : 0;
+}
+
 void CGroupHandler::create() {
+    if (native_) {
+        static bool subtreeEnabled = false;
+        if (!subtreeEnabled) {
+            // once per process, children of the root get the controllers we limit
+            int fd = openat(rootFd_(), "cgroup.subtree_control", O_WRONLY | O_CLOEXEC);
+            std::string controllers = "+memory +pids";
+            bool enabled = fd >= 0 && write(fd, controllers.data(), controllers.size()) >= 0;
+            if (!enabled && fd >= 0 && errno == EBUSY && moveToLeaf_(rootFd_())) {
+                enabled = write(fd, controllers.data(), controllers.size()) >= 0;
+            }
+            if (!enabled) {
+                impl::Message() << "Warning: failed to enable controllers in cgroup.subtree_control: " << std::strerror(errno);
+            }
+            // optional, only the cpu limits of a task need them; one at a time, so that one can't fail the other
+            for (std::string optional : {"+cpu", "+cpuset", "+io"}) {
+                if (fd >= 0) {
+                    [[maybe_unused]] auto res = write(fd, optional.data(), optional.size());
+                }
+            }
+            if (fd >= 0) close(fd);
+            subtreeEnabled = true;
+        }
+        if (mkdirat(rootFd_(), name_.c_str(), 0755)) {
+            throw SandboxError("failed to create cgroup: "s + std::strerror(errno));
+        }
+        loadFromKernel();
+        propagateToKernel();
+        return;
+    }
     if (auto ret = cgroup_create_cgroup(cg_, 0); ret) {
         throw SandboxError("failed to create cgroup: " + cgroup_strerror(ret));
     }
 }
 
 void CGroupHandler::attach() {
+    if (native_) {
+        writeFile_("cgroup.procs", "0");
+        return;
+    }
     if (auto ret = cgroup_attach_task(cg_); ret) {
         throw SandboxError("failed to attach process to cgroup: " + cgroup_strerror(ret));
     }
 }
 
 void CGroupHandler::attachTask(pid_t pid) { 
+    if (native_) {
+        writeFile_("cgroup.procs", std::to_string(pid));
+        return;
+    }
     if (auto ret = cgroup_attach_task_pid(cg_, pid); ret) {
         throw SandboxError("failed to attach process to cgroup: " + cgroup_strerror(ret));
     }
 }
 
+int CGroupHandler::openDir() {
+    if (native_) {
+        return openat(rootFd_(), name_.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    }
+    // libcgroup creates the group right under the root of the unified hierarchy
+    auto root = unifiedMountPoint_();
+    if (root.empty()) {
+        return -1;
+    }
+    auto path = root + "/" + name_;
+    return open(path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+}
+
 void CGroupHandler::loadFromKernel() {
+    if (native_) {
+        if (dirFd_ < 0) {
+            dirFd_ = openat(rootFd_(), name_.c_str(), O_DIRECTORY | O_RDONLY | O_CLOEXEC);
+        }
+        if (dirFd_ < 0) {
+            throw SandboxError("failed to read cgroup data from kernel: "s + std::strerror(errno));
+        }
+        return;
+    }
     if (auto ret = cgroup_get_cgroup(cg_); ret) {
         throw SandboxError("failed to read cgroup data from kernel: " + cgroup_strerror(ret));
     }
 }
 
 void CGroupHandler::propagateToKernel() {
+    if (native_) {
+        for (auto &[file, value] : pending_) {
+            writeFile_(file.c_str(), value);
+        }
+        pending_.clear();
+        return;
+    }
     if (auto ret = cgroup_modify_cgroup(cg_); ret) {
         throw SandboxError("failed to write data into cgroup in kernel: " + cgroup_strerror(ret));
     }
 }
 
+bool CGroupHandler::writeUnified_(const char *file, const std::string &value) {
+    int dirFd = openDir();
+    if (dirFd < 0) {
+        return false;
+    }
+    int fd = openat(dirFd, file, O_WRONLY | O_CLOEXEC);
+    close(dirFd);
+    if (fd < 0) {
+        return false;
+    }
+    bool written = write(fd, value.data(), value.size()) == static_cast<ssize_t>(value.size());
+    auto err = errno;
+    close(fd);
+    if (!written) {
+        throw SandboxError("failed to write "s + file + ": " + std::strerror(err));
+    }
+    return true;
+}
+
 cgroup_controller* CGroupHandler::getController_(const char* name) {
     return cgroup_get_controller(cg_, name);
 }
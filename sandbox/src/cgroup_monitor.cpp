@@ -0,0 +1,192 @@
+#include "cgroup_monitor.h"
+#include "exceptions.h"
+#include "msg.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <syscall.h>
+#include <cstring>
+#include <sstream>
+#include <string>
+
+using namespace std::string_literals;
+
+namespace sandbox
+{
+
+// epoll data of the inotify fd, pidfds carry their pid
+constexpr std::uint64_t inotifyEvent = 0;
+
+CGroupMonitor& CGroupMonitor::instance() {
+    static CGroupMonitor monitor;
+    return monitor;
+}
+
+CGroupMonitor::CGroupMonitor() {
+    epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd_ < 0) {
+        throw SandboxError("failed to create epoll instance: "s + std::strerror(errno));
+    }
+    inotifyFd_ = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = inotifyEvent;
+    if (inotifyFd_ < 0 || epoll_ctl(epollFd_, EPOLL_CTL_ADD, inotifyFd_, &ev)) {
+        throw SandboxError("failed to watch cgroup events: "s + std::strerror(errno));
+    }
+}
+
+CGroupMonitor::~CGroupMonitor() {
+    while (!watched_.empty()) {
+        remove(watched_.begin()->first);
+    }
+    close(inotifyFd_);
+    close(epollFd_);
+}
+
+bool CGroupMonitor::add(pid_t pid, int pidFd, int cgroupDirFd) {
+    Watched w;
+    if (pidFd >= 0) {
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = pid;
+        if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, pidFd, &ev)) {
+            throw SandboxError("failed to watch task: "s + std::strerror(errno));
+        }
+        w.pidFd = pidFd;
+    }
+    if (cgroupDirFd >= 0) {
+        // kernfs notifies the watches of a file, which need a path; the fd of the group stands in for it
+        auto dir = "/proc/self/fd/" + std::to_string(cgroupDirFd) + "/";
+        auto watch = [&](const char *file, int &fd, int &wd) {
+            fd = openat(cgroupDirFd, file, O_RDONLY | O_CLOEXEC);
+            wd = fd >= 0 ? inotify_add_watch(inotifyFd_, (dir + file).c_str(), IN_MODIFY) : -1;
+            if (wd >= 0) {
+                watches_[wd] = pid;
+            }
+        };
+        watch("cgroup.events", w.eventsFd, w.eventsWd);
+        watch("memory.events", w.memoryEventsFd, w.memoryEventsWd);
+        // a pooled group comes with the kills of its previous tasks
+        if (w.memoryEventsFd >= 0) {
+            w.oomKills = readKey_(w.memoryEventsFd, "oom_kill").value_or(0);
+        }
+    }
+    bool watching = w.pidFd >= 0 || w.eventsWd >= 0 || w.memoryEventsWd >= 0;
+    watched_[pid] = w;
+    if (!watching) {
+        remove(pid);
+    }
+    return watching;
+}
+
+void CGroupMonitor::remove(pid_t pid) {
+    auto it = watched_.find(pid);
+    if (it == watched_.end()) {
+        return;
+    }
+    auto &w = it->second;
+    for (int wd : {w.eventsWd, w.memoryEventsWd}) {
+        if (wd >= 0) {
+            inotify_rm_watch(inotifyFd_, wd);
+            watches_.erase(wd);
+        }
+    }
+    for (int fd : {w.eventsFd, w.memoryEventsFd}) {
+        if (fd >= 0) close(fd);
+    }
+    // the pidfd belongs to the task and stays open, it may have left the set already
+    if (w.pidFd >= 0) {
+        epoll_ctl(epollFd_, EPOLL_CTL_DEL, w.pidFd, nullptr);
+    }
+    watched_.erase(it);
+}
+
+bool CGroupMonitor::exited(pid_t pid) const {
+    auto it = watched_.find(pid);
+    return it != watched_.end() && it->second.exited;
+}
+
+bool CGroupMonitor::takeOomKill(pid_t pid) {
+    return oomKilled_.erase(pid);
+}
+
+int CGroupMonitor::fd() const {
+    return epollFd_;
+}
+
+void CGroupMonitor::dispatch() {
+    epoll_event events[64];
+    int n = epoll_wait(epollFd_, events, 64, 0);
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.u64 != inotifyEvent) {
+            auto it = watched_.find(events[i].data.u64);
+            if (it == watched_.end()) {
+                continue;
+            }
+            // a pidfd stays readable once its process is gone, it has nothing more to say
+            epoll_ctl(epollFd_, EPOLL_CTL_DEL, it->second.pidFd, nullptr);
+            it->second.exited = true;
+            continue;
+        }
+        alignas(inotify_event) char buf[4096];
+        std::set<pid_t> touched;
+        ssize_t len;
+        while ((len = read(inotifyFd_, buf, sizeof(buf))) > 0) {
+            for (char *p = buf; p < buf + len; p += sizeof(inotify_event) + reinterpret_cast<inotify_event*>(p)->len) {
+                auto it = watches_.find(reinterpret_cast<inotify_event*>(p)->wd);
+                if (it != watches_.end()) {
+                    touched.insert(it->second);
+                }
+            }
+        }
+        for (pid_t pid : touched) {
+            if (auto it = watched_.find(pid); it != watched_.end()) {
+                onCGroupEvent_(pid, it->second);
+            }
+        }
+    }
+}
+
+void CGroupMonitor::onCGroupEvent_(pid_t pid, Watched &w) {
+    if (w.eventsFd >= 0 && readKey_(w.eventsFd, "populated") == 0) {
+        w.exited = true;
+    }
+    if (w.memoryEventsFd < 0 || w.exited || oomKilled_.contains(pid)) {
+        return;
+    }
+    auto oomKills = readKey_(w.memoryEventsFd, "oom_kill");
+    if (!oomKills || *oomKills <= w.oomKills) {
+        return;
+    }
+    // the watcher is pid 1 of the task's pid namespace, the kernel takes every other process with it
+    int res = w.pidFd >= 0
+        ? syscall(SYS_pidfd_send_signal, w.pidFd, SIGKILL, nullptr, 0)
+        : kill(pid, SIGKILL);
+    if (res) {
+        impl::Message() << "Warning: failed to stop OOM killed task: " << std::strerror(errno);
+        return;
+    }
+    oomKilled_.insert(pid);
+    impl::Message() << "process has exceeded its memory limit (" << *oomKills - w.oomKills << " OOM kills)";
+}
+
+std::optional<std::uint64_t> CGroupMonitor::readKey_(int fd, const char *key) {
+    char buf[1024];
+    auto n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) {
+        return std::nullopt;
+    }
+    std::stringstream ss(std::string(buf, n));
+    std::string k;
+    std::uint64_t value;
+    while (ss >> k >> value) {
+        if (k == key) return value;
+    }
+    return std::nullopt;
+}
+
+} // namespace sandbox
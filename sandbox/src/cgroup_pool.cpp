@@ -0,0 +1,186 @@
+#include "cgroup_pool.h"
+#include "exceptions.h"
+#include "msg.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+using namespace std::string_literals;
+
+namespace sandbox
+{
+
+static const std::string poolPrefix = "sandbox-pool-";
+
+// stats that only grow, recorded when a group is handed out
+static const std::pair<const char*, const char*> baselineStats[] = {
+    {"cpu.stat", "usage_usec"},
+    {"cpu.stat", "user_usec"},
+    {"cpu.stat", "system_usec"},
+    {"memory.events", "oom_kill"},
+    {"memory.events", "max"},
+    {"pids.events", "max"},
+    {"memory.peak", nullptr},
+};
+
+CGroupPool& CGroupPool::instance() {
+    // never destroyed: handlers released during static destruction must still find it
+    static auto pool = new CGroupPool();
+    return *pool;
+}
+
+void CGroupPool::configure(std::size_t size) {
+    CGroupHandler::libinit();
+    if (size && CGroupHandler::backend() != CGroupHandler::Backend::Native) {
+        impl::Message() << "Warning: cgroup pool requires the native cgroup v2 backend, pooling is disabled";
+        return;
+    }
+    size_ = size;
+    if (size_) {
+        collectStale_();
+    }
+}
+
+bool CGroupPool::enabled() const {
+    return size_ > 0;
+}
+
+std::unique_ptr<CGroupHandler> CGroupPool::acquire() {
+    drain_();
+    std::unique_ptr<CGroupHandler> handler;
+    if (!idle_.empty()) {
+        handler = std::make_unique<CGroupHandler>(idle_.front().c_str());
+        idle_.pop_front();
+        handler->loadFromKernel();
+    } else {
+        auto name = poolPrefix + std::to_string(getpid()) + "-" + std::to_string(created_++);
+        handler = std::make_unique<CGroupHandler>(name.c_str());
+        handler->create();
+    }
+    handler->pool_ = this;
+    for (auto &[file, key] : baselineStats) {
+        if (auto value = handler->readStat(file, key)) {
+            handler->baseline_[key ? file + ":"s + key : file] = *value;
+        }
+    }
+    if (auto io = handler->readIoBytes()) {
+        handler->baseline_["io.stat:rbytes"] = io->first;
+        handler->baseline_["io.stat:wbytes"] = io->second;
+    }
+    // a peak is not a counter, it has to start over or it's of no use
+    handler->stalePeak_ = !handler->resetPeak() && handler->baseline("memory.peak") > 0;
+    return handler;
+}
+
+void CGroupPool::release(CGroupHandler &handler) {
+    auto &name = handler.name_;
+    try {
+        for (auto &file : handler.written_) {
+            if (file == "io.max") {
+                // one line per limited disk, each of them goes back to "max"
+                std::stringstream lines(handler.readFile_("io.max").value_or(""));
+                for (std::string disk, rest; lines >> disk && std::getline(lines, rest);) {
+                    handler.writeFile_("io.max", disk + " rbps=max wbps=max riops=max wiops=max");
+                }
+            } else if (file.ends_with(".max")) {
+                handler.writeFile_(file.c_str(), "max");
+            } else if (file == "cpu.weight") {
+                handler.writeFile_(file.c_str(), "100");
+            } else if (file == "io.weight") {
+                handler.writeFile_(file.c_str(), "default 100");
+            } else if (file == "cpuset.cpus") {
+                // empty is the parent's cpuset
+                handler.writeFile_(file.c_str(), "\n");
+            } else if (file == "cgroup.freeze") {
+                handler.writeFile_(file.c_str(), "0");
+            }
+        }
+    } catch (SandboxException &e) {
+        impl::Message() << "Warning: failed to reset cgroup " << name << ", dropping it: " << e.what();
+        if (!remove_(name)) {
+            retired_.push_back(name);
+        }
+        return;
+    }
+    handler.written_.clear();
+    if (idle_.size() + draining_.size() >= size_) {
+        if (!remove_(name)) {
+            draining_.push_back(name);
+        }
+        return;
+    }
+    if (populated_(name)) {
+        draining_.push_back(name);
+    } else {
+        idle_.push_back(name);
+    }
+}
+
+void CGroupPool::clear() {
+    drain_();
+    for (auto &name : idle_) {
+        remove_(name);
+    }
+    idle_.clear();
+    for (auto &name : draining_) {
+        remove_(name);
+    }
+    draining_.clear();
+    for (auto &name : retired_) {
+        remove_(name);
+    }
+    retired_.clear();
+}
+
+void CGroupPool::collectStale_() {
+    std::error_code ec;
+    for (auto &e : std::filesystem::directory_iterator(CGroupHandler::root(), ec)) {
+        auto name = e.path().filename().string();
+        if (!name.starts_with(poolPrefix))
+            continue;
+        pid_t pid = std::atoi(name.c_str() + poolPrefix.size());
+        if (pid > 0 && kill(pid, 0) && errno == ESRCH) {
+            remove_(name);
+        }
+    }
+}
+
+void CGroupPool::drain_() {
+    for (auto it = draining_.begin(); it != draining_.end();) {
+        if (populated_(*it)) {
+            ++it;
+            continue;
+        }
+        if (idle_.size() < size_) {
+            idle_.push_back(*it);
+        } else {
+            remove_(*it);
+        }
+        it = draining_.erase(it);
+    }
+}
+
+bool CGroupPool::populated_(const std::string &name) {
+    std::ifstream events(CGroupHandler::root() / name / "cgroup.events");
+    std::string key;
+    int value;
+    while (events >> key >> value) {
+        if (key == "populated") {
+            return value;
+        }
+    }
+    return false;
+}
+
+bool CGroupPool::remove_(const std::string &name) {
+    if (unlinkat(CGroupHandler::rootFd_(), name.c_str(), AT_REMOVEDIR) && errno != ENOENT) {
+        return false;
+    }
+    return true;
+}
+
+} // namespace sandbox
@@ -0,0 +1,224 @@
+#include "core_allocator.h"
+#include "exceptions.h"
+#include "msg.h"
+
+#include <sched.h>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <map>
+#include <iterator>
+
+using namespace std::string_literals;
+
+namespace sandbox
+{
+
+CoreAllocator::Lease::Lease(CoreAllocator &allocator, std::vector<std::size_t> cores, std::size_t sharer)
+    : allocator_{&allocator}
+    , cores_{std::move(cores)}
+    , sharer_{sharer}
+{
+    std::vector<int> cpus;
+    for (auto core : cores_) {
+        cpus.insert(cpus.end(), allocator_->cores_[core].begin(), allocator_->cores_[core].end());
+    }
+    cpus_ = formatCpuList(cpus);
+}
+
+CoreAllocator::Lease::Lease(Lease &&other) noexcept
+    : allocator_{other.allocator_}
+    , cores_{std::move(other.cores_)}
+    , sharer_{other.sharer_}
+    , cpus_{std::move(other.cpus_)}
+{
+    other.cores_.clear();
+    other.sharer_ = 0;
+}
+
+CoreAllocator::Lease::~Lease() {
+    if (!cores_.empty() || sharer_) {
+        allocator_->release_(cores_, sharer_);
+    }
+}
+
+const std::string& CoreAllocator::Lease::cpus() const {
+    return cpus_;
+}
+
+CoreAllocator& CoreAllocator::instance() {
+    // never destroyed: tasks held in statics release their leases after function-local statics are gone
+    static auto *allocator = new CoreAllocator;
+    return *allocator;
+}
+
+CoreAllocator::CoreAllocator() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+        throw SandboxError("failed to get CPU affinity: "s + std::strerror(errno));
+    }
+    // the lowest sibling identifies a core
+    std::map<int, std::vector<int>> cores;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+        std::string siblings;
+        std::ifstream("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/thread_siblings_list") >> siblings;
+        auto list = parseCpuList(siblings);
+        int first = list.empty() ? cpu : *std::min_element(list.begin(), list.end());
+        cores[first].push_back(cpu);
+    }
+    for (auto &[first, cpus] : cores) {
+        cores_.push_back(std::move(cpus));
+    }
+    busy_.resize(cores_.size());
+}
+
+CoreAllocator::Lease CoreAllocator::allocate(std::size_t count) {
+    std::lock_guard lock(mutex_);
+    auto cores = freeCores_();
+    if (cores.size() < count) {
+        throw SandboxException("not enough free cores: " + std::to_string(count) + " requested, "
+            + std::to_string(cores.size()) + " of " + std::to_string(cores_.size()) + " are free");
+    }
+    cores.resize(count);
+    for (auto core : cores) {
+        busy_[core] = true;
+    }
+    updateSharers_();
+    return Lease(*this, std::move(cores));
+}
+
+CoreAllocator::Lease CoreAllocator::share(const std::vector<int> &cpus, std::function<void(const std::string&)> update) {
+    std::lock_guard lock(mutex_);
+    auto unleased = unleasedCpus_();
+    std::vector<int> usable;
+    if (cpus.empty()) {
+        usable = unleased;
+    } else {
+        std::copy_if(cpus.begin(), cpus.end(), std::back_inserter(usable),
+            [&](int cpu) { return std::find(unleased.begin(), unleased.end(), cpu) != unleased.end(); });
+    }
+    if (usable.empty()) {
+        throw SandboxException("CPUs " + (cpus.empty() ? "of this process" : formatCpuList(cpus)) + " are all held exclusively by other tasks");
+    }
+    auto id = nextSharer_++;
+    sharers_[id] = {cpus, cpus.empty() ? std::move(update) : nullptr};
+    Lease lease(*this, {}, id);
+    // without leases a task that didn't ask for a cpuset keeps its parent's
+    if (!cpus.empty() || std::find(busy_.begin(), busy_.end(), true) != busy_.end()) {
+        lease.cpus_ = formatCpuList(usable);
+    }
+    return lease;
+}
+
+std::size_t CoreAllocator::freeCores() {
+    std::lock_guard lock(mutex_);
+    return freeCores_().size();
+}
+
+bool CoreAllocator::leased(int cpu) {
+    std::lock_guard lock(mutex_);
+    for (std::size_t i = 0; i < cores_.size(); i++) {
+        if (busy_[i] && std::find(cores_[i].begin(), cores_[i].end(), cpu) != cores_[i].end())
+            return true;
+    }
+    return false;
+}
+
+void CoreAllocator::release_(const std::vector<std::size_t> &cores, std::size_t sharer) {
+    std::lock_guard lock(mutex_);
+    sharers_.erase(sharer);
+    for (auto core : cores) {
+        busy_[core] = false;
+    }
+    if (!cores.empty()) {
+        updateSharers_();
+    }
+}
+
+std::vector<std::size_t> CoreAllocator::freeCores_() {
+    std::vector<std::size_t> cores;
+    bool pinned = false, following = false;
+    for (auto &[id, sharer] : sharers_) {
+        (sharer.cpus.empty() ? following : pinned) = true;
+    }
+    std::size_t unleased = 0;
+    for (std::size_t i = 0; i < cores_.size(); i++) {
+        if (busy_[i])
+            continue;
+        unleased++;
+        bool taken = false;
+        for (auto &[id, sharer] : sharers_) {
+            for (int cpu : sharer.cpus) {
+                taken |= std::find(cores_[i].begin(), cores_[i].end(), cpu) != cores_[i].end();
+            }
+        }
+        if (!taken) cores.push_back(i);
+    }
+    // tasks on the unleased CPUs need at least one; cores of pinned tasks are never leased, so they have them
+    if (following && !pinned && cores.size() == unleased && !cores.empty()) {
+        cores.pop_back();
+    }
+    return cores;
+}
+
+std::vector<int> CoreAllocator::unleasedCpus_() {
+    std::vector<int> cpus;
+    for (std::size_t i = 0; i < cores_.size(); i++) {
+        if (!busy_[i]) cpus.insert(cpus.end(), cores_[i].begin(), cores_[i].end());
+    }
+    std::sort(cpus.begin(), cpus.end());
+    return cpus;
+}
+
+void CoreAllocator::updateSharers_() {
+    auto cpus = formatCpuList(unleasedCpus_());
+    for (auto &[id, sharer] : sharers_) {
+        if (!sharer.update)
+            continue;
+        try {
+            sharer.update(cpus);
+        } catch (SandboxException &e) {
+            impl::Message() << "Warning: failed to move a task off the leased cores: " << e.what();
+        }
+    }
+}
+
+std::vector<int> CoreAllocator::parseCpuList(const std::string &list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    for (std::string range; std::getline(ss, range, ',');) {
+        int from, to;
+        char dash;
+        std::stringstream rs(range);
+        if (!(rs >> from))
+            continue;
+        to = from;
+        if (rs >> dash >> to && dash != '-') {
+            to = from;
+        }
+        for (int cpu = from; cpu <= to; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+std::string CoreAllocator::formatCpuList(std::vector<int> cpus) {
+    std::sort(cpus.begin(), cpus.end());
+    std::string list;
+    for (std::size_t i = 0; i < cpus.size();) {
+        auto j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) j++;
+        if (!list.empty()) list += ',';
+        list += std::to_string(cpus[i]);
+        if (j > i) list += '-' + std::to_string(cpus[j]);
+        i = j + 1;
+    }
+    return list;
+}
+
+} // namespace sandbox
@@ -1,41 +1,91 @@
 #include <iostream>
 #include <filesystem>
 #include <fstream>
+#include <chrono>
+#include <sstream>
+#include <vector>
+#include <optional>
+#include <cstdint>
 #include <unistd.h>
 #include <cstring>
 #include <fcntl.h>
 
 #include "exceptions.h"
 #include "cgroup_handler.h"
+#include "cgroup_freezer.h"
 
 using namespace sandbox;
 using namespace std::string_literals;
 
 struct Options {
     static constexpr const char* HELP = "" 
-    "Arguments format: [--thaw] <status file>";
+    "Arguments format: [--thaw [--prefetch]] [--timeout <ms> (1000 by default)] [--reclaim [<bytes to keep> (0 by default)]]\n"
+    "   <status file>...\n"
+    "   (freezes or thaws the tasks of all status files at once;\n"
+    "   --reclaim pushes the memory of frozen tasks out to swap through memory.reclaim, only the page cache\n"
+    "   of tasks with --memory-limit unless they got --memory-swap too,\n"
+    "   --prefetch reads it back in before the tasks are thawed, waiting up to the timeout for it)";
 
-    std::filesystem::path statusFilePath;
+    std::vector<std::filesystem::path> statusFilePaths;
     bool thaw = false;
+    bool prefetch = false;
+    std::optional<std::uint64_t> reclaimKeepBytes;
+    std::chrono::milliseconds timeout{1000};
 
     static Options fromSysArgs(int argc, char *argv[]) {
         Options opts{};
-        if (argc < 2 || argc > 3) {
-            throw SandboxException("expected path to the status file.");
-        }
         for (int i = 1; i < argc; i++) {
             std::string arg(argv[i]);
             if (arg == "--thaw") {
                 opts.thaw = true;
+            } else if (arg == "--prefetch") {
+                opts.prefetch = true;
+            } else if (arg == "--reclaim") {
+                opts.reclaimKeepBytes = 0;
+                std::uint64_t keep;
+                if (i + 1 < argc && (std::stringstream(argv[i + 1]) >> keep)) {
+                    opts.reclaimKeepBytes = keep;
+                    i++;
+                }
+            } else if (arg == "--timeout") {
+                unsigned ms;
+                if (++i >= argc || !(std::stringstream(argv[i]) >> ms)) {
+                    throw SandboxException("--timeout expects a number of milliseconds");
+                }
+                opts.timeout = std::chrono::milliseconds(ms);
             } else {
-                opts.statusFilePath = std::filesystem::path(arg);
+                opts.statusFilePaths.emplace_back(arg);
             }
         }
-        
+        if (opts.statusFilePaths.empty()) {
+            throw SandboxException("expected path to the status file.");
+        }
+        if (opts.thaw ? opts.reclaimKeepBytes.has_value() : opts.prefetch) {
+            throw SandboxException("--reclaim goes with freezing, --prefetch with --thaw");
+        }
         return opts;
     }
 };
 
+// the task's cgroup, the path of its directory if recorded, otherwise named after the status file
+static std::string readCGroupName(const std::filesystem::path &statusFilePath) {
+    std::string cgroupName = statusFilePath.filename();
+    if (!std::filesystem::exists(statusFilePath)) {
+        throw SandboxException("status file doesn't exist");
+    }
+    std::fstream statusFile(statusFilePath, std::ios::in);
+    pid_t taskPid;
+    statusFile >> taskPid;
+    if (statusFile.fail()) {
+        throw SandboxException("no pid in status file");
+    }
+    std::string recorded;
+    if (statusFile >> recorded) {
+        cgroupName = recorded;
+    }
+    return cgroupName;
+}
+
 int main(int argc, char *argv[]) {
     Options opts;
     try{
@@ -45,59 +95,73 @@ int main(int argc, char *argv[]) {
         std::cout << Options::HELP << std::endl;
         return 0;
     }
-    
-    pid_t taskPid;
-    try {
-        if (!std::filesystem::exists(opts.statusFilePath)) {
-            throw SandboxException("status file doesn't exist");
-        }
-        std::fstream statusFile(opts.statusFilePath, std::ios::in);
-        statusFile >> taskPid;
-        if (statusFile.fail()) {
-            throw SandboxException("no pid in status file");
-        }
-    } catch (SandboxException &e) {
-        std::cerr << "Failed to read status file: " << e.what() << std::endl;
-        return 1;
-    }
 
-    try {
-        auto path = "/proc/"s + std::to_string(taskPid) + "/ns/";
-        for (auto &nsfile : std::filesystem::directory_iterator(path)) {
-            auto nsfilepath = nsfile.path();
-            auto filename = nsfilepath.filename();
-            if (filename == "user") 
+    CGroupHandler::libinit();
+    // CGroupHandler::setLibCGroupLoggerLevel(1000);
+
+    auto startTime = std::chrono::steady_clock::now();
+    int failures = 0;
+    CGroupFreezer freezer;
+    for (auto &path : opts.statusFilePaths) {
+        std::string cgroupName;
+        try {
+            cgroupName = readCGroupName(path);
+        } catch (SandboxException &e) {
+            std::cerr << "Failed to read status file " << path << ": " << e.what() << std::endl;
+            failures++;
+            continue;
+        }
+        try {
+            CGroupHandler cg(cgroupName.c_str(), false);
+            // cgroup v2 groups are frozen together, only v1 freezer groups are handled one by one
+            if (int dirFd = cg.openDir(); dirFd >= 0) {
+                freezer.add(cgroupName, dirFd);
                 continue;
-            auto fd = open(nsfilepath.c_str(), O_RDONLY | O_CLOEXEC);
-            if (fd == -1) {
-                throw SandboxException("failed to read namespace link "s + filename.string() + ": "s + std::strerror(errno));
             }
-            if (setns(fd, 0) == -1) {
-                throw SandboxException("failed to join task's "s + filename.string() + " namespace: "s + std::strerror(errno));
+            cg.loadFromKernel();
+            if (opts.thaw) {
+                cg.thaw();
+            } else {
+                cg.freeze();
             }
+            cg.propagateToKernel();
+        } catch (SandboxException &e) {
+            std::cout << "CGroup handler failed for " << cgroupName << ": " << e.what() << std::endl;
+            failures++;
         }
-    } catch (SandboxException &e) {
-        std::cout << "Error: " << e.what() << std::endl;
-        return 1;
     }
 
-    CGroupHandler::libinit();
-    // CGroupHandler::setLibCGroupLoggerLevel(1000);
-
+    auto report = [&](const std::vector<CGroupFreezer::MemoryReport> &reports, const char *verb) {
+        std::uint64_t total = 0;
+        for (auto &r : reports) {
+            if (!r.error.empty()) {
+                std::cout << "CGroup " << r.name << ": " << r.error << std::endl;
+            }
+            auto moved = r.before > r.after ? r.before - r.after : r.after - r.before;
+            total += moved;
+            std::cout << "CGroup " << r.name << ": " << verb << " " << moved << " bytes (memory.current "
+                << r.before << " -> " << r.after << ") in " << r.took.count() << "us" << std::endl;
+        }
+        std::cout << verb << " " << total << " bytes in total" << std::endl;
+    };
     try {
-        auto filename = opts.statusFilePath.filename();
-        CGroupHandler cg(filename.c_str(), false);
-        cg.loadFromKernel();
-        if (opts.thaw) {
-            cg.thaw();
-        } else {
-            cg.freeze();
+        // the pages are read back while the tasks are still frozen, so that they wake up to warm memory
+        if (opts.prefetch) {
+            report(freezer.prefetch(opts.timeout), "Prefetched");
+        }
+        for (auto &[name, error] : freezer.apply(!opts.thaw, opts.timeout)) {
+            std::cout << "CGroup " << name << ": " << error << std::endl;
+            failures++;
         }
-        cg.propagateToKernel();
     } catch (SandboxException &e) {
-        std::cout << "CGroup handler failed: " << e.what() << std::endl;
+        std::cout << "Freezer failed: " << e.what() << std::endl;
         return 1;
     }
-
-    return 0;
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime);
+    std::cout << (opts.thaw ? "Thawed " : "Froze ") << opts.statusFilePaths.size() - failures << " of "
+        << opts.statusFilePaths.size() << " tasks in " << elapsed.count() << "us" << std::endl;
+    if (opts.reclaimKeepBytes) {
+        report(freezer.reclaim(*opts.reclaimKeepBytes), "Reclaimed");
+    }
+    return failures ? 1 : 0;
 }
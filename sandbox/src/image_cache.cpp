@@ -0,0 +1,299 @@
+#include "image_cache.h"
+#include "image_copier.h"
+#include "exceptions.h"
+#include "msg.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <cstring>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <set>
+#include <vector>
+#include <algorithm>
+
+using namespace std::string_literals;
+
+namespace sandbox
+{
+
+ImageCache::Lease::Lease(std::filesystem::path root, int lockFd) : root_{std::move(root)}, lockFd_{lockFd}
+{}
+
+ImageCache::Lease::Lease(Lease &&other) noexcept : root_{std::move(other.root_)}, lockFd_{other.lockFd_} {
+    other.lockFd_ = -1;
+}
+
+ImageCache::Lease::~Lease() {
+    if (lockFd_ >= 0) {
+        close(lockFd_);
+    }
+}
+
+const std::filesystem::path& ImageCache::Lease::root() const {
+    return root_;
+}
+
+ImageCache::ImageCache(std::filesystem::path dir, std::optional<std::size_t> maxBytes)
+    : dir_{std::filesystem::absolute(dir)}
+    , maxBytes_{maxBytes}
+{}
+
+ImageCache::Lease ImageCache::acquire(const std::filesystem::path &image) {
+    auto manifest = scan_(image);
+    auto entry = dir_ / fingerprint_(manifest);
+
+    try {
+        std::filesystem::create_directories(dir_);
+    } catch (std::exception &e) {
+        throw SandboxException("failed to create image cache dir: "s + e.what());
+    }
+    auto cacheLockPath = dir_ / ".lock";
+    int cacheLock = open(cacheLockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (cacheLock < 0 || flock(cacheLock, LOCK_EX)) {
+        auto err = errno;
+        if (cacheLock >= 0) close(cacheLock);
+        throw SandboxError("failed to lock image cache: "s + std::strerror(err));
+    }
+    try {
+        bool built = false;
+        if (!std::filesystem::exists(entry)) {
+            impl::Message() << "Image " << image << " is not cached, building snapshot " << entry.filename() << "...";
+            auto startTime = std::chrono::steady_clock::now();
+            build_(image, manifest, entry);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+            impl::Message() << "Snapshot is ready in " << elapsed.count() << "s";
+            built = true;
+        }
+        auto lockPath = entry / "lock";
+        int lockFd = open(lockPath.c_str(), O_RDWR | O_CLOEXEC);
+        if (lockFd < 0 || flock(lockFd, LOCK_SH)) {
+            auto err = errno;
+            if (lockFd >= 0) close(lockFd);
+            throw SandboxError("failed to lock image snapshot " + entry.string() + ": " + std::strerror(err));
+        }
+        Lease lease{entry / "root", lockFd};
+        // the lock file's mtime is the last use time for LRU eviction
+        if (futimens(lockFd, nullptr)) {
+            impl::Message() << "Warning: failed to update last use time of " << entry << ": " << std::strerror(errno);
+        }
+        if (built) {
+            evict_(entry);
+        }
+        close(cacheLock);
+        return lease;
+    } catch (...) {
+        close(cacheLock);
+        throw;
+    }
+}
+
+ImageCache::Manifest ImageCache::scan_(const std::filesystem::path &image) {
+    Manifest manifest;
+    try {
+        for (auto &e : std::filesystem::recursive_directory_iterator(image)) {
+            struct stat st;
+            if (lstat(e.path().c_str(), &st)) {
+                throw SandboxError("failed to stat " + e.path().string() + ": " + std::strerror(errno));
+            }
+            std::stringstream line;
+            line << std::oct << (st.st_mode & 07777) << std::dec << '\t' << st.st_uid << '\t' << st.st_gid << '\t';
+            if (S_ISDIR(st.st_mode)) {
+                line << 'd';
+            } else if (S_ISREG(st.st_mode)) {
+                line << "f\t" << st.st_size << '\t' << st.st_mtim.tv_sec << '.' << st.st_mtim.tv_nsec;
+            } else if (S_ISLNK(st.st_mode)) {
+                line << "l\t" << std::filesystem::read_symlink(e.path()).string();
+            } else {
+                line << "o\t" << (st.st_mode & S_IFMT) << '\t' << st.st_rdev;
+            }
+            manifest[e.path().lexically_relative(image).string()] = line.str();
+        }
+    } catch (std::filesystem::filesystem_error &e) {
+        throw SandboxException("failed to scan fs image: "s + e.what());
+    }
+    return manifest;
+}
+
+std::string ImageCache::fingerprint_(const Manifest &manifest) {
+    // 64-bit FNV-1a, collisions are not a concern at the scale of a local cache
+    std::uint64_t hash = 14695981039346656037ull;
+    auto feed = [&](const std::string &s) {
+        for (unsigned char c : s) {
+            hash = (hash ^ c) * 1099511628211ull;
+        }
+        hash = (hash ^ '\n') * 1099511628211ull;
+    };
+    for (auto &[path, line] : manifest) {
+        feed(path);
+        feed(line);
+    }
+    std::stringstream ss;
+    ss << std::hex << hash;
+    return ss.str();
+}
+
+ImageCache::Manifest ImageCache::loadManifest_(const std::filesystem::path &entry) {
+    Manifest manifest;
+    std::ifstream in(entry / "manifest");
+    std::string record;
+    while (std::getline(in, record)) {
+        auto tab = record.find('\t');
+        if (tab != std::string::npos) {
+            manifest[record.substr(0, tab)] = record.substr(tab + 1);
+        }
+    }
+    return manifest;
+}
+
+std::optional<std::filesystem::path> ImageCache::findBase_(const std::filesystem::path &image) {
+    auto source = std::filesystem::absolute(image).lexically_normal().string();
+    std::optional<std::filesystem::path> base;
+    std::filesystem::file_time_type baseUsed;
+    for (auto &e : std::filesystem::directory_iterator(dir_)) {
+        if (e.path().filename().string().starts_with("."))
+            continue;
+        std::string entrySource;
+        std::getline(std::ifstream(e.path() / "source"), entrySource);
+        if (entrySource != source)
+            continue;
+        std::error_code ec;
+        auto used = std::filesystem::last_write_time(e.path() / "lock", ec);
+        if (!ec && (!base || used > baseUsed)) {
+            base = e.path();
+            baseUsed = used;
+        }
+    }
+    return base;
+}
+
+void ImageCache::build_(const std::filesystem::path &image, const Manifest &manifest, const std::filesystem::path &entry) {
+    auto tmp = dir_ / (".tmp-" + entry.filename().string());
+    auto base = findBase_(image);
+    auto baseManifest = base ? loadManifest_(*base) : Manifest{};
+    std::size_t linked = 0, copied = 0;
+
+    try {
+        std::filesystem::remove_all(tmp);
+        std::filesystem::create_directories(tmp / "root");
+        // parents precede their children in the ordered manifest
+        for (auto &[rel, line] : manifest) {
+            auto src = image / rel;
+            auto dst = tmp / "root" / rel;
+            struct stat st;
+            if (lstat(src.c_str(), &st)) {
+                throw SandboxError("failed to stat " + src.string() + ": " + std::strerror(errno));
+            }
+            if (S_ISDIR(st.st_mode)) {
+                if (mkdir(dst.c_str(), st.st_mode & 07777))
+                    throw SandboxError("failed to mkdir " + dst.string() + ": " + std::strerror(errno));
+            } else if (S_ISLNK(st.st_mode)) {
+                std::filesystem::create_symlink(std::filesystem::read_symlink(src), dst);
+            } else if (S_ISREG(st.st_mode)) {
+                auto it = baseManifest.find(rel);
+                if (it != baseManifest.end() && it->second == line && !link((*base / "root" / rel).c_str(), dst.c_str())) {
+                    linked++;
+                    continue;
+                }
+                ImageCopier::copyFile(src, dst, st.st_mode & 07777);
+                if (chmod(dst.c_str(), st.st_mode & 07777))
+                    throw SandboxError("failed to chmod " + dst.string() + ": " + std::strerror(errno));
+                struct timespec times[2] = {st.st_atim, st.st_mtim};
+                if (utimensat(AT_FDCWD, dst.c_str(), times, AT_SYMLINK_NOFOLLOW))
+                    throw SandboxError("failed to set mtime of " + dst.string() + ": " + std::strerror(errno));
+                copied++;
+            } else {
+                if (mknod(dst.c_str(), st.st_mode, st.st_rdev))
+                    throw SandboxError("failed to mknod " + dst.string() + ": " + std::strerror(errno));
+            }
+            if (lchown(dst.c_str(), st.st_uid, st.st_gid))
+                throw SandboxError("failed to chown " + dst.string() + ": " + std::strerror(errno));
+        }
+
+        std::ofstream manifestFile(tmp / "manifest");
+        for (auto &[rel, line] : manifest) {
+            manifestFile << rel << '\t' << line << '\n';
+        }
+        std::ofstream(tmp / "source") << std::filesystem::absolute(image).lexically_normal().string() << '\n';
+        std::ofstream(tmp / "lock");
+        std::filesystem::rename(tmp, entry);
+    } catch (SandboxException &e) {
+        std::error_code ec;
+        std::filesystem::remove_all(tmp, ec);
+        throw;
+    } catch (std::exception &e) {
+        std::error_code ec;
+        std::filesystem::remove_all(tmp, ec);
+        throw SandboxException("failed to build image snapshot: "s + e.what());
+    }
+    if (base) {
+        impl::Message() << "Snapshot built from " << base->filename() << ": " << linked << " files reused, " << copied << " copied";
+    }
+}
+
+static std::size_t diskUsage_(const std::vector<std::filesystem::path> &roots) {
+    // snapshots share unchanged files through hardlinks, count each inode once
+    std::set<std::pair<dev_t, ino_t>> seen;
+    std::size_t total = 0;
+    for (auto &root : roots) {
+        std::error_code ec;
+        for (auto it = std::filesystem::recursive_directory_iterator(root, ec); !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+            struct stat st;
+            if (!lstat(it->path().c_str(), &st) && seen.insert({st.st_dev, st.st_ino}).second) {
+                total += st.st_blocks * 512;
+            }
+        }
+    }
+    return total;
+}
+
+void ImageCache::evict_(const std::filesystem::path &keep) {
+    if (!maxBytes_)
+        return;
+    std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::path>> entries;
+    for (auto &e : std::filesystem::directory_iterator(dir_)) {
+        if (e.path().filename().string().starts_with("."))
+            continue;
+        std::error_code ec;
+        auto used = std::filesystem::last_write_time(e.path() / "lock", ec);
+        entries.emplace_back(ec ? std::filesystem::file_time_type::min() : used, e.path());
+    }
+    std::sort(entries.begin(), entries.end());
+
+    auto paths = [&]() {
+        std::vector<std::filesystem::path> result;
+        for (auto &[used, path] : entries) result.push_back(path);
+        return result;
+    };
+    auto usage = diskUsage_(paths());
+    for (auto it = entries.begin(); it != entries.end() && usage > *maxBytes_;) {
+        auto path = it->second;
+        if (path == keep) {
+            ++it;
+            continue;
+        }
+        auto lockPath = path / "lock";
+        int lockFd = open(lockPath.c_str(), O_RDWR | O_CLOEXEC);
+        if (lockFd >= 0 && flock(lockFd, LOCK_EX | LOCK_NB)) {
+            // in use by a running task
+            close(lockFd);
+            ++it;
+            continue;
+        }
+        impl::Message() << "Evicting image snapshot " << path.filename();
+        std::error_code ec;
+        std::filesystem::remove_all(path, ec);
+        if (lockFd >= 0) close(lockFd);
+        if (ec) {
+            impl::Message() << "Warning: failed to evict " << path << ": " << ec.message();
+        }
+        it = entries.erase(it);
+        usage = diskUsage_(paths());
+    }
+}
+
+} // namespace sandbox
@@ -0,0 +1,215 @@
+#include "image_copier.h"
+#include "exceptions.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+
+using namespace std::string_literals;
+
+namespace sandbox
+{
+
+ImageCopier::ImageCopier(unsigned threads)
+    : threads_{threads ? threads : std::max(1u, std::thread::hardware_concurrency())}
+{}
+
+ImageCopier::Stats ImageCopier::copy(const std::filesystem::path &from, const std::filesystem::path &to) {
+    auto startTime = std::chrono::steady_clock::now();
+    from_ = from;
+    to_ = to;
+    queue_ = {""};
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < threads_; i++) {
+        workers.emplace_back(&ImageCopier::worker_, this);
+    }
+    for (auto &w : workers) {
+        w.join();
+    }
+    if (error_) {
+        std::rethrow_exception(error_);
+    }
+
+    for (auto &[first, dst] : pendingLinks_) {
+        if (link(first.c_str(), dst.c_str()))
+            throw SandboxError("failed to link " + dst.string() + " to " + first.string() + ": " + std::strerror(errno));
+    }
+    for (auto &d : dirs_) {
+        applyAttrs_(d.path, d.st);
+    }
+
+    Stats stats;
+    stats.files = files_;
+    stats.dirs = dirs_.size();
+    stats.links = pendingLinks_.size();
+    stats.bytesCloned = bytesCloned_;
+    stats.bytesCopied = bytesCopied_;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    return stats;
+}
+
+void ImageCopier::worker_() {
+    while (true) {
+        std::filesystem::path rel;
+        {
+            std::unique_lock lock(mutex_);
+            cv_.wait(lock, [&] { return !queue_.empty() || busy_ == 0 || error_; });
+            if (error_ || queue_.empty())
+                return;
+            // depth first keeps the queue short and the source directories warm in the dentry cache
+            rel = std::move(queue_.back());
+            queue_.pop_back();
+            busy_++;
+        }
+        try {
+            copyDir_(rel);
+        } catch (...) {
+            std::lock_guard lock(mutex_);
+            if (!error_) {
+                error_ = std::current_exception();
+            }
+        }
+        {
+            std::lock_guard lock(mutex_);
+            busy_--;
+        }
+        cv_.notify_all();
+    }
+}
+
+void ImageCopier::copyDir_(const std::filesystem::path &rel) {
+    std::vector<std::pair<std::filesystem::path, struct stat>> entries;
+    try {
+        for (auto &e : std::filesystem::directory_iterator(from_ / rel)) {
+            auto entryRel = rel / e.path().filename();
+            struct stat st;
+            if (lstat(e.path().c_str(), &st))
+                throw SandboxError("failed to stat " + e.path().string() + ": " + std::strerror(errno));
+            if (!S_ISDIR(st.st_mode)) {
+                entries.emplace_back(entryRel, st);
+                continue;
+            }
+            auto dst = to_ / entryRel;
+            // owner-writable until the walk is over, the real mode is applied in copy()
+            if (mkdir(dst.c_str(), 0700))
+                throw SandboxError("failed to mkdir " + dst.string() + ": " + std::strerror(errno));
+            {
+                std::lock_guard lock(mutex_);
+                dirs_.push_back({dst, st});
+                queue_.push_back(entryRel);
+            }
+            cv_.notify_one();
+        }
+    } catch (std::filesystem::filesystem_error &e) {
+        throw SandboxException("failed to copy fs image: "s + e.what());
+    }
+    for (auto &[entryRel, st] : entries) {
+        copyEntry_(entryRel, st);
+    }
+}
+
+void ImageCopier::copyEntry_(const std::filesystem::path &rel, const struct stat &st) {
+    auto src = from_ / rel;
+    auto dst = to_ / rel;
+    if (S_ISREG(st.st_mode)) {
+        if (st.st_nlink > 1) {
+            std::lock_guard lock(mutex_);
+            auto [it, inserted] = inodes_.try_emplace({st.st_dev, st.st_ino}, dst);
+            if (!inserted) {
+                pendingLinks_.emplace_back(it->second, dst);
+                return;
+            }
+        }
+        auto method = copyFile(src, dst, st.st_mode & 07777);
+        (method == FileCopyMethod::Clone ? bytesCloned_ : bytesCopied_) += st.st_size;
+        files_++;
+    } else if (S_ISLNK(st.st_mode)) {
+        std::vector<char> target(st.st_size + 1);
+        auto len = readlink(src.c_str(), target.data(), target.size());
+        if (len < 0)
+            throw SandboxError("failed to read link " + src.string() + ": " + std::strerror(errno));
+        target[std::min<std::size_t>(len, st.st_size)] = '\0';
+        if (symlink(target.data(), dst.c_str()))
+            throw SandboxError("failed to create symlink " + dst.string() + ": " + std::strerror(errno));
+    } else {
+        if (mknod(dst.c_str(), st.st_mode, st.st_rdev))
+            throw SandboxError("failed to mknod " + dst.string() + ": " + std::strerror(errno));
+    }
+    applyAttrs_(dst, st);
+}
+
+void ImageCopier::applyAttrs_(const std::filesystem::path &dst, const struct stat &st) {
+    // chown goes first, it drops the set-user-ID and set-group-ID bits
+    if (lchown(dst.c_str(), st.st_uid, st.st_gid))
+        throw SandboxError("failed to chown " + dst.string() + ": " + std::strerror(errno));
+    if (!S_ISLNK(st.st_mode) && chmod(dst.c_str(), st.st_mode & 07777))
+        throw SandboxError("failed to chmod " + dst.string() + ": " + std::strerror(errno));
+    struct timespec times[2] = {st.st_atim, st.st_mtim};
+    if (utimensat(AT_FDCWD, dst.c_str(), times, AT_SYMLINK_NOFOLLOW))
+        throw SandboxError("failed to set mtime of " + dst.string() + ": " + std::strerror(errno));
+}
+
+ImageCopier::FileCopyMethod ImageCopier::copyFile(const std::filesystem::path &from, const std::filesystem::path &to, mode_t mode) {
+    int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+        throw SandboxError("failed to open " + from.string() + ": " + std::strerror(errno));
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+    if (out < 0) {
+        close(in);
+        throw SandboxError("failed to create " + to.string() + ": " + std::strerror(errno));
+    }
+    auto fail = [&](const std::string &what) {
+        auto err = errno;
+        close(in);
+        close(out);
+        throw SandboxError("failed to " + what + " " + from.string() + " to " + to.string() + ": " + std::strerror(err));
+    };
+
+    auto method = FileCopyMethod::Clone;
+    if (ioctl(out, FICLONE, in)) {
+        // EXDEV across filesystems, EOPNOTSUPP/EINVAL/ENOTTY where reflinks are not supported
+        method = FileCopyMethod::CopyFileRange;
+        off_t copied = 0;
+        while (true) {
+            auto n = copy_file_range(in, nullptr, out, nullptr, 1 << 30, 0);
+            if (n < 0 && copied == 0 && (errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP || errno == ENOSYS)) {
+                method = FileCopyMethod::ReadWrite;
+                break;
+            }
+            if (n < 0)
+                fail("copy");
+            if (n == 0)
+                break;
+            copied += n;
+        }
+    }
+    if (method == FileCopyMethod::ReadWrite) {
+        std::vector<char> buf(1 << 20);
+        while (true) {
+            auto n = read(in, buf.data(), buf.size());
+            if (n < 0)
+                fail("read");
+            if (n == 0)
+                break;
+            for (ssize_t written = 0; written < n;) {
+                auto w = write(out, buf.data() + written, n - written);
+                if (w < 0)
+                    fail("write");
+                written += w;
+            }
+        }
+    }
+    close(in);
+    if (close(out))
+        throw SandboxError("failed to close " + to.string() + ": " + std::strerror(errno));
+    return method;
+}
+
+} // namespace sandbox
@@ -0,0 +1,255 @@
+#include "loop_image.h"
+#include "exceptions.h"
+#include "msg.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <linux/loop.h>
+#include <cstring>
+#include <cstdint>
+#include <sstream>
+
+using namespace std::string_literals;
+
+namespace sandbox
+{
+
+LoopImage::Lease::Lease(std::filesystem::path root, int lockFd) : root_{std::move(root)}, lockFd_{lockFd}
+{}
+
+LoopImage::Lease::Lease(Lease &&other) noexcept : root_{std::move(other.root_)}, lockFd_{other.lockFd_} {
+    other.lockFd_ = -1;
+}
+
+LoopImage::Lease::~Lease() {
+    if (lockFd_ < 0) {
+        return;
+    }
+    auto mountsDir = root_.parent_path();
+    int dirLock = lockMountsDir_(mountsDir);
+    // exclusive means no other lease is left; the mount points of tasks being set up are leased too
+    if (dirLock >= 0 && !flock(lockFd_, LOCK_EX | LOCK_NB)) {
+        unmount_(root_);
+        unlink((root_.string() + ".lock").c_str());
+    }
+    close(lockFd_);
+    if (dirLock >= 0) close(dirLock);
+}
+
+const std::filesystem::path& LoopImage::Lease::root() const {
+    return root_;
+}
+
+LoopImage::LoopImage(std::filesystem::path image) : image_{std::filesystem::absolute(image)}
+{}
+
+bool LoopImage::isImageFile(const std::filesystem::path &path) {
+    return std::filesystem::is_regular_file(path);
+}
+
+LoopImage::Lease LoopImage::mount(const std::filesystem::path &dir) {
+    auto mountsDir = std::filesystem::absolute(dir) / ".sandbox-images";
+    auto target = mountsDir / mountName_();
+    try {
+        std::filesystem::create_directories(mountsDir);
+    } catch (std::exception &e) {
+        throw SandboxException("failed to create image mount point: "s + e.what());
+    }
+    int dirLock = lockMountsDir_(mountsDir);
+    if (dirLock < 0) {
+        throw SandboxError("failed to lock " + (mountsDir / ".lock").string() + ": " + std::strerror(errno));
+    }
+    try {
+        makePrivate_(mountsDir);
+        collect_(mountsDir, target);
+        if (mkdir(target.c_str(), 0755) && errno != EEXIST) {
+            throw SandboxError("failed to create image mount point " + target.string() + ": " + std::strerror(errno));
+        }
+        auto lockPath = target.string() + ".lock";
+        int lockFd = open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (lockFd < 0 || flock(lockFd, LOCK_SH)) {
+            auto err = errno;
+            if (lockFd >= 0) close(lockFd);
+            throw SandboxError("failed to lock " + lockPath + ": " + std::strerror(err));
+        }
+        Lease lease{target, lockFd};
+        struct stat targetSt, dirSt;
+        if (stat(target.c_str(), &targetSt) || stat(mountsDir.c_str(), &dirSt)) {
+            throw SandboxError("failed to stat " + target.string() + ": " + std::strerror(errno));
+        }
+        // otherwise mounted by an earlier task
+        if (targetSt.st_dev == dirSt.st_dev) {
+            auto fsType = detectFsType_();
+            int loopFd;
+            auto device = attachLoopDevice_(loopFd);
+            // not noexec, the image is the task's root
+            if (::mount(device.c_str(), target.c_str(), fsType.c_str(), MS_RDONLY | MS_NOSUID | MS_NODEV, nullptr)) {
+                auto err = errno;
+                // the device is autocleared once its last fd is closed
+                close(loopFd);
+                throw SandboxError("failed to mount " + image_.string() + " (" + fsType + ") at " + target.string() + ": " + std::strerror(err));
+            }
+            close(loopFd);
+            impl::Message() << "Mounted " << image_ << " (" << fsType << ") at " << target << " via " << device;
+        }
+        close(dirLock);
+        return lease;
+    } catch (...) {
+        close(dirLock);
+        throw;
+    }
+}
+
+int LoopImage::lockMountsDir_(const std::filesystem::path &mountsDir) {
+    auto lockPath = mountsDir / ".lock";
+    int lockFd = open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lockFd >= 0 && flock(lockFd, LOCK_EX)) {
+        auto err = errno;
+        close(lockFd);
+        errno = err;
+        return -1;
+    }
+    return lockFd;
+}
+
+void LoopImage::makePrivate_(const std::filesystem::path &mountsDir) {
+    struct statx st;
+    if (statx(AT_FDCWD, mountsDir.c_str(), 0, 0, &st)) {
+        throw SandboxError("failed to stat " + mountsDir.string() + ": " + std::strerror(errno));
+    }
+    if (!(st.stx_attributes_mask & STATX_ATTR_MOUNT_ROOT)) {
+        throw SandboxError("can't tell whether " + mountsDir.string() + " is a mount point (kernel 5.8+ needed)");
+    }
+    if (st.stx_attributes & STATX_ATTR_MOUNT_ROOT) {
+        return;
+    }
+    if (::mount(mountsDir.c_str(), mountsDir.c_str(), nullptr, MS_BIND, nullptr)
+            || ::mount(nullptr, mountsDir.c_str(), nullptr, MS_PRIVATE, nullptr)) {
+        throw SandboxError("failed to make " + mountsDir.string() + " a private mount: " + std::strerror(errno));
+    }
+}
+
+void LoopImage::collect_(const std::filesystem::path &mountsDir, const std::filesystem::path &keep) {
+    std::error_code ec;
+    for (auto &e : std::filesystem::directory_iterator(mountsDir, ec)) {
+        if (e.path() == keep || !e.is_directory(ec))
+            continue;
+        auto lockPath = e.path().string() + ".lock";
+        int lockFd = open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (lockFd < 0)
+            continue;
+        if (!flock(lockFd, LOCK_EX | LOCK_NB)) {
+            unmount_(e.path());
+            unlink(lockPath.c_str());
+        }
+        close(lockFd);
+    }
+}
+
+void LoopImage::unmount_(const std::filesystem::path &target) {
+    // tasks that already have their own copy of the mount keep it
+    if (umount2(target.c_str(), MNT_DETACH) && errno != EINVAL) {
+        impl::Message() << "Warning: failed to unmount image at " << target << ": " << std::strerror(errno);
+        return;
+    }
+    if (rmdir(target.c_str()) && errno != ENOENT) {
+        impl::Message() << "Warning: failed to remove image mount point " << target << ": " << std::strerror(errno);
+    }
+}
+
+std::string LoopImage::detectFsType_() {
+    int fd = open(image_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw SandboxError("failed to open " + image_.string() + ": " + std::strerror(errno));
+    }
+    unsigned char sb[2048] = {};
+    auto n = pread(fd, sb, sizeof(sb), 0);
+    close(fd);
+    if (n < 0) {
+        throw SandboxError("failed to read " + image_.string() + ": " + std::strerror(errno));
+    }
+    auto le = [&](std::size_t offset, std::size_t bytes) {
+        std::uint32_t v = 0;
+        for (std::size_t i = 0; i < bytes; i++) {
+            v |= std::uint32_t(sb[offset + i]) << (8 * i);
+        }
+        return v;
+    };
+    if (!std::memcmp(sb, "hsqs", 4))
+        return "squashfs";
+    if (le(1024, 4) == 0xE0F5E1E2)
+        return "erofs";
+    if (le(1024 + 56, 2) == 0xEF53)
+        return "ext4";
+    throw SandboxException(image_.string() + " is not a squashfs, erofs or ext2/3/4 image");
+}
+
+std::string LoopImage::attachLoopDevice_(int &loopFd) {
+    int ctl = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+    if (ctl < 0) {
+        throw SandboxError("failed to open /dev/loop-control: "s + std::strerror(errno));
+    }
+    int imageFd = open(image_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (imageFd < 0) {
+        close(ctl);
+        throw SandboxError("failed to open " + image_.string() + ": " + std::strerror(errno));
+    }
+    auto fail = [&](const std::string &what) {
+        auto err = errno;
+        close(imageFd);
+        close(ctl);
+        throw SandboxError(what + ": " + std::strerror(err));
+    };
+    // a free device may be taken by someone else before we bind it, retry with the next one
+    for (int attempt = 0; attempt < 16; attempt++) {
+        int n = ioctl(ctl, LOOP_CTL_GET_FREE);
+        if (n < 0)
+            fail("failed to find a free loop device");
+        auto device = "/dev/loop" + std::to_string(n);
+        loopFd = open(device.c_str(), O_RDWR | O_CLOEXEC);
+        if (loopFd < 0)
+            fail("failed to open " + device);
+        if (ioctl(loopFd, LOOP_SET_FD, imageFd)) {
+            auto err = errno;
+            close(loopFd);
+            if (err == EBUSY)
+                continue;
+            errno = err;
+            fail("failed to attach " + image_.string() + " to " + device);
+        }
+        struct loop_info64 info = {};
+        std::strncpy(reinterpret_cast<char*>(info.lo_file_name), image_.c_str(), LO_NAME_SIZE - 1);
+        info.lo_flags = LO_FLAGS_READ_ONLY | LO_FLAGS_AUTOCLEAR;
+        if (ioctl(loopFd, LOOP_SET_STATUS64, &info)) {
+            auto err = errno;
+            ioctl(loopFd, LOOP_CLR_FD, 0);
+            close(loopFd);
+            errno = err;
+            fail("failed to configure " + device);
+        }
+        close(imageFd);
+        close(ctl);
+        return device;
+    }
+    errno = EBUSY;
+    fail("failed to attach " + image_.string() + " to a loop device");
+    return {};
+}
+
+std::string LoopImage::mountName_() {
+    // a new version of the file gets its own mount, tasks still running on the old one keep it
+    struct stat st;
+    if (stat(image_.c_str(), &st)) {
+        throw SandboxError("failed to stat " + image_.string() + ": " + std::strerror(errno));
+    }
+    std::stringstream ss;
+    ss << image_.filename().string() << '-' << std::hex << st.st_dev << '-' << st.st_ino << '-' << st.st_size
+       << '-' << st.st_mtim.tv_sec << '.' << st.st_mtim.tv_nsec;
+    return ss.str();
+}
+
+} // namespace sandbox
@@ -0,0 +1,399 @@
+#include "options.h"
+#include "loop_image.h"
+#include "exceptions.h"
+
+#include <sstream>
+
+namespace sandbox
+{
+
+Options Options::fromSysArgs(int argc, char *argv[]) {
+    Options opts{};
+    int i = 1;
+    while (i < argc) {
+        std::string arg(argv[i]);
+        i++;
+        if (arg == "--") break;
+        // todo parse contraints
+        if (arg == "--new-network") {
+            opts.newNetwork = true;
+            continue;
+        }
+        if (arg == "--libcgroup-verbose") {
+            opts.libcgroupVerbose = true;
+            continue;
+        }
+        if (arg == "--libcgroup") {
+            opts.forceLibCGroup = true;
+            continue;
+        }
+        if (arg == "--watcher-verbose") {
+            opts.watcherVerbose = true;
+            continue;
+        }
+        if (arg == "--no-freezer") {
+            opts.enableFreezer = false;
+            continue;
+        }
+        if (arg == "--preserve-capabilities") {
+            opts.preserveCapabilities = true;
+            continue;
+        }
+        if (arg == "-r" || arg == "--cleanup-fs-image-dir") {
+            opts.cleanupImageDir = true;
+            continue;
+        }
+        if (i >= argc) {
+            throw SandboxException(arg + " option without an argument");
+        }
+        std::stringstream data(argv[i++]);
+        auto onReadFail = [&](std::string expected) {
+            if (data.fail()) {
+                throw SandboxException(arg + " option expects " + expected);
+            }
+        };
+        if (arg == "-t" || arg == "--time-limit") {
+            double limit;
+            data >> limit;
+            onReadFail("a numeric argument (whole number of seconds)");
+            opts.timeLimit = limit;
+        } else if (arg == "--cpu-time-limit") {
+            double limit;
+            data >> limit;
+            onReadFail("a numeric argument (seconds)");
+            opts.cpuTimeLimit = limit;
+        } else if (arg == "-m" || arg == "--memory-limit") {
+            size_t limit;
+            data >> limit;
+            onReadFail("a numeric argument (# bytes)");
+            opts.memoryLimit = limit;
+        } else if (arg == "--memory-swap") {
+            if (data.str() == "max") {
+                opts.swapLimit.reset();
+            } else {
+                size_t limit;
+                data >> limit;
+                onReadFail("a numeric argument (# bytes) or max");
+                opts.swapLimit = limit;
+            }
+        } else if (arg == "-s" || arg == "--stack-size") {
+            size_t limit;
+            data >> limit;
+            onReadFail("a numeric argument (# bytes)");
+            opts.stackSize = limit;
+        } else if (arg == "-n" || arg == "--niceness") {
+            int limit;
+            data >> limit;
+            onReadFail("a numeric argument (niceness)");
+            opts.niceness = limit;
+        } else if (arg == "--cpus") {
+            std::string cpus;
+            data >> cpus;
+            onReadFail("a cpuset list or auto[:<cores>]");
+            if (cpus == "auto") {
+                opts.exclusiveCores = 1;
+            } else if (cpus.starts_with("auto:")) {
+                std::stringstream cores(cpus.substr(5));
+                std::size_t count;
+                if (!(cores >> count) || count == 0) {
+                    throw SandboxException(arg + " auto:<cores> expects a positive number of cores");
+                }
+                opts.exclusiveCores = count;
+            } else {
+                if (cpus.find_first_not_of("0123456789,-") != std::string::npos) {
+                    throw SandboxException(arg + " expects a cpuset list, e.g. 0-3,8");
+                }
+                opts.cpus = cpus;
+            }
+        } else if (arg == "--cpu-max") {
+            TaskConstraints::CpuBandwidth bandwidth;
+            data >> bandwidth.quotaUs;
+            onReadFail("<quota us>[/<period us>]");
+            if (char slash; data >> slash) {
+                data >> bandwidth.periodUs;
+                if (slash != '/' || data.fail()) {
+                    throw SandboxException(arg + " option expects <quota us>[/<period us>]");
+                }
+            }
+            opts.cpuBandwidth = bandwidth;
+        } else if (arg == "--cpu-weight") {
+            unsigned weight;
+            data >> weight;
+            onReadFail("a numeric argument (weight)");
+            if (weight < 1 || weight > 10000) {
+                throw SandboxException(arg + " expects a value from [1, 10000]");
+            }
+            opts.cpuWeight = weight;
+        } else if (arg == "--io-max") {
+            std::string limits;
+            data >> limits;
+            onReadFail("<rbps|wbps|riops|wiops>=<value>[,...]");
+            TaskConstraints::IoLimit io;
+            std::stringstream fields(limits);
+            for (std::string field; std::getline(fields, field, ',');) {
+                auto eq = field.find('=');
+                std::stringstream value(eq == std::string::npos ? "" : field.substr(eq + 1));
+                std::uint64_t limit;
+                auto key = field.substr(0, eq);
+                auto target = key == "rbps" ? &io.rbps : key == "wbps" ? &io.wbps
+                    : key == "riops" ? &io.riops : key == "wiops" ? &io.wiops : nullptr;
+                if (!target || !(value >> limit) || !value.eof() || limit == 0) {
+                    throw SandboxException(arg + " expects <rbps|wbps|riops|wiops>=<positive number>[,...], got " + field);
+                }
+                *target = limit;
+            }
+            opts.ioMax = io;
+        } else if (arg == "--io-weight") {
+            unsigned weight;
+            data >> weight;
+            onReadFail("a numeric argument (weight)");
+            if (weight < 1 || weight > 10000) {
+                throw SandboxException(arg + " expects a value from [1, 10000]");
+            }
+            opts.ioWeight = weight;
+        } else if (arg == "--priority") {
+            std::string priority;
+            data >> priority;
+            onReadFail("batch, normal or latency");
+            if (priority == "batch") {
+                opts.priority = TaskConstraints::Priority::Batch;
+            } else if (priority == "normal") {
+                opts.priority = TaskConstraints::Priority::Normal;
+            } else if (priority == "latency") {
+                opts.priority = TaskConstraints::Priority::Latency;
+            } else {
+                throw SandboxException(arg + " expects batch, normal or latency");
+            }
+        } else if (arg == "-f" || arg == "--max-forks") {
+            size_t limit;
+            data >> limit;
+            onReadFail("a numeric argument (# forks)");
+            opts.maxForks = limit;
+        } else if (arg == "-i" || arg == "--fs-image") {
+            std::filesystem::path p;
+            data >> p;
+            onReadFail("a path to the container image");
+            opts.fsImage = p;
+        } else if (arg == "--image-mode") {
+            std::string mode;
+            data >> mode;
+            if (mode == "copy") {
+                opts.imageMode = TaskConstraints::ImageMode::Copy;
+            } else if (mode == "overlay") {
+                opts.imageMode = TaskConstraints::ImageMode::Overlay;
+            } else if (mode == "overlay-tmpfs") {
+                opts.imageMode = TaskConstraints::ImageMode::OverlayTmpfs;
+            } else {
+                throw SandboxException(arg + " expects one of: copy, overlay, overlay-tmpfs");
+            }
+        } else if (arg == "--image-cache") {
+            std::filesystem::path p;
+            data >> p;
+            onReadFail("a path to the image cache directory");
+            opts.imageCacheDir = p;
+        } else if (arg == "--image-cache-size") {
+            size_t limit;
+            data >> limit;
+            onReadFail("a numeric argument (# bytes)");
+            opts.imageCacheMaxBytes = limit;
+        } else if (arg == "--scratch") {
+            std::filesystem::path p;
+            data >> p;
+            onReadFail("a path inside the container (or host fs)");
+            opts.scratchDir = p;
+        } else if (arg == "--tmpfs-size") {
+            size_t limit;
+            data >> limit;
+            onReadFail("a numeric argument (# bytes)");
+            opts.tmpfsMaxBytes = limit;
+        } else if (arg == "--tmpfs-inodes") {
+            size_t limit;
+            data >> limit;
+            onReadFail("a numeric argument (# inodes)");
+            opts.tmpfsMaxInodes = limit;
+        } else if (arg == "-w" || arg == "--work-dir") {
+            std::filesystem::path p;
+            data >> p;
+            onReadFail("a path of working directory inside the container (or host fs)");
+            opts.workDir = p;
+        } else if (arg == "-a" || arg == "--add") {
+            std::string pp;
+            data >> pp;
+            onReadFail(arg + " expects <path-from>:<path-to>[:rw], e.g. ./bin/cmd:/app/cmd");
+            auto it = pp.find(':');
+            if (it == std::string::npos) {
+                throw SandboxException(arg + " expects <path-from>:<path-to>[:rw], e.g. ./bin/cmd:/app/cmd");
+            }
+            std::filesystem::path from{pp.substr(0, it)};
+            std::string to = pp.substr(it + 1);
+            bool writable = false;
+            if (to.ends_with(":rw") || to.ends_with(":ro")) {
+                writable = to.ends_with(":rw");
+                to.resize(to.size() - 3);
+            }
+            opts.fileMapping.emplace_back(from, to, writable);
+        } else if (arg == "--zygote") {
+            size_t size;
+            data >> size;
+            onReadFail("a numeric argument (# prepared sandboxes)");
+            opts.zygoteSize = size;
+        } else if (arg == "--zygote-refill-rate") {
+            double rate;
+            data >> rate;
+            onReadFail("a numeric argument (tasks per second)");
+            opts.zygoteRefillRate = rate;
+        } else if (arg == "--audit") {
+            std::filesystem::path p;
+            data >> p;
+            onReadFail("a path to the audit file");
+            opts.auditPath = p;
+        } else if (arg == "--sample") {
+            std::filesystem::path p;
+            data >> p;
+            onReadFail("a path to the samples file");
+            opts.sampleFile = p;
+        } else if (arg == "--sample-interval") {
+            unsigned ms;
+            data >> ms;
+            onReadFail("a numeric argument (milliseconds)");
+            if (ms == 0) {
+                throw SandboxException(arg + " expects a positive interval");
+            }
+            opts.sampleInterval = std::chrono::milliseconds(ms);
+        } else if (arg == "--cgroup-pool") {
+            size_t size;
+            data >> size;
+            onReadFail("a numeric argument (# cgroups)");
+            opts.cgroupPoolSize = size;
+        } else if (arg == "-u" || arg == "--uid") {
+            uid_t uid;
+            data >> uid;
+            onReadFail("expected uid");
+            opts.uid = uid;
+        } else if (arg == "-g" || arg == "--gid") {
+            uid_t gid;
+            data >> gid;
+            onReadFail("expected gid");
+            opts.gid = gid;
+        } else {
+            throw SandboxException("unsupported argument: " + arg);
+        }
+    }
+    if (!opts.imageMode) {
+        // copying an image file would defeat the point of mounting it
+        bool imageFile = opts.fsImage && LoopImage::isImageFile(*opts.fsImage);
+        opts.imageMode = imageFile ? TaskConstraints::ImageMode::Overlay : TaskConstraints::ImageMode::Copy;
+    }
+    if (opts.zygoteSize) {
+        if (i < argc) throw SandboxException("--zygote reads commands from stdin, no executable is expected");
+        return opts;
+    }
+    if (i >= argc) throw SandboxException("no executable is specified");
+    opts.executable = std::string(argv[i++]);
+    while (i < argc) {
+        opts.args.emplace_back(std::string(argv[i++]));
+    }
+    return opts;
+}
+
+void Options::resolvePaths(const std::filesystem::path &base) {
+    auto resolve = [&](std::filesystem::path &p) {
+        if (p.is_relative()) {
+            p = base / p;
+        }
+    };
+    for (auto *p : {&fsImage, &imageCacheDir, &auditPath, &sampleFile}) {
+        if (*p) {
+            resolve(**p);
+        }
+    }
+    for (auto &m : fileMapping) {
+        resolve(m.from);
+    }
+    if (!fsImage) {
+        resolve(workDir);
+        if (scratchDir) {
+            resolve(*scratchDir);
+        }
+    }
+}
+
+TaskConstraints Options::constraints() const {
+    return TaskConstraints{
+        timeLimit,
+        cpuTimeLimit,
+        memoryLimit,
+        swapLimit,
+        stackSize,
+        maxForks,
+        niceness,
+        cpus,
+        exclusiveCores,
+        cpuBandwidth,
+        cpuWeight,
+        ioMax,
+        ioWeight,
+        priority,
+        newNetwork,
+        enableFreezer,
+        preserveCapabilities,
+        fsImage,
+        *imageMode,
+        imageCacheDir,
+        imageCacheMaxBytes,
+        scratchDir,
+        tmpfsMaxBytes,
+        tmpfsMaxInodes,
+        workDir,
+        fileMapping,
+        sampleFile,
+        sampleInterval,
+        uid,
+        gid
+    };
+}
+
+std::vector<std::string> splitWords(const std::string &line) {
+    std::vector<std::string> words;
+    std::string word;
+    bool inWord = false;
+    for (std::size_t i = 0; i < line.size(); i++) {
+        char c = line[i];
+        if (c == ' ' || c == '\t' || c == '\r') {
+            if (inWord) words.push_back(std::move(word));
+            word.clear();
+            inWord = false;
+            continue;
+        }
+        inWord = true;
+        if (c == '\\') {
+            if (++i == line.size()) {
+                throw SandboxException("backslash at the end of the line");
+            }
+            word += line[i];
+        } else if (c == '\'') {
+            auto end = line.find('\'', i + 1);
+            if (end == std::string::npos) {
+                throw SandboxException("unterminated single quote");
+            }
+            word += line.substr(i + 1, end - i - 1);
+            i = end;
+        } else if (c == '"') {
+            for (i++; i < line.size() && line[i] != '"'; i++) {
+                if (line[i] == '\\' && i + 1 < line.size() && (line[i + 1] == '"' || line[i + 1] == '\\')) {
+                    i++;
+                }
+                word += line[i];
+            }
+            if (i == line.size()) {
+                throw SandboxException("unterminated double quote");
+            }
+        } else {
+            word += c;
+        }
+    }
+    if (inWord) words.push_back(std::move(word));
+    return words;
+}
+
+} // namespace sandbox
@@ -0,0 +1,244 @@
+#include "preemption_scheduler.h"
+#include "exceptions.h"
+#include "msg.h"
+
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+
+using namespace std::string_literals;
+
+namespace sandbox
+{
+
+// how often demand is measured and the decisions are revisited, also the least time a task stays frozen
+static constexpr auto REBALANCE_PERIOD = std::chrono::seconds(1);
+
+static const char* priorityName_(TaskConstraints::Priority priority) {
+    switch (priority) {
+    case TaskConstraints::Priority::Batch: return "batch";
+    case TaskConstraints::Priority::Normal: return "normal";
+    case TaskConstraints::Priority::Latency: return "latency";
+    }
+    return "unknown";
+}
+
+// MemAvailable of /proc/meminfo in bytes
+static std::uint64_t availableMemory_() {
+    std::ifstream meminfo("/proc/meminfo");
+    std::string key, unit;
+    std::uint64_t value;
+    while (meminfo >> key >> value >> unit) {
+        if (key == "MemAvailable:") {
+            return value * 1024;
+        }
+    }
+    return 0;
+}
+
+PreemptionScheduler::PreemptionScheduler(double cpus, std::uint64_t minAvailableMemory, std::chrono::milliseconds maxPreemption)
+    : cpus_{cpus > 0 ? cpus : static_cast<double>(sysconf(_SC_NPROCESSORS_ONLN))}
+    , minAvailableMemory_{minAvailableMemory}
+    , maxPreemption_{maxPreemption}
+    , nextPeriod_{Clock::now() + REBALANCE_PERIOD}
+{
+    timerFd_ = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (timerFd_ < 0) {
+        throw SandboxError("failed to create timer: "s + std::strerror(errno));
+    }
+}
+
+PreemptionScheduler::~PreemptionScheduler() {
+    close(timerFd_);
+}
+
+void PreemptionScheduler::add(Task &task) {
+    auto now = Clock::now();
+    auto maxCpus = task.cpuParallelism();
+    entries_.push_back({&task, task.constraints().priority, maxCpus, std::min(maxCpus, 1.0), task.cpuUsage(), now, std::nullopt, now});
+    reclaimFutile_ = false;
+    rebalance_();
+}
+
+void PreemptionScheduler::remove(Task &task) {
+    std::erase_if(entries_, [&](const Entry &e) { return e.task == &task; });
+    reclaimFutile_ = false;
+    rebalance_();
+}
+
+int PreemptionScheduler::fd() const {
+    return timerFd_;
+}
+
+void PreemptionScheduler::dispatch() {
+    std::uint64_t expirations;
+    if (read(timerFd_, &expirations, sizeof(expirations)) < 0) {
+        return;
+    }
+    auto now = Clock::now();
+    if (now >= nextPeriod_) {
+        measure_();
+        nextPeriod_ = now + REBALANCE_PERIOD;
+    }
+    for (auto &e : entries_) {
+        if (e.preemptedAt && now - *e.preemptedAt >= maxPreemption_) {
+            resume_(e, "starved");
+            // as long as it waited, before it has to make room again
+            e.immuneUntil = now + maxPreemption_;
+        }
+    }
+    rebalance_();
+}
+
+void PreemptionScheduler::measure_() {
+    auto now = Clock::now();
+    for (auto &e : entries_) {
+        if (e.preemptedAt)
+            continue;
+        auto usage = e.task->cpuUsage();
+        auto elapsed = now - e.measuredAt;
+        // a task added late in the period is measured over the next one as well
+        if (e.usageUs && elapsed < REBALANCE_PERIOD / 2)
+            continue;
+        auto elapsedUs = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+        if (usage && e.usageUs && *usage >= *e.usageUs && elapsedUs > 0) {
+            e.cpus = std::min(e.maxCpus, static_cast<double>(*usage - *e.usageUs) / elapsedUs);
+        }
+        e.usageUs = usage;
+        e.measuredAt = now;
+    }
+}
+
+void PreemptionScheduler::rebalance_() {
+    auto now = Clock::now();
+    for (auto &e : entries_) {
+        // thawed behind our back, by cancel()
+        if (e.preemptedAt && !e.task->preempted()) {
+            impl::Message() << "Task " << e.task->id() << " was thawed to be cancelled";
+            e.preemptedAt.reset();
+            e.usageUs.reset();
+        }
+    }
+    auto highestRunning = [&] {
+        std::optional<TaskConstraints::Priority> highest;
+        for (auto &e : entries_) {
+            if (!e.preemptedAt && (!highest || e.priority > *highest)) highest = e.priority;
+        }
+        return highest;
+    };
+
+    // preempt while saturated, the lowest class and the youngest task first
+    std::vector<Entry*> preempted;
+    bool memory = memorySaturated_();
+    reclaimFutile_ &= memory;
+    while (true) {
+        memory = !reclaimFutile_ && memorySaturated_();
+        if (!memory && !cpuSaturated_(0))
+            break;
+        auto highest = highestRunning();
+        Entry *victim = nullptr;
+        for (auto &e : entries_) {
+            if (e.preemptedAt || e.immuneUntil > now || !highest || e.priority >= *highest || e.task->cancelled())
+                continue;
+            if (!victim || e.priority <= victim->priority) victim = &e;
+        }
+        if (!victim)
+            break;
+        preempt_(*victim, memory);
+        if (memory && victim->preemptedAt && !victim->reclaimed) {
+            // the others are not going to give up more, freezing them would only stall them
+            impl::Message() << "Preempting for memory freed nothing, no more tasks are frozen for it for now";
+            reclaimFutile_ = true;
+            if (!cpuSaturated_(victim->cpus)) {
+                resume_(*victim, "it had no memory to give up");
+                continue;
+            }
+        }
+        preempted.push_back(victim);
+    }
+
+    // resume the highest class and the longest waiting first, as long as they fit
+    std::vector<Entry*> frozen;
+    for (auto &e : entries_) {
+        // freezing reclaims memory and drops demand, which must not thaw the task right away
+        if (e.preemptedAt && std::find(preempted.begin(), preempted.end(), &e) == preempted.end()) frozen.push_back(&e);
+    }
+    std::stable_sort(frozen.begin(), frozen.end(), [](Entry *a, Entry *b) {
+        return a->priority != b->priority ? a->priority > b->priority : *a->preemptedAt < *b->preemptedAt;
+    });
+    for (auto *e : frozen) {
+        auto highest = highestRunning();
+        if (!highest || *highest <= e->priority) {
+            resume_(*e, "nothing above it runs");
+        } else if (now - *e->preemptedAt >= REBALANCE_PERIOD && !memorySaturated_(e->reclaimed) && !cpuSaturated_(e->cpus)) {
+            resume_(*e, "capacity is back");
+        }
+    }
+    armTimer_();
+}
+
+bool PreemptionScheduler::cpuSaturated_(double extraCpus) const {
+    double demand = extraCpus;
+    for (auto &e : entries_) {
+        if (!e.preemptedAt) demand += e.cpus;
+    }
+    return demand > cpus_;
+}
+
+bool PreemptionScheduler::memorySaturated_(std::uint64_t extraBytes) const {
+    return minAvailableMemory_ && availableMemory_() < minAvailableMemory_ + extraBytes;
+}
+
+void PreemptionScheduler::preempt_(Entry &e, bool forMemory) {
+    try {
+        auto reclaimed = e.task->preempt(forMemory);
+        e.preemptedAt = Clock::now();
+        e.usageUs.reset();
+        e.reclaimed = reclaimed;
+        impl::Message() << "Preempted " << priorityName_(e.priority) << " task " << e.task->id()
+            << (forMemory ? " (memory, " + std::to_string(reclaimed) + " bytes reclaimed)" : " (cpu)");
+    } catch (SandboxException &err) {
+        impl::Message() << "Warning: failed to preempt task " << e.task->id() << ": " << err.what();
+        // not tried again before the next starvation period
+        e.immuneUntil = Clock::now() + maxPreemption_;
+    }
+}
+
+void PreemptionScheduler::resume_(Entry &e, const char *why) {
+    auto frozenFor = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - *e.preemptedAt);
+    try {
+        e.task->resume();
+    } catch (SandboxException &err) {
+        impl::Message() << "Warning: failed to resume task " << e.task->id() << ": " << err.what();
+    }
+    e.preemptedAt.reset();
+    e.reclaimed = 0;
+    impl::Message() << "Resumed " << priorityName_(e.priority) << " task " << e.task->id() << " after "
+        << frozenFor.count() << "ms, " << why;
+}
+
+void PreemptionScheduler::armTimer_() {
+    // the next starvation limit, the end of an immunity or the next period, whichever comes first
+    auto now = Clock::now();
+    std::optional<Clock::time_point> next;
+    if (!entries_.empty()) {
+        next = nextPeriod_;
+    }
+    for (auto &e : entries_) {
+        auto at = e.preemptedAt ? *e.preemptedAt + maxPreemption_ : e.immuneUntil;
+        if (at > now || e.preemptedAt) {
+            next = next ? std::min(*next, at) : at;
+        }
+    }
+    itimerspec spec{};
+    if (next) {
+        auto ns = std::max<std::int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(*next - now).count(), 1);
+        spec.it_value.tv_sec = ns / 1'000'000'000;
+        spec.it_value.tv_nsec = ns % 1'000'000'000;
+    }
+    timerfd_settime(timerFd_, 0, &spec, nullptr);
+}
+
+} // namespace sandbox
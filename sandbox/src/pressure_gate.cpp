@@ -0,0 +1,162 @@
+#include "pressure_gate.h"
+#include "exceptions.h"
+#include "msg.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/timerfd.h>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+using namespace std::string_literals;
+
+namespace sandbox
+{
+
+PressureGate::PressureGate(const std::vector<Threshold> &thresholds, std::chrono::milliseconds window, std::size_t maxTasks,
+        const std::optional<std::filesystem::path> &cgroupDir)
+    : window_{window}
+    , maxTasks_{std::max<std::size_t>(maxTasks, 1)}
+    , limit_{maxTasks_}
+    , windowStart_{Clock::now()}
+{
+    timerFd_ = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (timerFd_ < 0) {
+        throw SandboxError("failed to create timer: "s + std::strerror(errno));
+    }
+    auto cleanup = [&] {
+        for (auto &s : sources_) close(s.fd);
+        close(timerFd_);
+    };
+    auto windowUs = std::chrono::duration_cast<std::chrono::microseconds>(window_).count();
+    for (auto &t : thresholds) {
+        auto path = cgroupDir ? *cgroupDir / (t.resource + ".pressure") : "/proc/pressure" / std::filesystem::path(t.resource);
+        int fd = open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) {
+            auto err = errno;
+            cleanup();
+            throw SandboxError("failed to open " + path.string() + " (is PSI enabled?): " + std::strerror(err));
+        }
+        sources_.push_back({t, fd, 0});
+        // the kernel cuts the last byte of what is written to /proc/pressure, hence the terminator
+        auto trigger = "some " + std::to_string(static_cast<std::int64_t>(windowUs * t.percent / 100)) + " "
+            + std::to_string(windowUs);
+        if (write(fd, trigger.c_str(), trigger.size() + 1) < 0) {
+            auto err = errno;
+            cleanup();
+            throw SandboxError("failed to set PSI trigger \"" + trigger + "\" on " + path.string() + ": " + std::strerror(err)
+                + (err == EINVAL ? " (windows are 500ms to 10s, a multiple of 2s without CAP_SYS_RESOURCE)" : ""));
+        }
+        sources_.back().stallTotal = stallTotal_(sources_.back());
+    }
+    itimerspec spec{};
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(window_).count();
+    spec.it_value = spec.it_interval = {static_cast<time_t>(ns / 1'000'000'000), static_cast<long>(ns % 1'000'000'000)};
+    if (timerfd_settime(timerFd_, 0, &spec, nullptr)) {
+        auto err = errno;
+        cleanup();
+        throw SandboxError("failed to arm PSI window timer: "s + std::strerror(err));
+    }
+}
+
+PressureGate::~PressureGate() {
+    for (auto &s : sources_) {
+        if (s.fd >= 0) close(s.fd);
+    }
+    close(timerFd_);
+}
+
+std::size_t PressureGate::limit() const {
+    return limit_;
+}
+
+std::chrono::milliseconds PressureGate::throttledTime() const {
+    auto total = throttledTime_;
+    if (throttledSince_) {
+        total += Clock::now() - *throttledSince_;
+    }
+    return std::chrono::duration_cast<std::chrono::milliseconds>(total);
+}
+
+std::vector<pollfd> PressureGate::pollFds() const {
+    std::vector<pollfd> fds{{timerFd_, POLLIN, 0}};
+    for (auto &s : sources_) {
+        // poll() skips the negative fds of triggers that failed
+        fds.push_back({s.fd, POLLPRI, 0});
+    }
+    return fds;
+}
+
+void PressureGate::dispatch(const pollfd *polled, std::size_t running) {
+    for (std::size_t i = 0; i < sources_.size(); i++) {
+        auto &s = sources_[i];
+        auto revents = polled[i + 1].revents;
+        if (s.fd < 0 || !revents)
+            continue;
+        if (revents & POLLERR) {
+            // the watched cgroup is gone
+            impl::Message() << "Warning: PSI trigger on " << s.threshold.resource << " failed, no longer watching it";
+            close(s.fd);
+            s.fd = -1;
+        } else if ((revents & POLLPRI) && !pressured_) {
+            // one decrease per window, however many resources report
+            pressured_ = true;
+            setLimit_(std::min(limit_, std::max<std::size_t>(running, 1)) / 2,
+                s.threshold.resource + " stalls above " + std::to_string(static_cast<int>(s.threshold.percent)) + "%");
+        }
+    }
+    if (polled[0].revents) {
+        tick_();
+    }
+}
+
+void PressureGate::tick_() {
+    std::uint64_t expirations;
+    if (read(timerFd_, &expirations, sizeof(expirations)) < 0)
+        return;
+    auto now = Clock::now();
+    auto elapsedUs = std::chrono::duration_cast<std::chrono::microseconds>(now - windowStart_).count();
+    windowStart_ = now;
+    // a trigger reports at most once per window of its own, which needn't line up with ours
+    bool calm = !pressured_;
+    for (auto &s : sources_) {
+        if (s.fd < 0)
+            continue;
+        auto total = stallTotal_(s);
+        calm &= elapsedUs <= 0 || (total - s.stallTotal) * 100.0 / elapsedUs < s.threshold.percent;
+        s.stallTotal = total;
+    }
+    pressured_ = false;
+    if (calm && limit_ < maxTasks_) {
+        setLimit_(limit_ + std::max<std::size_t>(maxTasks_ / 8, 1), "no pressure");
+    }
+}
+
+std::uint64_t PressureGate::stallTotal_(const Source &s) const {
+    char buf[256];
+    auto n = pread(s.fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0)
+        return s.stallTotal;
+    buf[n] = '\0';
+    // "some avg10=0.00 avg60=0.00 avg300=0.00 total=<us>" is the first line
+    auto total = std::strstr(buf, "total=");
+    return total ? std::strtoull(total + 6, nullptr, 10) : s.stallTotal;
+}
+
+void PressureGate::setLimit_(std::size_t limit, const std::string &why) {
+    limit = std::clamp<std::size_t>(limit, 1, maxTasks_);
+    if (limit == limit_)
+        return;
+    limit_ = limit;
+    auto now = Clock::now();
+    if (limit_ < maxTasks_ && !throttledSince_) {
+        throttledSince_ = now;
+    } else if (limit_ == maxTasks_ && throttledSince_) {
+        throttledTime_ += now - *throttledSince_;
+        throttledSince_.reset();
+    }
+    impl::Message() << "Pressure gate: " << why << ", at most " << limit_ << " tasks at once";
+}
+
+} // namespace sandbox
@@ -0,0 +1,131 @@
+#include "reaper.h"
+#include "exceptions.h"
+#include "msg.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <syscall.h>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+using namespace std::string_literals;
+
+// from linux/ioprio.h, which is missing in older kernel headers
+constexpr int ioprioWhoProcess = 1;
+constexpr int ioprioClassIdle = 3;
+constexpr int ioprioClassShift = 13;
+
+namespace sandbox
+{
+
+Reaper::Reaper(std::filesystem::path dir)
+    : dir_{std::filesystem::absolute(dir)}
+    , trash_{dir_ / ".sandbox-trash"}
+{}
+
+void Reaper::discard(const std::filesystem::path &path) {
+    if (!std::filesystem::exists(path))
+        return;
+    std::error_code ec;
+    std::filesystem::create_directories(trash_, ec);
+    // the task id in the name keeps entries of different tasks apart
+    auto target = trash_ / path.filename();
+    if (!ec && !rename(path.c_str(), target.c_str()))
+        return;
+    impl::Message() << "Warning: failed to move " << path << " to trash (" << std::strerror(errno) << "), removing it now";
+    std::filesystem::remove_all(path, ec);
+    if (ec) {
+        impl::Message() << "Warning: failed to remove " << path << ": " << ec.message();
+    }
+}
+
+void Reaper::spawn() {
+    pid_t pid = fork();
+    if (pid < 0) {
+        throw SandboxError("failed to start reaper: "s + std::strerror(errno));
+    }
+    if (pid) {
+        waitpid(pid, nullptr, 0);
+        return;
+    }
+    // double fork, so that the reaper is adopted by init and never becomes a zombie of ours
+    setsid();
+    if (fork()) {
+        _exit(0);
+    }
+    // don't keep the caller's output pipes open, whoever reads them would wait for the reaper
+    int devnull = open("/dev/null", O_RDWR);
+    if (devnull >= 0) {
+        dup2(devnull, STDIN_FILENO);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        close(devnull);
+    }
+    std::vector<int> inherited;
+    std::error_code ec;
+    for (auto &e : std::filesystem::directory_iterator("/proc/self/fd", ec)) {
+        int fd = std::stoi(e.path().filename().string());
+        if (fd > STDERR_FILENO) inherited.push_back(fd);
+    }
+    for (int fd : inherited) {
+        close(fd);
+    }
+    syscall(SYS_ioprio_set, ioprioWhoProcess, 0, ioprioClassIdle << ioprioClassShift);
+    setpriority(PRIO_PROCESS, 0, 19);
+    try {
+        collectCrashed_();
+        reap_();
+    } catch (...) {
+        _exit(1);
+    }
+    // the caller's destructors (cgroup, status file) must not run here
+    _exit(0);
+}
+
+void Reaper::collectCrashed_() {
+    std::error_code ec;
+    for (auto &e : std::filesystem::directory_iterator(dir_, ec)) {
+        auto name = e.path().filename().string();
+        if (!name.starts_with("sandbox-task-") || !e.is_regular_file())
+            continue;
+        pid_t pid = 0;
+        std::ifstream(e.path()) >> pid;
+        if (pid <= 0 || !kill(pid, 0) || errno != ESRCH)
+            continue;
+        for (auto suffix : {".d", ".overlay.d"}) {
+            discard(dir_ / (name + suffix));
+        }
+        std::filesystem::remove(e.path(), ec);
+    }
+}
+
+void Reaper::reap_() {
+    std::filesystem::create_directories(trash_);
+    auto lockPath = trash_.parent_path() / ".sandbox-trash.lock";
+    int lockFd = open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    // concurrent reapers queue up, each one finds the trash at most as full as the previous one left it
+    if (lockFd < 0 || flock(lockFd, LOCK_EX))
+        return;
+    while (true) {
+        std::error_code ec;
+        std::filesystem::directory_iterator it(trash_, ec);
+        if (ec || it == std::filesystem::directory_iterator())
+            break;
+        bool removed = false;
+        for (; !ec && it != std::filesystem::directory_iterator(); it.increment(ec)) {
+            std::error_code removeEc;
+            std::filesystem::remove_all(it->path(), removeEc);
+            removed |= !removeEc;
+        }
+        if (!removed)
+            break;
+    }
+    close(lockFd);
+}
+
+} // namespace sandbox
@@ -0,0 +1,59 @@
+#include "run_audit.h"
+
+#include <sstream>
+
+namespace sandbox
+{
+
+const char* RunAudit::toString(Termination termination) {
+    switch (termination) {
+    case Termination::Exit: return "exit";
+    case Termination::Signal: return "signal";
+    case Termination::OomKill: return "oom_kill";
+    case Termination::TimeLimit: return "time_limit";
+    case Termination::CpuTimeLimit: return "cpu_time_limit";
+    case Termination::PidsLimit: return "pids_limit";
+    }
+    return "unknown";
+}
+
+template <typename T>
+static void field_(std::ostream &out, const char *name, const std::optional<T> &value) {
+    out << ",\"" << name << "\":";
+    if (value) {
+        out << *value;
+    } else {
+        out << "null";
+    }
+}
+
+std::string RunAudit::toJson() const {
+    std::stringstream out;
+    // task ids are hex, nothing to escape
+    out << "{\"task\":\"" << taskId << "\",\"termination\":\"" << toString(termination) << '"';
+    field_(out, "exit_code", exitCode);
+    field_(out, "signal", signal);
+    out << ",\"wall_time_us\":" << wallTime.count()
+        << ",\"user_time_us\":" << userTime.count()
+        << ",\"system_time_us\":" << systemTime.count()
+        << ",\"max_rss_bytes\":" << maxRssBytes
+        << ",\"major_faults\":" << majorFaults
+        << ",\"minor_faults\":" << minorFaults
+        << ",\"voluntary_context_switches\":" << voluntaryContextSwitches
+        << ",\"involuntary_context_switches\":" << involuntaryContextSwitches;
+    field_(out, "cgroup_cpu_usage_us", cgroupCpuUsageUs);
+    field_(out, "cgroup_user_us", cgroupUserUs);
+    field_(out, "cgroup_system_us", cgroupSystemUs);
+    field_(out, "memory_peak_bytes", memoryPeakBytes);
+    field_(out, "io_read_bytes", ioReadBytes);
+    field_(out, "io_write_bytes", ioWriteBytes);
+    field_(out, "oom_kills", oomKills);
+    field_(out, "pids_limit_hits", pidsLimitHits);
+    field_(out, "pids_spawned", pidsSpawned);
+    out << ",\"preempted_us\":" << preemptedTime.count()
+        << ",\"preemptions\":" << preemptions;
+    out << '}';
+    return out.str();
+}
+
+} // namespace sandbox
@@ -0,0 +1,181 @@
+#include "sampler.h"
+#include "exceptions.h"
+#include "msg.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+
+using namespace std::string_literals;
+
+namespace sandbox
+{
+
+static const char *sampledFiles[] = {"memory.current", "cpu.stat", "io.stat", "pids.current"};
+
+static const char csvHeader[] = "task,t_us,memory_current,cpu_usage_us,cpu_user_us,cpu_system_us,io_rbytes,io_wbytes,pids_current\n";
+
+// reads the file from the start, returns the length or 0 if it can't be read
+static std::size_t read_(int fd, char *buf, std::size_t size) {
+    if (fd < 0) return 0;
+    auto n = pread(fd, buf, size - 1, 0);
+    if (n <= 0) return 0;
+    buf[n] = '\0';
+    return n;
+}
+
+// value of "key value" in a flat keyed file
+static const char* keyed_(const char *content, const char *key) {
+    auto len = std::strlen(key);
+    for (auto p = content; (p = std::strstr(p, key)); p += len) {
+        if ((p == content || p[-1] == '\n') && p[len] == ' ') {
+            return p + len + 1;
+        }
+    }
+    return nullptr;
+}
+
+static void append_(std::string &line, const char *value) {
+    line += ',';
+    if (value) {
+        line += std::to_string(std::strtoull(value, nullptr, 10));
+    }
+}
+
+Sampler& Sampler::instance() {
+    static Sampler sampler;
+    return sampler;
+}
+
+Sampler::Sampler() {
+    epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd_ < 0) {
+        throw SandboxError("failed to create epoll instance: "s + std::strerror(errno));
+    }
+}
+
+Sampler::~Sampler() {
+    while (!sampled_.empty()) {
+        remove(sampled_.begin()->first);
+    }
+    close(epollFd_);
+}
+
+void Sampler::add(pid_t pid, const std::string &taskId, int cgroupDirFd, std::chrono::microseconds interval,
+        const std::filesystem::path &output) {
+    Sampled s{taskId, -1, -1, {-1, -1, -1, -1}, std::chrono::steady_clock::now()};
+    auto cleanup = [&] {
+        for (int fd : s.files) if (fd >= 0) close(fd);
+        if (s.timerFd >= 0) close(s.timerFd);
+        if (s.outFd >= 0) close(s.outFd);
+    };
+    for (int i = 0; i < FileCount; i++) {
+        s.files[i] = openat(cgroupDirFd, sampledFiles[i], O_RDONLY | O_CLOEXEC);
+    }
+    s.outFd = open(output.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    s.timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (s.outFd < 0 || s.timerFd < 0) {
+        auto err = errno;
+        cleanup();
+        throw SandboxError("failed to start sampling: "s + std::strerror(err));
+    }
+    if (lseek(s.outFd, 0, SEEK_END) == 0) {
+        [[maybe_unused]] auto res = write(s.outFd, csvHeader, sizeof(csvHeader) - 1);
+    }
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::max(interval, std::chrono::microseconds(1))).count();
+    itimerspec spec{};
+    spec.it_interval.tv_sec = ns / 1'000'000'000;
+    spec.it_interval.tv_nsec = ns % 1'000'000'000;
+    spec.it_value = spec.it_interval;
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = pid;
+    if (timerfd_settime(s.timerFd, 0, &spec, nullptr) || epoll_ctl(epollFd_, EPOLL_CTL_ADD, s.timerFd, &ev)) {
+        auto err = errno;
+        cleanup();
+        throw SandboxError("failed to start sampling: "s + std::strerror(err));
+    }
+    auto &added = sampled_[pid] = std::move(s);
+    sample_(added);
+}
+
+void Sampler::remove(pid_t pid) {
+    auto it = sampled_.find(pid);
+    if (it == sampled_.end()) {
+        return;
+    }
+    auto &s = it->second;
+    sample_(s);
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - s.start).count();
+    auto perSample = std::chrono::duration<double, std::micro>(s.spent).count() / s.samples;
+    impl::Message() << "Sampler: " << s.samples << " samples, " << perSample << "us each, "
+        << (seconds > 0 ? std::chrono::duration<double>(s.spent).count() / seconds * 100 : 0) << "% of a CPU";
+    for (int fd : s.files) {
+        if (fd >= 0) close(fd);
+    }
+    // closing the timer drops it from the epoll set
+    close(s.timerFd);
+    close(s.outFd);
+    sampled_.erase(it);
+}
+
+int Sampler::fd() const {
+    return epollFd_;
+}
+
+void Sampler::dispatch() {
+    epoll_event events[64];
+    int n = epoll_wait(epollFd_, events, 64, 0);
+    for (int i = 0; i < n; i++) {
+        auto it = sampled_.find(events[i].data.u64);
+        if (it == sampled_.end()) {
+            continue;
+        }
+        std::uint64_t expirations;
+        [[maybe_unused]] auto res = read(it->second.timerFd, &expirations, sizeof(expirations));
+        sample_(it->second);
+    }
+}
+
+void Sampler::sample_(Sampled &s) {
+    auto now = std::chrono::steady_clock::now();
+    char buf[4096];
+    std::string line = s.taskId;
+    line += ',';
+    line += std::to_string(std::chrono::duration_cast<std::chrono::microseconds>(now - s.start).count());
+
+    append_(line, read_(s.files[MemoryCurrent], buf, sizeof(buf)) ? buf : nullptr);
+    bool cpu = read_(s.files[CpuStat], buf, sizeof(buf));
+    for (auto key : {"usage_usec", "user_usec", "system_usec"}) {
+        append_(line, cpu ? keyed_(buf, key) : nullptr);
+    }
+    if (s.files[IoStat] >= 0) {
+        // "<major>:<minor> rbytes=1 wbytes=2 ..." per device, the file is empty until there is I/O
+        if (!read_(s.files[IoStat], buf, sizeof(buf))) {
+            buf[0] = '\0';
+        }
+        std::uint64_t rbytes = 0, wbytes = 0;
+        for (auto p = std::strstr(buf, "rbytes="); p; p = std::strstr(p + 1, "rbytes=")) {
+            rbytes += std::strtoull(p + 7, nullptr, 10);
+        }
+        for (auto p = std::strstr(buf, "wbytes="); p; p = std::strstr(p + 1, "wbytes=")) {
+            wbytes += std::strtoull(p + 7, nullptr, 10);
+        }
+        line += ',' + std::to_string(rbytes) + ',' + std::to_string(wbytes);
+    } else {
+        line += ",,";
+    }
+    append_(line, read_(s.files[PidsCurrent], buf, sizeof(buf)) ? buf : nullptr);
+    line += '\n';
+    [[maybe_unused]] auto res = write(s.outFd, line.data(), line.size());
+
+    s.samples++;
+    s.spent += std::chrono::steady_clock::now() - now;
+}
+
+} // namespace sandbox
@@ -1,168 +1,112 @@
 #include <iostream>
+#include <fstream>
 #include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstring>
+#include <algorithm>
+#include <ext/stdio_filebuf.h>
 
 #include "task.h"
+#include "task_pool.h"
+#include "cgroup_pool.h"
+#include "options.h"
 #include "exceptions.h"
 #include "msg.h"
 
 using namespace sandbox;
 
-struct Options {
-    static constexpr const char* HELP = "" 
-    "Arguments format:"
-    "[options]... -- <executable> <arguments...>\n"
-    "Options:\n"
-    "   [-t|--time-limit <seconds>]\n"
-    "   [-m|--memory-limit <bytes>]\n"
-    "   [-s|--stack-size <bytes> (8MB by default)]\n"
-    "   [-f|--max-forks <count>]\n"
-    "   [-n|--niceness <value from [-20, 19]>]\n"
-    "   [--no-freezer]\n"
-    "   [--new-network]\n"
-    "   [--preserve-capabilities]\n"
-    "   [--libcgroup-verbose]\n"
-    "   [--watcher-verbose]\n"
-    "   [-i|--fs-image <path> [-a|--add <path-from>:<path-to>]...]\n"
-    "   [-r|--cleanup-fs-image-dir]\n"
-    "   [-w|--work-dir <path>]\n"
-    "   [-u|--uid <uid> (1000 by default)]\n"
-    "   [-g|--gid <gid> (1000 by default)]\n";
-
-    std::string executable;
-    std::vector<std::string> args;
-    std::optional<double> timeLimit;
-    std::optional<std::size_t> memoryLimit;
-    std::size_t stackSize = 8*1024*1024;
-    std::optional<int> niceness;
-    std::optional<std::size_t> maxForks;
-    bool newNetwork = false;
-    bool libcgroupVerbose = false;
-    bool watcherVerbose = false;
-    bool enableFreezer = true;
-    bool preserveCapabilities = false;
-    bool cleanupImageDir = false;
-    std::optional<std::filesystem::path> fsImage;
-    std::filesystem::path workDir = ".";
-    std::vector<TaskConstraints::FileMapping> fileMapping;
-    uid_t uid = 1000;
-    gid_t gid = 1000;
-
-    static Options fromSysArgs(int argc, char *argv[]) {
-        Options opts{};
-        int i = 1;
-        while (i < argc) {
-            std::string arg(argv[i]);
-            i++;
-            if (arg == "--") break;
-            // todo parse contraints
-            if (arg == "--new-network") {
-                opts.newNetwork = true;
-                continue;
-            }
-            if (arg == "--libcgroup-verbose") {
-                opts.libcgroupVerbose = true;
-                continue;
-            }
-            if (arg == "--watcher-verbose") {
-                opts.watcherVerbose = true;
-                continue;
-            }
-            if (arg == "--no-freezer") {
-                opts.enableFreezer = false;
-                continue;
-            }
-            if (arg == "--preserve-capabilities") {
-                opts.preserveCapabilities = true;
-                continue;
-            }
-            if (arg == "-r" || arg == "--cleanup-fs-image-dir") {
-                opts.cleanupImageDir = true;
-                continue;
-            }
-            if (i >= argc) {
-                throw SandboxException(arg + " option without an argument");
-            }
-            std::stringstream data(argv[i++]);
-            auto onReadFail = [&](std::string expected) {
-                if (data.fail()) {
-                    throw SandboxException(arg + " option expects " + expected);
-                }
-            };
-            if (arg == "-t" || arg == "--time-limit") {
-                double limit;
-                data >> limit;
-                onReadFail("a numeric argument (whole number of seconds)");
-                opts.timeLimit = limit;
-            } else if (arg == "-m" || arg == "--memory-limit") {
-                size_t limit;
-                data >> limit;
-                onReadFail("a numeric argument (# bytes)");
-                opts.memoryLimit = limit;
-            } else if (arg == "-s" || arg == "--stack-size") {
-                size_t limit;
-                data >> limit;
-                onReadFail("a numeric argument (# bytes)");
-                opts.stackSize = limit;
-            } else if (arg == "-n" || arg == "--niceness") {
-                int limit;
-                data >> limit;
-                onReadFail("a numeric argument (niceness)");
-                opts.niceness = limit;
-            } else if (arg == "-f" || arg == "--max-forks") {
-                size_t limit;
-                data >> limit;
-                onReadFail("a numeric argument (# forks)");
-                opts.maxForks = limit;
-            } else if (arg == "-i" || arg == "--fs-image") {
-                std::filesystem::path p;
-                data >> p;
-                onReadFail("a path to the container image");
-                opts.fsImage = p;
-            } else if (arg == "-w" || arg == "--work-dir") {
-                std::filesystem::path p;
-                data >> p;
-                onReadFail("a path of working directory inside the container (or host fs)");
-                opts.workDir = p;
-            } else if (arg == "-a" || arg == "--add") {
-                std::string pp;
-                data >> pp;
-                onReadFail(arg + " expects <path-from>:<path-to>, e.g. ./bin/cmd:/app/cmd");
-                auto it = pp.find(':');
-                if (it == std::string::npos) {
-                    throw SandboxException(arg + " expects <path-from>:<path-to>, e.g. ./bin/cmd:/app/cmd");
-                }
-                std::filesystem::path from{pp.substr(0, it)}, to{pp.substr(it + 1)};
-                opts.fileMapping.emplace_back(from, to);
-            } else if (arg == "-u" || arg == "--uid") {
-                uid_t uid;
-                data >> uid;
-                onReadFail("expected uid");
-                opts.uid = uid;
-            } else if (arg == "-g" || arg == "--gid") {
-                uid_t gid;
-                data >> gid;
-                onReadFail("expected gid");
-                opts.gid = gid;
-            } else {
-                throw SandboxException("unsupported argument: " + arg);
-            }
-        }
-        if (i >= argc) throw SandboxException("no executable is specified");
-        opts.executable = std::string(argv[i++]);
-        while (i < argc) {
-            opts.args.emplace_back(std::string(argv[i++]));
+static std::unique_ptr<Task> task;
+
+static void writeAudit(const Options &opts) {
+    if (!opts.auditPath)
+        return;
+    try {
+        std::ofstream out(*opts.auditPath, std::ios::app);
+        out << task->getAudit().toJson() << '\n';
+        if (!out) {
+            impl::Message() << "Warning: failed to write audit to " << *opts.auditPath;
         }
-        return opts;
+    } catch (SandboxException &e) {
+        impl::Message() << "Warning: no audit: " << e.what();
     }
-};
-
-static std::unique_ptr<Task> task;
+}
 void sighandler(int sig) {
     if (task) {
         task->cancel();
     }
 }
 
+// nearest-rank percentiles of the start-to-exec latencies of a zygote's tasks
+static void reportLatencies(std::vector<std::chrono::microseconds> latencies) {
+    if (latencies.empty())
+        return;
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](int p) {
+        return latencies[std::max<std::size_t>((latencies.size() * p + 99) / 100, 1) - 1].count();
+    };
+    impl::Message() << "Start-to-exec latency of " << latencies.size() << " tasks: p50 " << percentile(50) << "us, p90 "
+        << percentile(90) << "us, p99 " << percentile(99) << "us, max " << latencies.back().count() << "us";
+}
+
+static int runZygote(const Options &opts, const TaskConstraints &constraints) {
+    // tasks inherit stdin, they must not consume the commands
+    int commandsFd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+    int devnull = open("/dev/null", O_RDONLY);
+    if (commandsFd < 0 || devnull < 0 || dup2(devnull, STDIN_FILENO) < 0) {
+        impl::Message() << "Failed to detach stdin: " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    close(devnull);
+    __gnu_cxx::stdio_filebuf<char> commandsBuf(commandsFd, std::ios::in);
+    std::istream commands(&commandsBuf);
+
+    TaskPool pool{constraints, *opts.zygoteSize, opts.zygoteRefillRate, opts.watcherVerbose};
+    try {
+        pool.refill();
+    } catch (SandboxException &e) {
+        impl::Message() << "Failed to prepare sandboxes: " << e.what() << std::endl;
+        return 1;
+    }
+    impl::Message() << "Zygote is ready with " << pool.idle() << " sandboxes, reading commands from stdin";
+    std::vector<std::chrono::microseconds> latencies;
+    std::string line;
+    while (std::getline(commands, line)) {
+        std::vector<std::string> args;
+        try {
+            args = splitWords(line);
+        } catch (SandboxException &e) {
+            impl::Message() << "Bad command: " << e.what() << std::endl;
+            continue;
+        }
+        if (args.empty())
+            continue;
+        std::string executable = std::move(args.front());
+        args.erase(args.begin());
+        try {
+            task = pool.acquire();
+            task->launch(executable, args);
+            impl::Message() << "Task exec'd in " << task->launchLatency().count() << "us";
+            latencies.push_back(task->launchLatency());
+            task->await();
+            writeAudit(opts);
+            if (opts.cleanupImageDir && opts.fsImage) {
+                task->cleanupImageDir();
+            }
+        } catch (SandboxException &e) {
+            impl::Message() << "Execution failed: " << e.what() << std::endl;
+        }
+        task.reset();
+        try {
+            pool.refill();
+        } catch (SandboxException &e) {
+            impl::Message() << "Failed to refill the pool: " << e.what() << std::endl;
+        }
+    }
+    reportLatencies(std::move(latencies));
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     signal(SIGINT, sighandler);
 
@@ -175,36 +119,27 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    CGroupHandler::libinit();
+    CGroupHandler::libinit(opts.forceLibCGroup ? CGroupHandler::Backend::LibCGroup : CGroupHandler::Backend::Auto);
 
     if (opts.libcgroupVerbose) {
         CGroupHandler::setLibCGroupLoggerLevel(100000);
     }
 
-    task = std::make_unique<Task>(
-        opts.executable,
-        opts.args,
-        TaskConstraints{
-            opts.timeLimit,
-            opts.memoryLimit,
-            opts.stackSize,
-            opts.maxForks,
-            opts.niceness,
-            opts.newNetwork,
-            opts.enableFreezer,
-            opts.preserveCapabilities,
-            opts.fsImage,
-            opts.workDir,
-            opts.fileMapping,
-            opts.uid,
-            opts.gid
-        },
-        opts.watcherVerbose
-    );
+    auto constraints = opts.constraints();
+
+    if (opts.zygoteSize) {
+        CGroupPool::instance().configure(opts.cgroupPoolSize);
+        auto ret = runZygote(opts, constraints);
+        CGroupPool::instance().clear();
+        return ret;
+    }
+
+    task = std::make_unique<Task>(opts.executable, opts.args, constraints, opts.watcherVerbose);
 
     try {
         task->start();
         auto retcode = task->await();
+        writeAudit(opts);
         if (opts.cleanupImageDir && opts.fsImage) {
             task->cleanupImageDir();
         }
@@ -0,0 +1,487 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <set>
+#include <chrono>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <cstring>
+#include <algorithm>
+
+#include "task.h"
+#include "options.h"
+#include "time_limiter.h"
+#include "sampler.h"
+#include "cgroup_monitor.h"
+#include "pressure_gate.h"
+#include "cgroup_pool.h"
+#include "core_allocator.h"
+#include "image_cache.h"
+#include "loop_image.h"
+#include "exceptions.h"
+#include "msg.h"
+
+using namespace sandbox;
+using namespace std::string_literals;
+
+/*
+ * Manifest: one task per line, "[task options]... -- <executable> <arguments...>" or just
+ * "<executable> <arguments...>", split into words like a shell does: whitespace separates words, '...'
+ * quotes everything literally, "..." quotes everything but \" and \\, and a backslash outside quotes
+ * escapes the next character. There is no expansion of any kind. Empty lines and lines starting with #
+ * are skipped.
+ * Task options are those of the sandbox CLI, the options after -- on our command line go before them.
+ *
+ * Results: a tab-separated line per task, in manifest order:
+ *   <line> <exit code, or "error"> <wall seconds> <start-to-exec latency, us> <cpu> <task id or error message>
+ *
+ * With a --max-*-pressure threshold the number of running tasks is also bounded by a PressureGate,
+ * new tasks wait in the queue while the watched resources stall above the thresholds.
+ *
+ * Tasks without a cpuset of their own are pinned to CPUs that no --cpus auto task holds. A task whose
+ * CPUs are all held that way waits, with every task behind it, until running tasks give theirs back.
+ */
+struct BatchOptions {
+    static constexpr const char* HELP = ""
+    "Arguments format:\n"
+    "   sandbox-batch [-j|--jobs <count> (number of CPUs by default)] [-o|--output <results file> (batch_results.tsv by default)]\n"
+    "                 [--output-dir <dir> (stdout and stderr of task N go to <dir>/N.out and <dir>/N.err)]\n"
+    "                 [--cgroup-pool <size>] [--libcgroup]\n"
+    "                 [--max-cpu-pressure <%>] [--max-memory-pressure <%>] [--max-io-pressure <%>] (of stalled time, PSI \"some\")\n"
+    "                 [--psi-window <ms> (2000 by default)] [--psi-cgroup <dir> (pressure of a cgroup, the host's by default)]\n"
+    "                 <manifest> [-- <task options applied to every task>...]\n";
+
+    std::filesystem::path manifest;
+    std::filesystem::path output = "batch_results.tsv";
+    std::optional<std::filesystem::path> outputDir;
+    std::optional<std::size_t> jobs;
+    std::size_t cgroupPoolSize = 0;
+    bool forceLibCGroup = false;
+    std::vector<PressureGate::Threshold> pressureThresholds;
+    std::chrono::milliseconds psiWindow{2000};
+    std::optional<std::filesystem::path> psiCGroup;
+    std::vector<std::string> commonArgs;
+
+    static BatchOptions fromSysArgs(int argc, char *argv[]) {
+        BatchOptions opts{};
+        int i = 1;
+        auto value = [&](const std::string &arg) {
+            if (i >= argc) {
+                throw SandboxException(arg + " option without an argument");
+            }
+            return std::string(argv[i++]);
+        };
+        while (i < argc) {
+            std::string arg(argv[i++]);
+            if (arg == "--") {
+                opts.commonArgs.assign(argv + i, argv + argc);
+                break;
+            } else if (arg == "-j" || arg == "--jobs") {
+                std::stringstream data(value(arg));
+                std::size_t jobs;
+                if (!(data >> jobs) || jobs == 0) {
+                    throw SandboxException(arg + " option expects a positive number");
+                }
+                opts.jobs = jobs;
+            } else if (arg == "-o" || arg == "--output") {
+                opts.output = value(arg);
+            } else if (arg == "--output-dir") {
+                opts.outputDir = value(arg);
+            } else if (arg == "--cgroup-pool") {
+                std::stringstream data(value(arg));
+                if (!(data >> opts.cgroupPoolSize)) {
+                    throw SandboxException(arg + " option expects a numeric argument (# cgroups)");
+                }
+            } else if (arg == "--libcgroup") {
+                opts.forceLibCGroup = true;
+            } else if (arg == "--max-cpu-pressure" || arg == "--max-memory-pressure" || arg == "--max-io-pressure") {
+                std::stringstream data(value(arg));
+                double percent;
+                if (!(data >> percent) || percent <= 0 || percent > 100) {
+                    throw SandboxException(arg + " option expects a percentage in (0, 100]");
+                }
+                // --max-<resource>-pressure
+                opts.pressureThresholds.push_back({arg.substr(6, arg.size() - 6 - 9), percent});
+            } else if (arg == "--psi-window") {
+                std::stringstream data(value(arg));
+                std::size_t ms;
+                if (!(data >> ms) || ms == 0) {
+                    throw SandboxException(arg + " option expects a positive number (ms)");
+                }
+                opts.psiWindow = std::chrono::milliseconds(ms);
+            } else if (arg == "--psi-cgroup") {
+                opts.psiCGroup = value(arg);
+            } else if (opts.manifest.empty() && !arg.starts_with("-")) {
+                opts.manifest = arg;
+            } else {
+                throw SandboxException("unsupported argument: " + arg);
+            }
+        }
+        if (opts.manifest.empty()) {
+            throw SandboxException("no manifest is specified");
+        }
+        return opts;
+    }
+};
+
+static int selfPipe[2];
+static volatile sig_atomic_t stopping = 0;
+
+static void onSignal(int sig) {
+    auto savedErrno = errno;
+    if (sig != SIGCHLD) {
+        stopping = 1;
+    }
+    [[maybe_unused]] auto res = write(selfPipe[1], "s", 1);
+    errno = savedErrno;
+}
+
+class Batch {
+public:
+    explicit Batch(BatchOptions opts) : opts_{std::move(opts)} {}
+
+    int run() {
+        loadManifest_();
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+            throw SandboxError("failed to get CPU affinity: "s + std::strerror(errno));
+        }
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) cpus_.push_back(cpu);
+        }
+        freeCpus_.insert(cpus_.begin(), cpus_.end());
+        auto jobs = opts_.jobs.value_or(freeCpus_.size());
+        if (jobs > freeCpus_.size()) {
+            impl::Message() << "Warning: " << jobs << " jobs on " << freeCpus_.size() << " CPUs, tasks will share CPUs";
+        }
+        if (std::error_code ec; opts_.outputDir && (std::filesystem::create_directories(*opts_.outputDir, ec), ec)) {
+            throw SandboxException("failed to create " + opts_.outputDir->string() + ": " + ec.message());
+        }
+
+        if (pipe2(selfPipe, O_CLOEXEC | O_NONBLOCK)) {
+            throw SandboxError("failed to create pipe: "s + std::strerror(errno));
+        }
+        struct sigaction sa{};
+        sa.sa_handler = onSignal;
+        sa.sa_flags = SA_RESTART;
+        for (int sig : {SIGCHLD, SIGINT, SIGTERM}) {
+            sigaction(sig, &sa, nullptr);
+        }
+
+        std::optional<PressureGate> gate;
+        if (!opts_.pressureThresholds.empty()) {
+            gate.emplace(opts_.pressureThresholds, opts_.psiWindow, jobs, opts_.psiCGroup);
+        }
+
+        auto startTime = std::chrono::steady_clock::now();
+        std::size_t next = 0;
+        while (next < tasks_.size() || !running_.empty()) {
+            while (!stopping && next < tasks_.size() && running_.size() < (gate ? gate->limit() : jobs) && start_(next)) {
+                next++;
+            }
+            if (stopping) {
+                for (auto &[index, running] : running_) {
+                    running.task->cancel();
+                }
+                next = tasks_.size();
+            }
+            if (running_.empty())
+                break;
+            auto &limiter = TimeLimiter::instance();
+            auto &sampler = Sampler::instance();
+            auto &monitor = CGroupMonitor::instance();
+            std::vector<pollfd> fds = {{selfPipe[0], POLLIN, 0}, {limiter.fd(), POLLIN, 0}, {sampler.fd(), POLLIN, 0},
+                {monitor.fd(), POLLIN, 0}};
+            if (gate) {
+                auto gateFds = gate->pollFds();
+                fds.insert(fds.end(), gateFds.begin(), gateFds.end());
+            }
+            if (poll(fds.data(), fds.size(), -1) < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw SandboxError("poll failed: "s + std::strerror(errno));
+            }
+            if (fds[1].revents) {
+                limiter.dispatch();
+            }
+            if (fds[2].revents) {
+                sampler.dispatch();
+            }
+            if (fds[3].revents) {
+                monitor.dispatch();
+            }
+            if (gate) {
+                gate->dispatch(fds.data() + 4, running_.size());
+            }
+            if (fds[0].revents) {
+                char buf[64];
+                while (read(selfPipe[0], buf, sizeof(buf)) > 0);
+                reapTasks_();
+            }
+        }
+        auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+        writeResults_();
+        std::size_t failed = 0;
+        for (auto &t : tasks_) {
+            failed += !t.error.empty() || t.retcode != 0;
+        }
+        impl::Message() << tasks_.size() << " tasks (" << failed << " failed or unfinished) in " << seconds << "s, "
+            << (seconds > 0 ? tasks_.size() / seconds : 0) << " tasks/sec, results are in " << opts_.output;
+        if (gate) {
+            impl::Message() << "Launches were throttled by pressure for " << gate->throttledTime().count() / 1000.0 << "s";
+        }
+        return failed ? 1 : 0;
+    }
+
+private:
+    struct Entry {
+        std::size_t line;
+        std::vector<std::string> args;
+        std::string id;
+        std::optional<int> retcode;
+        std::string error;
+        double seconds = 0;
+        std::chrono::microseconds launchLatency{0};
+        int cpu = -1;
+    };
+
+    struct Running {
+        std::unique_ptr<Task> task;
+        std::chrono::steady_clock::time_point startedAt;
+        bool cleanupImageDir;
+        std::optional<std::filesystem::path> auditPath;
+    };
+
+    void loadManifest_() {
+        std::ifstream manifest(opts_.manifest);
+        if (!manifest) {
+            throw SandboxException("failed to open manifest " + opts_.manifest.string());
+        }
+        std::string line;
+        for (std::size_t lineNo = 1; std::getline(manifest, line); lineNo++) {
+            auto first = line.find_first_not_of(" \t\r");
+            if (first == std::string::npos || line[first] == '#')
+                continue;
+            std::vector<std::string> words;
+            try {
+                words = splitWords(line);
+            } catch (SandboxException &e) {
+                throw SandboxException("manifest line " + std::to_string(lineNo) + ": " + e.what());
+            }
+            Entry entry{lineNo, {"sandbox-batch"}, "", std::nullopt, ""};
+            entry.args.insert(entry.args.end(), opts_.commonArgs.begin(), opts_.commonArgs.end());
+            if (std::find(words.begin(), words.end(), "--") == words.end()) {
+                entry.args.push_back("--");
+            }
+            entry.args.insert(entry.args.end(), words.begin(), words.end());
+            tasks_.push_back(std::move(entry));
+        }
+    }
+
+    // false if the task has to wait for the CPUs running tasks hold exclusively
+    bool start_(std::size_t index) {
+        auto &entry = tasks_[index];
+        Running running{nullptr, std::chrono::steady_clock::now(), false, std::nullopt};
+        int cpu = -1;
+        try {
+            std::vector<char*> argv;
+            for (auto &a : entry.args) {
+                argv.push_back(a.data());
+            }
+            auto opts = Options::fromSysArgs(argv.size(), argv.data());
+            if (opts.zygoteSize) {
+                throw SandboxException("--zygote is not supported in a manifest");
+            }
+            // tasks start in manifest order, the ones behind wait too; alone, a task that doesn't fit fails
+            if (!running_.empty() && !fitsCpus_(opts)) {
+                return false;
+            }
+            resolveImage_(opts);
+            running.cleanupImageDir = opts.cleanupImageDir && opts.fsImage;
+            running.auditPath = opts.auditPath;
+            running.task = std::make_unique<Task>(opts.constraints(), opts.watcherVerbose);
+            entry.id = running.task->id();
+            std::vector<int> stdio;
+            if (opts_.outputDir) {
+                auto base = *opts_.outputDir / std::to_string(entry.line);
+                stdio = {
+                    open("/dev/null", O_RDONLY | O_CLOEXEC),
+                    open((base.string() + ".out").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644),
+                    open((base.string() + ".err").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644),
+                };
+                if (std::find(stdio.begin(), stdio.end(), -1) != stdio.end()) {
+                    auto err = errno;
+                    for (int fd : stdio) if (fd >= 0) close(fd);
+                    throw SandboxError("failed to open output files of the task: "s + std::strerror(err));
+                }
+                running.task->redirectStdio(stdio[0], stdio[1], stdio[2]);
+            }
+            running.task->prepare();
+            for (int fd : stdio) close(fd);
+            // a task with its own cpuset is bound by it, the others get the lowest free CPU no task holds
+            // exclusively, or any such CPU once there are more jobs than CPUs
+            if (!opts.cpus && !opts.exclusiveCores) {
+                auto &allocator = CoreAllocator::instance();
+                auto slot = std::find_if(freeCpus_.begin(), freeCpus_.end(), [&](int c) { return !allocator.leased(c); });
+                for (std::size_t i = 0; slot == freeCpus_.end() && cpu < 0 && i < cpus_.size(); i++) {
+                    auto c = cpus_[(index + i) % cpus_.size()];
+                    cpu = allocator.leased(c) ? -1 : c;
+                }
+                if (slot != freeCpus_.end()) {
+                    cpu = *slot;
+                    freeCpus_.erase(slot);
+                    entry.cpu = cpu;
+                }
+                if (cpu >= 0) {
+                    running.task->pinToCpu(cpu);
+                }
+            }
+            running.task->launch(opts.executable, opts.args);
+            entry.launchLatency = running.task->launchLatency();
+        } catch (SandboxException &e) {
+            entry.error = e.what();
+        }
+        if (!entry.error.empty()) {
+            if (entry.cpu >= 0) {
+                freeCpus_.insert(entry.cpu);
+            }
+            impl::Message() << "Task at line " << entry.line << " failed to start: " << entry.error;
+            if (running.task) {
+                // SIGINT, then SIGKILL for a task that already got its command
+                running.task->cancel();
+                running.task->cancel();
+                running.task->dismiss();
+            }
+            return true;
+        }
+        running_.emplace(index, std::move(running));
+        return true;
+    }
+
+    bool fitsCpus_(const Options &opts) const {
+        auto &allocator = CoreAllocator::instance();
+        if (opts.exclusiveCores) {
+            return allocator.freeCores() >= *opts.exclusiveCores;
+        }
+        std::vector<int> cpus;
+        if (opts.cpus) {
+            cpus = CoreAllocator::parseCpuList(*opts.cpus);
+        } else {
+            cpus = cpus_;
+        }
+        return std::any_of(cpus.begin(), cpus.end(), [&](int c) { return !allocator.leased(c); });
+    }
+
+    void reapTasks_() {
+        for (auto it = running_.begin(); it != running_.end();) {
+            auto &[index, running] = *it;
+            auto &entry = tasks_[index];
+            try {
+                entry.retcode = running.task->tryAwait();
+                if (entry.retcode && running.cleanupImageDir) {
+                    running.task->cleanupImageDir();
+                }
+            } catch (SandboxException &e) {
+                entry.error = e.what();
+                entry.retcode = 1;
+            }
+            if (!entry.retcode) {
+                ++it;
+                continue;
+            }
+            entry.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - running.startedAt).count();
+            if (running.auditPath && entry.error.empty()) {
+                try {
+                    std::ofstream(*running.auditPath, std::ios::app) << running.task->getAudit().toJson() << '\n';
+                } catch (SandboxException &e) {
+                    impl::Message() << "Warning: no audit for the task at line " << entry.line << ": " << e.what();
+                }
+            }
+            if (entry.cpu >= 0) {
+                freeCpus_.insert(entry.cpu);
+            }
+            it = running_.erase(it);
+        }
+    }
+
+    // the images shared by the tasks are mounted or snapshotted once for the whole batch
+    void resolveImage_(Options &opts) {
+        if (!opts.fsImage)
+            return;
+        auto image = *opts.fsImage;
+        if (auto it = images_.find(image); it != images_.end()) {
+            opts.fsImage = it->second;
+        } else if (LoopImage::isImageFile(image)) {
+            auto &lease = loopLeases_.emplace_back(LoopImage{image}.mount(std::filesystem::current_path()));
+            opts.fsImage = images_[image] = lease.root();
+        } else if (opts.imageCacheDir && opts.imageMode != TaskConstraints::ImageMode::Copy) {
+            ImageCache cache{*opts.imageCacheDir, opts.imageCacheMaxBytes};
+            auto &lease = leases_.emplace_back(cache.acquire(image));
+            opts.fsImage = images_[image] = lease.root();
+        } else {
+            return;
+        }
+        opts.imageCacheDir.reset();
+    }
+
+    void writeResults_() {
+        std::ofstream out(opts_.output);
+        for (auto &t : tasks_) {
+            out << t.line << '\t';
+            if (t.error.empty() && t.retcode) {
+                out << *t.retcode;
+            } else {
+                out << "error";
+            }
+            out << '\t' << t.seconds << '\t' << t.launchLatency.count() << '\t' << t.cpu << '\t';
+            if (!t.error.empty()) {
+                out << t.error;
+            } else if (!t.retcode) {
+                out << "not run";
+            } else {
+                out << t.id;
+            }
+            out << '\n';
+        }
+        if (!out) {
+            impl::Message() << "Warning: failed to write results to " << opts_.output;
+        }
+    }
+
+    BatchOptions opts_;
+    std::vector<Entry> tasks_;
+    std::map<std::size_t, Running> running_;
+    std::vector<int> cpus_;
+    std::set<int> freeCpus_;
+    // image given in the manifest -> what the tasks get instead
+    std::map<std::filesystem::path, std::filesystem::path> images_;
+    std::vector<ImageCache::Lease> leases_;
+    std::vector<LoopImage::Lease> loopLeases_;
+};
+
+int main(int argc, char *argv[]) {
+    BatchOptions opts;
+    try {
+        opts = BatchOptions::fromSysArgs(argc, argv);
+    } catch (SandboxException &e) {
+        std::cout << "Bad arguments: " << e.what() << std::endl;
+        std::cout << BatchOptions::HELP << std::endl;
+        return 1;
+    }
+
+    try {
+        CGroupHandler::libinit(opts.forceLibCGroup ? CGroupHandler::Backend::LibCGroup : CGroupHandler::Backend::Auto);
+        CGroupPool::instance().configure(opts.cgroupPoolSize);
+        auto ret = Batch{opts}.run();
+        CGroupPool::instance().clear();
+        return ret;
+    } catch (SandboxException &e) {
+        impl::Message() << "sandbox-batch failed: " << e.what() << std::endl;
+        return 1;
+    }
+}
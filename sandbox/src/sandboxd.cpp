@@ -0,0 +1,644 @@
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <map>
+#include <algorithm>
+#include <cstdint>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <grp.h>
+#include <pwd.h>
+
+#include "task.h"
+#include "options.h"
+#include "time_limiter.h"
+#include "sampler.h"
+#include "cgroup_monitor.h"
+#include "preemption_scheduler.h"
+#include "cgroup_pool.h"
+#include "exceptions.h"
+#include "msg.h"
+
+using namespace sandbox;
+using namespace std::string_literals;
+
+/*
+ * Protocol, one SOCK_SEQPACKET connection per task:
+ *   client -> sandboxd: the client's working directory, then the sandbox CLI arguments of the task,
+ *                       each one NUL-terminated, optionally with stdin, stdout and stderr for the task
+ *                       attached as SCM_RIGHTS; relative paths of the arguments are resolved against
+ *                       the working directory
+ *   sandboxd -> client: "started <task id>", "exec <start-to-exec latency, us>", then
+ *                       "audit <RunAudit JSON>" and "exit <code>" once the task is over,
+ *                       or "error <message>" at any point
+ * The task is cancelled if the client disconnects before it is over, and killed if it is still
+ * running CANCEL_GRACE later. Image copies run in a child process, other sessions aren't held up by them.
+ *
+ * The socket is created with mode 0600, or 0660 with --socket-group. Tasks are set up with the
+ * daemon's privileges, so a client that isn't root (by SO_PEERCRED) may only run tasks as its own
+ * uid and its own primary or supplementary gid (-u and -g default to 1000, it has to pass them), and
+ * may not ask for --preserve-capabilities, writable -a mappings, or the paths sandboxd writes itself
+ * (--sample, --image-cache).
+ */
+struct DaemonOptions {
+    static constexpr const char* HELP = ""
+    "Arguments format:\n"
+    "   sandboxd [--socket <path> (./sandboxd.sock by default)] [--socket-group <group> (only root connects by default)]\n"
+    "            [--libcgroup] [--libcgroup-verbose]\n"
+    "            [--cgroup-pool <size> (reuse up to <size> idle cgroups across tasks)]\n"
+    "            [--cpu-capacity <cpus> (online CPUs by default)] [--min-available-memory <bytes>]\n"
+    "            [--max-preemption <seconds> (60 by default)]\n"
+    "       (tasks of a lower --priority are frozen while higher ones run and the CPUs or memory\n"
+    "        are saturated, for at most --max-preemption at once)\n"
+    "   sandboxd [--socket <path>] [--audit <path>] --run [task options]... -- <executable> <arguments...>\n"
+    "       (runs a task in a running sandboxd with our stdio, exits with its exit code;\n"
+    "        task options are those of the sandbox CLI, --audit appends the task's resource usage as a JSON line)\n";
+
+    std::filesystem::path socketPath = "sandboxd.sock";
+    std::optional<std::string> socketGroup;
+    bool libcgroupVerbose = false;
+    bool forceLibCGroup = false;
+    bool run = false;
+    std::size_t cgroupPoolSize = 0;
+    double cpuCapacity = 0;
+    std::uint64_t minAvailableMemory = 0;
+    double maxPreemptionSeconds = 60;
+    std::optional<std::filesystem::path> auditPath;
+    std::vector<std::string> taskArgs;
+
+    static DaemonOptions fromSysArgs(int argc, char *argv[]) {
+        DaemonOptions opts{};
+        int i = 1;
+        while (i < argc) {
+            std::string arg(argv[i++]);
+            if (arg == "--run") {
+                opts.run = true;
+                opts.taskArgs.assign(argv + i, argv + argc);
+                break;
+            } else if (arg == "--libcgroup-verbose") {
+                opts.libcgroupVerbose = true;
+            } else if (arg == "--libcgroup") {
+                opts.forceLibCGroup = true;
+            } else if (arg == "--socket") {
+                if (i >= argc) {
+                    throw SandboxException(arg + " option without an argument");
+                }
+                opts.socketPath = argv[i++];
+            } else if (arg == "--socket-group") {
+                if (i >= argc) {
+                    throw SandboxException(arg + " option without an argument");
+                }
+                opts.socketGroup = argv[i++];
+            } else if (arg == "--audit") {
+                if (i >= argc) {
+                    throw SandboxException(arg + " option without an argument");
+                }
+                opts.auditPath = argv[i++];
+            } else if (arg == "--cgroup-pool") {
+                if (i >= argc) {
+                    throw SandboxException(arg + " option without an argument");
+                }
+                std::stringstream data(argv[i++]);
+                if (!(data >> opts.cgroupPoolSize)) {
+                    throw SandboxException(arg + " option expects a numeric argument (# cgroups)");
+                }
+            } else if (arg == "--cpu-capacity" || arg == "--min-available-memory" || arg == "--max-preemption") {
+                if (i >= argc) {
+                    throw SandboxException(arg + " option without an argument");
+                }
+                std::stringstream data(argv[i++]);
+                bool ok = arg == "--cpu-capacity" ? !!(data >> opts.cpuCapacity)
+                    : arg == "--min-available-memory" ? !!(data >> opts.minAvailableMemory)
+                    : !!(data >> opts.maxPreemptionSeconds);
+                if (!ok) {
+                    throw SandboxException(arg + " option expects a numeric argument");
+                }
+            } else {
+                throw SandboxException("unsupported argument: " + arg);
+            }
+        }
+        return opts;
+    }
+};
+
+static sockaddr_un socketAddress(const std::filesystem::path &path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.string().size() >= sizeof(addr.sun_path)) {
+        throw SandboxException("socket path is too long: " + path.string());
+    }
+    std::strcpy(addr.sun_path, path.c_str());
+    return addr;
+}
+
+// a group name or a numeric gid
+static gid_t groupId(const std::string &group) {
+    if (auto entry = getgrnam(group.c_str())) {
+        return entry->gr_gid;
+    }
+    gid_t gid;
+    std::stringstream ss(group);
+    if (!(ss >> gid) || !ss.eof()) {
+        throw SandboxException("no such group: " + group);
+    }
+    return gid;
+}
+
+// the primary and supplementary groups of a user, by its passwd entry
+static bool inGroupOf(uid_t uid, gid_t primary, gid_t gid) {
+    if (gid == primary) {
+        return true;
+    }
+    auto entry = getpwuid(uid);
+    if (!entry) {
+        return false;
+    }
+    int count = 0;
+    getgrouplist(entry->pw_name, primary, nullptr, &count);
+    std::vector<gid_t> groups(count);
+    if (getgrouplist(entry->pw_name, primary, groups.data(), &count) < 0) {
+        return false;
+    }
+    return std::find(groups.begin(), groups.begin() + count, gid) != groups.begin() + count;
+}
+
+// what only root may ask for: the task would act as the host's root or as another user,
+// or sandboxd would write files for it
+static void checkPeer(const ucred &peer, const Options &opts) {
+    if (peer.uid == 0) {
+        return;
+    }
+    if (opts.uid == 0 || opts.gid == 0) {
+        throw SandboxException("only root may run tasks as uid or gid 0");
+    }
+    if (opts.uid != peer.uid || !inGroupOf(peer.uid, peer.gid, opts.gid)) {
+        throw SandboxException("only root may run tasks as other users, pass -u " + std::to_string(peer.uid)
+            + " -g " + std::to_string(peer.gid));
+    }
+    if (opts.preserveCapabilities) {
+        throw SandboxException("only root may use --preserve-capabilities");
+    }
+    for (auto &m : opts.fileMapping) {
+        if (m.writable) {
+            throw SandboxException("only root may map paths writable: " + m.from.string());
+        }
+    }
+    if (opts.sampleFile || opts.imageCacheDir) {
+        throw SandboxException("only root may use --sample and --image-cache, sandboxd writes them as root");
+    }
+}
+
+static void reply(int fd, const std::string &msg) {
+    // the client may be gone already, its task is cancelled then
+    send(fd, msg.data(), msg.size(), MSG_NOSIGNAL);
+}
+
+using Clock = std::chrono::steady_clock;
+
+// how long the task of a disconnected client has to exit on SIGINT
+static constexpr auto CANCEL_GRACE = std::chrono::seconds(5);
+
+static int selfPipe[2];
+static volatile sig_atomic_t stopping = 0;
+
+static void onSignal(int sig) {
+    auto savedErrno = errno;
+    if (sig != SIGCHLD) {
+        stopping = 1;
+    }
+    [[maybe_unused]] auto res = write(selfPipe[1], "s", 1);
+    errno = savedErrno;
+}
+
+class Daemon {
+public:
+    explicit Daemon(const DaemonOptions &opts)
+        : socketPath_{opts.socketPath}
+        , socketGroup_{opts.socketGroup}
+        , scheduler_{opts.cpuCapacity, opts.minAvailableMemory,
+            std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::duration<double>(opts.maxPreemptionSeconds))}
+    {}
+
+    int serve() {
+        if (pipe2(selfPipe, O_CLOEXEC | O_NONBLOCK)) {
+            throw SandboxError("failed to create pipe: "s + std::strerror(errno));
+        }
+        struct sigaction sa{};
+        sa.sa_handler = onSignal;
+        sa.sa_flags = SA_RESTART;
+        for (int sig : {SIGCHLD, SIGINT, SIGTERM}) {
+            sigaction(sig, &sa, nullptr);
+        }
+
+        listenFd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (listenFd_ < 0) {
+            throw SandboxError("failed to create socket: "s + std::strerror(errno));
+        }
+        auto addr = socketAddress(socketPath_);
+        unlink(socketPath_.c_str());
+        // connecting is running tasks with our privileges: the socket is never open to others, not even briefly
+        auto oldMask = umask(0177);
+        int res = bind(listenFd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        auto err = errno;
+        umask(oldMask);
+        if (res) {
+            throw SandboxError("failed to bind " + socketPath_.string() + ": " + std::strerror(err));
+        }
+        if (socketGroup_ && (chown(socketPath_.c_str(), -1, groupId(*socketGroup_)) || chmod(socketPath_.c_str(), 0660))) {
+            throw SandboxError("failed to give group " + *socketGroup_ + " access to " + socketPath_.string() + ": " + std::strerror(errno));
+        }
+        if (listen(listenFd_, SOMAXCONN)) {
+            throw SandboxError("failed to listen on " + socketPath_.string() + ": " + std::strerror(errno));
+        }
+        impl::Message() << "sandboxd is listening on " << socketPath_;
+
+        while (!stopping) {
+            auto &limiter = TimeLimiter::instance();
+            auto &sampler = Sampler::instance();
+            auto &monitor = CGroupMonitor::instance();
+            std::vector<pollfd> fds{{listenFd_, POLLIN, 0}, {selfPipe[0], POLLIN, 0}, {limiter.fd(), POLLIN, 0},
+                {sampler.fd(), POLLIN, 0}, {monitor.fd(), POLLIN, 0}, {scheduler_.fd(), POLLIN, 0}};
+            std::vector<std::uint64_t> polled;
+            for (auto &[id, session] : sessions_) {
+                if (session.fd >= 0) {
+                    fds.push_back({session.fd, POLLIN, 0});
+                    polled.push_back(id);
+                }
+            }
+            std::vector<std::uint64_t> staging;
+            for (auto &[id, session] : sessions_) {
+                if (session.stagingFd >= 0) {
+                    fds.push_back({session.stagingFd, POLLIN, 0});
+                    staging.push_back(id);
+                }
+            }
+            if (poll(fds.data(), fds.size(), killTimeout_()) < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw SandboxError("poll failed: "s + std::strerror(errno));
+            }
+            if (fds[2].revents) {
+                limiter.dispatch();
+            }
+            if (fds[3].revents) {
+                sampler.dispatch();
+            }
+            if (fds[4].revents) {
+                monitor.dispatch();
+            }
+            if (fds[5].revents) {
+                scheduler_.dispatch();
+            }
+            if (fds[1].revents) {
+                char buf[64];
+                while (read(selfPipe[0], buf, sizeof(buf)) > 0);
+                reapTasks_();
+            }
+            for (std::size_t i = 0; i < polled.size(); i++) {
+                // the session may be gone after reapTasks_()
+                if (fds[i + 6].revents && sessions_.contains(polled[i])) {
+                    onClientEvent_(polled[i]);
+                }
+            }
+            for (std::size_t i = 0; i < staging.size(); i++) {
+                if (fds[i + 6 + polled.size()].revents && sessions_.contains(staging[i])) {
+                    onStaged_(staging[i]);
+                }
+            }
+            killAbandoned_();
+            if (fds[0].revents) {
+                int fd = accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+                ucred peer{};
+                socklen_t len = sizeof(peer);
+                if (fd >= 0 && getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &len)) {
+                    impl::Message() << "Warning: failed to identify a client, dropping it: " << std::strerror(errno);
+                    close(fd);
+                } else if (fd >= 0) {
+                    auto &session = sessions_[nextSessionId_++];
+                    session.fd = fd;
+                    session.peer = peer;
+                }
+            }
+        }
+
+        impl::Message() << "sandboxd is stopping, cancelling " << sessions_.size() << " tasks...";
+        while (!sessions_.empty()) {
+            auto id = sessions_.begin()->first;
+            auto &session = sessions_[id];
+            if (session.stagingFd >= 0) {
+                session.task->cancel();
+                try {
+                    session.task->awaitStagedImage();
+                } catch (SandboxException&) {
+                    // killed
+                }
+                session.task->cleanupImageDir();
+            } else if (session.task) {
+                session.task->cancel();
+                session.task->cancel();
+                session.task->await();
+            }
+            dropSession_(id, "sandboxd is stopping");
+        }
+        close(listenFd_);
+        unlink(socketPath_.c_str());
+        return 0;
+    }
+
+private:
+    // sessions outlive their connections until the task is over, so they aren't keyed by fd
+    struct Session {
+        int fd = -1;
+        // credentials of the client at connect time
+        ucred peer{};
+        std::unique_ptr<Task> task;
+        bool cleanupImageDir = false;
+        // pidfd of the child staging the task's image, the task starts once it exits
+        int stagingFd = -1;
+        // the client's stdio for the task, kept until it starts
+        std::vector<int> stdio;
+        // the client is gone and the task is cancelled, it is killed if it is still running then
+        std::optional<Clock::time_point> killAt;
+    };
+
+    void onClientEvent_(std::uint64_t id) {
+        auto &session = sessions_[id];
+        int fd = session.fd;
+        char buf[64 * 1024];
+        char control[CMSG_SPACE(3 * sizeof(int))];
+        iovec iov{buf, sizeof(buf)};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        auto n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+
+        std::vector<int> stdio;
+        for (auto cmsg = CMSG_FIRSTHDR(&msg); n > 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                auto count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                stdio.resize(count);
+                std::memcpy(stdio.data(), CMSG_DATA(cmsg), count * sizeof(int));
+            }
+        }
+
+        if (n <= 0 || session.task) {
+            for (int sfd : stdio) close(sfd);
+            if (n > 0)
+                return;
+            // the client is gone
+            close(fd);
+            session.fd = -1;
+            if (!session.task) {
+                dropSession_(id, "");
+                return;
+            }
+            session.task->cancel();
+            if (session.stagingFd < 0) {
+                session.killAt = Clock::now() + CANCEL_GRACE;
+            }
+            return;
+        }
+
+        session.stdio = std::move(stdio);
+        try {
+            stageTask_(session, std::string(buf, n));
+        } catch (SandboxException &e) {
+            dropSession_(id, e.what());
+            return;
+        }
+        if (session.stagingFd < 0) {
+            startTask_(id);
+        }
+    }
+
+    // parses the request and starts staging the image of the task, if it needs that
+    void stageTask_(Session &session, const std::string &request) {
+        std::stringstream ss(request);
+        std::string cwd;
+        std::getline(ss, cwd, '\0');
+        if (!std::filesystem::path(cwd).is_absolute()) {
+            throw SandboxException("expected the client's working directory first, got \"" + cwd + "\"");
+        }
+        std::vector<std::string> args{"sandboxd"};
+        for (std::string a; std::getline(ss, a, '\0');) {
+            args.push_back(a);
+        }
+        std::vector<char*> argv;
+        for (auto &a : args) {
+            argv.push_back(a.data());
+        }
+        auto opts = Options::fromSysArgs(argv.size(), argv.data());
+        if (opts.zygoteSize) {
+            throw SandboxException("--zygote is not supported by sandboxd");
+        }
+        opts.resolvePaths(cwd);
+        checkPeer(session.peer, opts);
+        auto &stdio = session.stdio;
+        if (!stdio.empty() && stdio.size() != 3) {
+            throw SandboxException("expected 3 stdio fds, got " + std::to_string(stdio.size()));
+        }
+        session.cleanupImageDir = opts.cleanupImageDir && opts.fsImage;
+        session.task = std::make_unique<Task>(opts.executable, opts.args, opts.constraints(), opts.watcherVerbose);
+        if (!stdio.empty()) {
+            session.task->redirectStdio(stdio[0], stdio[1], stdio[2]);
+        }
+        session.stagingFd = session.task->stageImage();
+    }
+
+    void onStaged_(std::uint64_t id) {
+        auto &session = sessions_[id];
+        session.stagingFd = -1;
+        try {
+            session.task->awaitStagedImage();
+            if (session.fd < 0) {
+                throw SandboxException("the client is gone");
+            }
+        } catch (SandboxException &e) {
+            // nothing ran in the image yet, a copy is of no use to anyone
+            session.task->cleanupImageDir();
+            dropSession_(id, e.what());
+            return;
+        }
+        startTask_(id);
+    }
+
+    void startTask_(std::uint64_t id) {
+        auto &session = sessions_[id];
+        try {
+            session.task->start();
+            scheduler_.add(*session.task);
+        } catch (SandboxException &e) {
+            if (session.cleanupImageDir) {
+                session.task->cleanupImageDir();
+            }
+            dropSession_(id, e.what());
+            return;
+        }
+        reply(session.fd, "started " + session.task->id());
+        reply(session.fd, "exec " + std::to_string(session.task->launchLatency().count()));
+        for (int sfd : session.stdio) close(sfd);
+        session.stdio.clear();
+    }
+
+    // replies `error` to a client that is still connected
+    void dropSession_(std::uint64_t id, const std::string &error) {
+        auto &session = sessions_[id];
+        if (session.fd >= 0) {
+            reply(session.fd, "error " + error);
+            close(session.fd);
+        }
+        for (int sfd : session.stdio) close(sfd);
+        sessions_.erase(id);
+    }
+
+    // ms until the first task of a disconnected client is to be killed, -1 if none is
+    int killTimeout_() const {
+        std::optional<Clock::time_point> first;
+        for (auto &[id, session] : sessions_) {
+            if (session.killAt && (!first || *session.killAt < *first)) {
+                first = session.killAt;
+            }
+        }
+        if (!first)
+            return -1;
+        auto left = std::chrono::ceil<std::chrono::milliseconds>(*first - Clock::now()).count();
+        return static_cast<int>(std::max<std::int64_t>(left, 0));
+    }
+
+    void killAbandoned_() {
+        auto now = Clock::now();
+        for (auto &[id, session] : sessions_) {
+            if (session.killAt && *session.killAt <= now) {
+                impl::Message() << "Task " << session.task->id() << " ignored SIGINT for " << CANCEL_GRACE.count() << "s, killing it";
+                // the second cancel() sends SIGKILL
+                session.task->cancel();
+                session.killAt.reset();
+            }
+        }
+    }
+
+    void reapTasks_() {
+        for (auto it = sessions_.begin(); it != sessions_.end();) {
+            auto &session = it->second;
+            std::optional<int> retcode;
+            try {
+                // a task whose image is still staged hasn't started
+                retcode = session.task && session.stagingFd < 0 ? session.task->tryAwait() : std::nullopt;
+                if (retcode && session.cleanupImageDir) {
+                    session.task->cleanupImageDir();
+                }
+            } catch (SandboxException &e) {
+                impl::Message() << "Task " << session.task->id() << " failed: " << e.what();
+                retcode = 1;
+            }
+            if (!retcode) {
+                ++it;
+                continue;
+            }
+            if (session.task) {
+                scheduler_.remove(*session.task);
+            }
+            if (session.fd >= 0) {
+                try {
+                    reply(session.fd, "audit " + session.task->getAudit().toJson());
+                } catch (SandboxException&) {
+                    // the task failed before it could be audited
+                }
+                reply(session.fd, "exit " + std::to_string(*retcode));
+                close(session.fd);
+            }
+            it = sessions_.erase(it);
+        }
+    }
+
+    std::filesystem::path socketPath_;
+    std::optional<std::string> socketGroup_;
+    int listenFd_ = -1;
+    std::map<std::uint64_t, Session> sessions_;
+    std::uint64_t nextSessionId_ = 0;
+    PreemptionScheduler scheduler_;
+};
+
+static int runClient(const DaemonOptions &opts) {
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    auto addr = socketAddress(opts.socketPath);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))) {
+        throw SandboxError("failed to connect to " + opts.socketPath.string() + ": " + std::strerror(errno));
+    }
+    // the task's paths are relative to our working directory, not to sandboxd's
+    std::string request = std::filesystem::current_path().string() + '\0';
+    for (auto &a : opts.taskArgs) {
+        request += a;
+        request += '\0';
+    }
+    int stdio[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(stdio))] = {};
+    iovec iov{request.data(), request.size()};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(stdio));
+    std::memcpy(CMSG_DATA(cmsg), stdio, sizeof(stdio));
+    if (sendmsg(fd, &msg, 0) < 0) {
+        throw SandboxError("failed to send the task: "s + std::strerror(errno));
+    }
+
+    char buf[64 * 1024];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+        std::string replyMsg(buf, n);
+        if (replyMsg.starts_with("audit ") && opts.auditPath) {
+            std::ofstream(*opts.auditPath, std::ios::app) << replyMsg.substr(6) << '\n';
+        }
+        if (replyMsg.starts_with("exit ")) {
+            return std::stoi(replyMsg.substr(5));
+        }
+        if (replyMsg.starts_with("error ")) {
+            impl::Message() << "Execution failed: " << replyMsg.substr(6);
+            return 1;
+        }
+    }
+    impl::Message() << "Connection to sandboxd is lost";
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    DaemonOptions opts;
+    try {
+        opts = DaemonOptions::fromSysArgs(argc, argv);
+    } catch (SandboxException &e) {
+        std::cout << "Bad arguments: " << e.what() << std::endl;
+        std::cout << DaemonOptions::HELP << std::endl;
+        return 1;
+    }
+
+    try {
+        if (opts.run) {
+            return runClient(opts);
+        }
+        CGroupHandler::libinit(opts.forceLibCGroup ? CGroupHandler::Backend::LibCGroup : CGroupHandler::Backend::Auto);
+        if (opts.libcgroupVerbose) {
+            CGroupHandler::setLibCGroupLoggerLevel(100000);
+        }
+        CGroupPool::instance().configure(opts.cgroupPoolSize);
+        auto ret = Daemon{opts}.serve();
+        CGroupPool::instance().clear();
+        return ret;
+    } catch (SandboxException &e) {
+        impl::Message() << "sandboxd failed: " << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,89 @@
+#include "stack_pool.h"
+#include "exceptions.h"
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <cstring>
+
+using namespace std::string_literals;
+
+namespace sandbox
+{
+
+// unused stacks kept per size, the rest are unmapped
+constexpr std::size_t maxFreeStacks = 16;
+
+StackPool::Stack::Stack(StackPool &pool, char *base, std::size_t size)
+    : pool_{&pool}
+    , base_{base}
+    , size_{size}
+{}
+
+StackPool::Stack::Stack(Stack &&other) noexcept
+    : pool_{other.pool_}
+    , base_{other.base_}
+    , size_{other.size_}
+{
+    other.base_ = nullptr;
+}
+
+StackPool::Stack::~Stack() {
+    if (base_) {
+        pool_->release_(base_, size_);
+    }
+}
+
+char* StackPool::Stack::top() const {
+    return base_ + size_;
+}
+
+StackPool& StackPool::instance() {
+    // never destroyed, stacks may be released during static destruction
+    static auto pool = new StackPool();
+    return *pool;
+}
+
+StackPool::Stack StackPool::acquire(std::size_t size) {
+    auto page = pageSize_();
+    size = (size + page - 1) / page * page;
+    {
+        std::lock_guard lock(mutex_);
+        auto &stacks = free_[size];
+        if (!stacks.empty()) {
+            auto base = stacks.back();
+            stacks.pop_back();
+            return Stack(*this, base, size);
+        }
+    }
+    // untouched pages cost nothing, only what the child writes to gets backed
+    void *mem = mmap(nullptr, size + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+        throw SandboxError("failed to allocate stack: "s + std::strerror(errno));
+    }
+    if (mprotect(mem, page, PROT_NONE)) {
+        auto err = errno;
+        munmap(mem, size + page);
+        throw SandboxError("failed to set up stack guard page: "s + std::strerror(err));
+    }
+    return Stack(*this, static_cast<char*>(mem) + page, size);
+}
+
+void StackPool::release_(char *base, std::size_t size) {
+    {
+        std::lock_guard lock(mutex_);
+        auto &stacks = free_[size];
+        if (stacks.size() < maxFreeStacks) {
+            stacks.push_back(base);
+            return;
+        }
+    }
+    auto page = pageSize_();
+    munmap(base - page, size + page);
+}
+
+std::size_t StackPool::pageSize_() {
+    static const std::size_t size = sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+} // namespace sandbox
@@ -13,6 +13,12 @@ StatusFile::StatusFile(std::filesystem::path path) : path_{path}
     f.close();
 }
 
+void StatusFile::recordCGroup(const std::string &name) const {
+    std::fstream f(path_, std::ios::out);
+    f << getpid() << '\n' << name << '\n';
+    f.close();
+}
+
 StatusFile::~StatusFile() {
     if (std::filesystem::exists(path_)) {
         if (!std::filesystem::remove(path_)) {
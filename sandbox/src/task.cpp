@@ -1,4 +1,12 @@
 #include "task.h"
+#include "image_copier.h"
+#include "reaper.h"
+#include "cgroup_pool.h"
+#include "loop_image.h"
+#include "time_limiter.h"
+#include "stack_pool.h"
+#include "sampler.h"
+#include "cgroup_monitor.h"
 #include "exceptions.h"
 #include "msg.h"
 
@@ -7,15 +15,58 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/mount.h>
+#include <sys/statvfs.h>
 #include <sys/prctl.h>
 #include <sys/capability.h>
 #include <syscall.h>
 #include <iostream>
+#include <fstream>
 #include <random>
+#include <fcntl.h>
+#include <cstdint>
+#include <algorithm>
+#include <set>
+#include <poll.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
 
-constexpr size_t watcherStackSize = 8*1024*1024;
-static char watcherStack[watcherStackSize];
+// the watcher only waits for its children, it needs far less than the command's stack
+constexpr size_t watcherStackSize = 256*1024;
+
+// what the watcher tells about the command before it exits
+struct WatcherReport {
+    // wait status of the command, -1 if it was never reaped
+    int status = -1;
+    pid_t lastPid = 0;
+    // the limit the watcher killed the command for, if any
+    sandbox::TimeLimiter::Kill kill = sandbox::TimeLimiter::Kill::None;
+    // how late that kill was, or how much CPU time past the limit
+    std::int64_t overrunUs = 0;
+};
+
+// struct clone_args and CLONE_INTO_CGROUP of linux/sched.h (5.7), missing in older kernel headers
+struct Clone3Args {
+    std::uint64_t flags;
+    std::uint64_t pidfd;
+    std::uint64_t childTid;
+    std::uint64_t parentTid;
+    std::uint64_t exitSignal;
+    std::uint64_t stack;
+    std::uint64_t stackSize;
+    std::uint64_t tls;
+    std::uint64_t setTid;
+    std::uint64_t setTidSize;
+    std::uint64_t cgroup;
+};
+constexpr std::uint64_t cloneIntoCGroup = 0x200000000ULL;
+#ifndef CLONE_PIDFD
+#define CLONE_PIDFD 0x00001000
+#endif
 
 
 using namespace std::string_literals;
@@ -34,21 +85,56 @@ Task::Task(std::filesystem::path executable, std::vector<std::string> args, Task
     , watcherVerbose_{watcherVerbose}
     , initPid_{0}
     , taskPid_{0}
+    , pidFd_{-1}
+    , monitored_{false}
     , interrupted_{false}
-    , timeLimitKillerThread_{nullptr}
 {
 }
 
+Task::Task(TaskConstraints constraints, bool watcherVerbose)
+    : Task({}, {}, std::move(constraints), watcherVerbose)
+{}
+
+Task::~Task() {
+    if (frozenNs_) {
+        munmap(frozenNs_, sizeof(*frozenNs_));
+    }
+    if (cpuStatFd_ >= 0) {
+        close(cpuStatFd_);
+    }
+    // a task that was never awaited
+    if (pidFd_ >= 0) {
+        close(pidFd_);
+    }
+}
+
 void Task::cancel() {
+    if (stagingPid_) {
+        // the staging child is ours and unreaped, its pid can't be reused
+        kill(stagingPid_, SIGKILL);
+        return;
+    }
     if (!initPid_) {
         return;
     }
+    // the pidfd can't hit a reused pid, unlike kill()
+    auto signal = [&](int sig) {
+        return pidFd_ >= 0 ? syscall(SYS_pidfd_send_signal, pidFd_, sig, nullptr, 0) : kill(initPid_, sig);
+    };
+    // a frozen task would only see SIGINT once thawed
+    if (preemptedSince_) {
+        try {
+            resume();
+        } catch (SandboxException &e) {
+            impl::Message() << "Warning: failed to resume the task: " << e.what();
+        }
+    }
     if (interrupted_) {
-        if (auto res = kill(initPid_, SIGKILL); res) {
+        if (auto res = signal(SIGKILL); res) {
             impl::Message() << "failed to send SIGKILL: " << std::strerror(errno);
         }
     } else {
-        if (auto res = kill(initPid_, SIGINT); res) {
+        if (auto res = signal(SIGINT); res) {
             impl::Message() << "failed to send SIGINT: " << std::strerror(errno);
         }
         interrupted_ = true;
@@ -56,11 +142,157 @@ void Task::cancel() {
 }
 
 int Task::await() { 
+    // our own time limit, and those of the other tasks of the process, are enforced while we wait
+    auto &limiter = TimeLimiter::instance();
+    auto &sampler = Sampler::instance();
+    auto &monitor = CGroupMonitor::instance();
+    while (true) {
+        if (auto retcode = tryAwait()) {
+            return *retcode;
+        }
+        pollfd fds[3] = {{limiter.fd(), POLLIN, 0}, {sampler.fd(), POLLIN, 0}, {monitor.fd(), POLLIN, 0}};
+        // with neither a pidfd nor a cgroup v2 group, fall back to checking on the watcher every few ms;
+        // the same goes for the moment between the group going empty and the watcher becoming reapable
+        int timeout = monitored_ && !monitor.exited(initPid_) ? -1 : 5;
+        if (poll(fds, 3, timeout) < 0 && errno != EINTR) {
+            throw SandboxException("failed to await the task: "s + std::strerror(errno));
+        }
+        if (fds[0].revents) {
+            limiter.dispatch();
+        }
+        if (fds[1].revents) {
+            sampler.dispatch();
+        }
+        if (fds[2].revents) {
+            monitor.dispatch();
+        }
+    }
+}
+
+std::optional<int> Task::tryAwait() {
     int status;
-    auto pid = waitpid(initPid_, &status, 0);
+    struct rusage usage;
+    // the watcher reaps every process of the task, its rusage covers all of them
+    auto pid = wait4(initPid_, &status, WNOHANG, &usage);
     if (pid < 0) {
         throw SandboxException("failed to await the task: "s + std::strerror(errno));
     }
+    if (pid == 0) {
+        return std::nullopt;
+    }
+    return onExit_(status, usage);
+}
+
+void Task::redirectStdio(int in, int out, int err) {
+    stdio_ = {in, out, err};
+}
+
+void Task::pinToCpu(int cpu) {
+    // the CPU is kept out of exclusive leases from now on
+    coreLease_.emplace(CoreAllocator::instance().share({cpu}));
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(initPid_, sizeof(set), &set)) {
+        throw SandboxError("failed to pin task to CPU " + std::to_string(cpu) + ": " + std::strerror(errno));
+    }
+}
+
+const std::string& Task::id() const {
+    return taskId_;
+}
+
+const TaskConstraints& Task::constraints() const {
+    return constraints_;
+}
+
+std::uint64_t Task::preempt(bool reclaimMemory) {
+    if (preemptedSince_) {
+        return 0;
+    }
+    cgroupHandler_->freeze();
+    preemptedSince_ = std::chrono::steady_clock::now();
+    preemptions_++;
+    // frozen pages are not going to be touched until the task is resumed
+    return reclaimMemory ? cgroupHandler_->reclaimMemory(cgroupHandler_->readStat("memory.current").value_or(0)) : 0;
+}
+
+void Task::resume() {
+    if (!preemptedSince_) {
+        return;
+    }
+    auto frozenFor = std::chrono::steady_clock::now() - *preemptedSince_;
+    auto frozenNs = std::chrono::duration_cast<std::chrono::nanoseconds>(frozenFor);
+    // the watcher is frozen too, its deadline has to move before it runs again
+    if (frozenNs_) {
+        frozenNs_->fetch_add(frozenNs.count());
+    }
+    TimeLimiter::instance().postpone(initPid_, frozenNs);
+    try {
+        cgroupHandler_->thaw();
+    } catch (...) {
+        if (frozenNs_) {
+            frozenNs_->fetch_sub(frozenNs.count());
+        }
+        TimeLimiter::instance().postpone(initPid_, -frozenNs);
+        throw;
+    }
+    preemptedTime_ += std::chrono::duration_cast<std::chrono::microseconds>(frozenFor);
+    preemptedSince_.reset();
+}
+
+bool Task::preempted() const {
+    return preemptedSince_.has_value();
+}
+
+bool Task::cancelled() const {
+    return interrupted_;
+}
+
+int Task::onExit_(int status, const struct rusage &usage) {
+    auto kill = TimeLimiter::instance().takeKill(initPid_);
+    TimeLimiter::instance().remove(initPid_);
+    bool oomKilled = CGroupMonitor::instance().takeOomKill(initPid_);
+    // killed while frozen
+    if (preemptedSince_) {
+        preemptedTime_ += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - *preemptedSince_);
+        preemptedSince_.reset();
+    }
+    CGroupMonitor::instance().remove(initPid_);
+    monitored_ = false;
+    // the last sample sees the final counters, the group is still there
+    Sampler::instance().remove(initPid_);
+    // the command's own status, unless the watcher was killed before it could tell
+    WatcherReport report;
+    bool reported = read(watcher2MainPipefd_[0], &report, sizeof(report)) == sizeof(report);
+    close(watcher2MainPipefd_[0]);
+    // the watcher got there first, or nobody dispatched TimeLimiter in time; it only logs its own kills
+    if (reported && kill == TimeLimiter::Kill::None && report.kill != TimeLimiter::Kill::None) {
+        kill = report.kill;
+        if (kill == TimeLimiter::Kill::RealTime) {
+            impl::Message() << "process has exceeded its time limit (killed " << report.overrunUs << "us late)";
+        } else {
+            auto limitUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::duration<double>(*constraints_.maxCpuTimeSeconds)).count();
+            impl::Message() << "process has exceeded its CPU time limit (used " << limitUs + report.overrunUs << "us of " << limitUs << "us)";
+        }
+    }
+    try {
+        collectAudit_(reported && report.status != -1 ? report.status : status, usage, kill, oomKilled,
+            reported && report.lastPid > 0 ? std::optional<std::uint64_t>(report.lastPid - 1) : std::nullopt);
+    } catch (SandboxException &e) {
+        impl::Message() << "Warning: failed to collect resource usage: " << e.what();
+    }
+    // the cores are free for the next task as soon as this one is over
+    coreLease_.reset();
+    if (pidFd_ >= 0) {
+        close(pidFd_);
+        pidFd_ = -1;
+    }
+    // the watcher exits on its own after killing the command for a time limit, TimeLimiter kills the
+    // watcher itself; whichever was first, it reads the same
+    if (audit_ && (audit_->termination == RunAudit::Termination::TimeLimit || audit_->termination == RunAudit::Termination::CpuTimeLimit)) {
+        status = W_EXITCODE(0, SIGKILL);
+    }
     if (WIFEXITED(status)) {
         impl::Message() << "exited with code: " << WEXITSTATUS(status);
         return WEXITSTATUS(status);
@@ -76,37 +308,192 @@ int Task::await() {
 
 void Task::start() {
     impl::Message() << "Starting task " << taskId_ << "...";
-    if (pipe(main2WatcherPipefd_) < 0 || pipe(watcher2ExecPipefd_) < 0)
+    prepare();
+    launch(executable_, args_);
+}
+
+void Task::prepare() {
+    if (pipe(main2WatcherPipefd_) < 0 || pipe(watcher2ExecPipefd_) < 0 || pipe2(execPipefd_, O_CLOEXEC) < 0
+            || pipe2(watcher2MainPipefd_, O_CLOEXEC | O_NONBLOCK) < 0)
         throw SandboxError("failed to create pipe: " + strerror(errno));
-    unshare_();
     configureCGroup_();
     prepareImage_();
+    limitIo_();
+    shareLimits_();
     startWatcher_();
-    limitTime_();
-    cgroupHandler_->attachTask(initPid_);
+    // the watcher has its copies, ours would only leak when many tasks live in one process
+    for (int fd : {main2WatcherPipefd_[0], watcher2ExecPipefd_[0], watcher2ExecPipefd_[1], execPipefd_[1], watcher2MainPipefd_[1]}) {
+        close(fd);
+    }
     setNiceness_();
     prepareUserns_(initPid_);
-    if (write(main2WatcherPipefd_[1], "OK", 2) != 2)
+    // the exec child needs the uid and gid maps and inherits the niceness, the watcher clones it now
+    if (write(main2WatcherPipefd_[1], "", 1) != 1)
         throw SandboxError("failed to write to pipe: " + strerror(errno));
+    // a byte once the exec child waits for the command, EOF if it failed to get there (await() tells why)
+    char buf;
+    while (read(execPipefd_[0], &buf, 1) < 0 && errno == EINTR);
+}
+
+static void writeString_(std::string &out, const std::string &s) {
+    std::uint32_t size = s.size();
+    out.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    out.append(s);
+}
+
+void Task::launch(std::filesystem::path executable, std::vector<std::string> args, std::optional<std::vector<std::string>> env) {
+    auto startTime = std::chrono::steady_clock::now();
+    launchedAt_ = startTime;
+    executable_ = std::move(executable);
+    args_ = std::move(args);
+    if (!env) {
+        env.emplace();
+        for (char **e = environ; *e; e++) {
+            env->emplace_back(*e);
+        }
+    }
+    env_ = std::move(*env);
+
+    // [size][argc]([size][bytes])...[envc]([size][bytes])... , argv[0] is the executable
+    std::string body;
+    std::uint32_t argc = 1 + args_.size();
+    body.append(reinterpret_cast<const char*>(&argc), sizeof(argc));
+    writeString_(body, executable_.string());
+    for (auto &a : args_) {
+        writeString_(body, a);
+    }
+    std::uint32_t envc = env_.size();
+    body.append(reinterpret_cast<const char*>(&envc), sizeof(envc));
+    for (auto &e : env_) {
+        writeString_(body, e);
+    }
+    std::string msg;
+    writeString_(msg, body);
+    for (std::size_t written = 0; written < msg.size();) {
+        auto n = write(main2WatcherPipefd_[1], msg.data() + written, msg.size() - written);
+        if (n < 0)
+            throw SandboxError("failed to write to pipe: " + strerror(errno));
+        written += n;
+    }
     if (close(main2WatcherPipefd_[1]))
         throw SandboxError("failed to close pipe: " + strerror(errno));
+    // the watcher starts its own clocks once it reads the command
+    limitTime_();
+    monitor_();
+    startSampling_();
+
+    char buf;
+    while (read(execPipefd_[0], &buf, 1) < 0 && errno == EINTR);
+    close(execPipefd_[0]);
+    launchLatency_ = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime);
 }
 
-void Task::unshare_() {
-    int flags = CLONE_NEWCGROUP;
-    if (constraints_.newNetwork) {
-        flags |= CLONE_NEWNET;
+void Task::dismiss() {
+    if (!initPid_) {
+        return;
+    }
+    // the watcher reads EOF instead of a command and exits
+    close(main2WatcherPipefd_[1]);
+    if (cpuStatFd_ >= 0) {
+        close(cpuStatFd_);
+        cpuStatFd_ = -1;
     }
-    if (unshare(flags)) {
-        throw SandboxError("failed to unshare namespaces: "s + std::strerror(errno));
+    close(execPipefd_[0]);
+    close(watcher2MainPipefd_[0]);
+    if (pidFd_ >= 0) {
+        close(pidFd_);
+        pidFd_ = -1;
     }
+    if (waitpid(initPid_, nullptr, 0) < 0) {
+        impl::Message() << "Warning: failed to await dismissed task " << taskId_ << ": " << std::strerror(errno);
+    }
+    initPid_ = 0;
+}
+
+std::chrono::microseconds Task::launchLatency() const {
+    return launchLatency_;
 }
 
 void Task::cleanupImageDir() {
     if (constraints_.fsImage && constraints_.fsImage != "/") {
         impl::Message() << "Removing: " << root_ << std::endl;
-        std::filesystem::remove_all(root_);
+        // both dirs are kept with a trailing slash, parent_path() drops it
+        auto taskDir = root_.parent_path();
+        Reaper reaper{taskDir.parent_path()};
+        reaper.discard(taskDir);
+        if (!overlayDir_.empty()) {
+            reaper.discard(overlayDir_.parent_path());
+        }
+        reaper.spawn();
+    }
+}
+
+int Task::stageImage() {
+    using ImageMode = TaskConstraints::ImageMode;
+    if (!constraints_.fsImage)
+        return -1;
+    bool imageFile = LoopImage::isImageFile(*constraints_.fsImage);
+    bool cached = constraints_.imageCacheDir && !imageFile;
+    bool copy = constraints_.imageMode == ImageMode::Copy;
+    if (!cached && !copy)
+        return -1;
+    root_ = std::filesystem::absolute(taskId_ + ".d/");
+    stagingPid_ = fork();
+    if (stagingPid_ < 0) {
+        throw SandboxError("failed to start staging the image: "s + std::strerror(errno));
+    }
+    if (stagingPid_ == 0) {
+        // the client connections of a daemon must not stay open for as long as the copy takes
+        close_range(STDERR_FILENO + 1, ~0U, 0);
+        try {
+            auto source = *constraints_.fsImage;
+            std::optional<LoopImage::Lease> loopLease;
+            std::optional<ImageCache::Lease> imageLease;
+            if (imageFile) {
+                loopLease.emplace(LoopImage{source}.mount(std::filesystem::current_path()));
+                source = loopLease->root();
+            } else if (cached) {
+                imageLease.emplace(ImageCache{*constraints_.imageCacheDir, constraints_.imageCacheMaxBytes}.acquire(source));
+                source = imageLease->root();
+            }
+            if (copy) {
+                std::filesystem::create_directories(root_);
+                auto stats = ImageCopier{}.copy(source, root_);
+                impl::Message() << "Copied " << stats.files << " files, " << stats.dirs << " dirs in " << stats.seconds << "s";
+            }
+        } catch (std::exception &e) {
+            impl::Message() << "Failed to stage the image: " << e.what();
+            _exit(1);
+        } catch (SandboxException &e) {
+            impl::Message() << "Failed to stage the image: " << e.what();
+            _exit(1);
+        }
+        // the caller's destructors (cgroup, status file) must not run here
+        _exit(0);
+    }
+    stagingFd_ = syscall(SYS_pidfd_open, stagingPid_, 0);
+    if (stagingFd_ < 0) {
+        auto err = errno;
+        kill(stagingPid_, SIGKILL);
+        waitpid(stagingPid_, nullptr, 0);
+        stagingPid_ = 0;
+        throw SandboxError("failed to watch the staging process: "s + std::strerror(err));
+    }
+    return stagingFd_;
+}
+
+void Task::awaitStagedImage() {
+    if (!stagingPid_)
+        return;
+    int status;
+    while (waitpid(stagingPid_, &status, 0) < 0 && errno == EINTR);
+    close(stagingFd_);
+    stagingPid_ = 0;
+    stagingFd_ = -1;
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        throw SandboxException("failed to stage the image, see the log");
     }
+    imageStaged_ = constraints_.imageMode == TaskConstraints::ImageMode::Copy;
 }
 
 void Task::prepareImage_() {
@@ -114,62 +501,234 @@ void Task::prepareImage_() {
         return;
     impl::Message() << "Preparing image...";
 
+    using ImageMode = TaskConstraints::ImageMode;
+    imageSource_ = *constraints_.fsImage;
+    if (LoopImage::isImageFile(imageSource_)) {
+        if (constraints_.imageCacheDir) {
+            impl::Message() << "Warning: image files are mounted as is, image cache is not used";
+        }
+        loopLease_.emplace(LoopImage{imageSource_}.mount(std::filesystem::current_path()));
+        imageSource_ = loopLease_->root();
+    } else if (constraints_.imageCacheDir) {
+        if (constraints_.imageMode == ImageMode::Copy) {
+            impl::Message() << "Warning: image cache only saves the copy of the image in overlay modes";
+        }
+        ImageCache cache{*constraints_.imageCacheDir, constraints_.imageCacheMaxBytes};
+        imageLease_.emplace(cache.acquire(*constraints_.fsImage));
+        imageSource_ = imageLease_->root();
+    }
     root_ = std::filesystem::absolute(taskId_ + ".d/");
-    auto copyOpts = std::filesystem::copy_options{std::filesystem::copy_options::recursive};
+    // mount points for files added with -a live in the image copy or in the overlay upper layer
+    auto mappingRoot = root_;
     try {
         std::filesystem::create_directories(root_);
-        copy(*constraints_.fsImage, root_, copyOpts);
+        if (imageStaged_) {
+            impl::Message() << "Image was copied by the staging process";
+        } else if (constraints_.imageMode == ImageMode::Copy) {
+            auto stats = ImageCopier{}.copy(imageSource_, root_);
+            auto bytes = stats.bytesCloned + stats.bytesCopied;
+            impl::Message() << "Copied " << stats.files << " files, " << stats.dirs << " dirs, " << stats.links << " hardlinks in " << stats.seconds << "s: "
+                << stats.bytesCloned / 1e6 << " MB reflinked, " << stats.bytesCopied / 1e6 << " MB copied ("
+                << (stats.seconds > 0 ? bytes / 1e6 / stats.seconds : 0) << " MB/s)";
+        } else {
+            overlayDir_ = std::filesystem::absolute(taskId_ + ".overlay.d/");
+            std::filesystem::create_directories(overlayDir_);
+            if (constraints_.imageMode == ImageMode::Overlay) {
+                mappingRoot = overlayDir_ / "upper";
+                std::filesystem::create_directories(overlayDir_ / "upper");
+                std::filesystem::create_directories(overlayDir_ / "work");
+            }
+        }
     } catch (std::exception &e) {
-        throw SandboxException("failed to copy fs image: "s + e.what());
+        throw SandboxException("failed to prepare fs image: "s + e.what());
     }
     for (auto &m : constraints_.fileMapping) {
-        try {
-            if (std::filesystem::is_directory(m.from)) {
-                std::filesystem::create_directories(m.to);
-            } else {
-                std::filesystem::create_directories(m.to.parent_path());
-            }
-            auto fp = m.to.string();
-            if (fp.starts_with("/")) fp = fp.substr(1);
-            copy(m.from, root_ / fp, copyOpts);
-        } catch (std::exception &e) {
-            throw SandboxException("failed to copy "s + m.from.string() + " to "s + (m.to).string() + ": "s + e.what());
+        // the exec child binds the host path before pivot_root, resolve it relative to our cwd now
+        auto from = std::filesystem::absolute(m.from);
+        if (!std::filesystem::exists(from)) {
+            throw SandboxError("cannot map " + m.from.string() + ": no such file or directory");
         }
+        mappings_.push_back({from, m.to, m.writable});
+        if (constraints_.imageMode != ImageMode::OverlayTmpfs) {
+            createMountPoint_(mappingRoot, mappings_.back());
+        }
+    }
+    std::vector<std::filesystem::path> owned{root_};
+    if (constraints_.imageMode == ImageMode::Overlay) {
+        // the task's root (in its user namespace) must be able to write into the upper layer
+        owned.insert(owned.end(), {overlayDir_, overlayDir_ / "upper", overlayDir_ / "work"});
     }
-    if (chown(root_.c_str(), constraints_.uid, constraints_.gid)) {
-        throw SandboxError("failed to chown image: "s + std::strerror(errno));
+    for (auto &p : owned) {
+        if (chown(p.c_str(), constraints_.uid, constraints_.gid)) {
+            throw SandboxError("failed to chown " + p.string() + ": " + std::strerror(errno));
+        }
     }
     impl::Message() << "Image is ready";
 }
 
 void Task::startWatcher_() {
-    int flags = SIGCHLD | CLONE_NEWPID | CLONE_NEWUSER;
-    initPid_ = clone(impl::execWatcher, watcherStack + watcherStackSize, flags, this);
+    // the watcher's and not ours: a daemon or a batch runner goes on starting tasks in its own namespaces
+    int namespaces = CLONE_NEWPID | CLONE_NEWUSER | CLONE_NEWCGROUP | (constraints_.newNetwork ? CLONE_NEWNET : 0);
+    // born in the task's cgroup, the watcher never runs outside of its limits, and the pidfd comes for free
+    int cgroupFd = cgroupHandler_->openDir();
+    if (cgroupFd >= 0) {
+        Clone3Args args{};
+        args.flags = namespaces | CLONE_PIDFD | cloneIntoCGroup;
+        args.pidfd = reinterpret_cast<std::uint64_t>(&pidFd_);
+        args.exitSignal = SIGCHLD;
+        args.cgroup = cgroupFd;
+        // no stack: like fork, the child goes on with a copy of ours
+        pid_t pid = syscall(SYS_clone3, &args, sizeof(args));
+        if (pid == 0) {
+            _exit(impl::execWatcher(this));
+        }
+        auto err = errno;
+        close(cgroupFd);
+        if (pid > 0) {
+            initPid_ = pid;
+            return;
+        }
+        // ENOSYS, E2BIG: no clone3 or no cgroup field, EINVAL/EOPNOTSUPP: cgroup v1 or a domain cgroup
+        if (err != ENOSYS && err != E2BIG && err != EINVAL && err != EOPNOTSUPP)
+            throw SandboxError("failed to start watcher: "s + strerror(err));
+        pidFd_ = -1;
+    }
+    int flags = SIGCHLD | namespaces;
+    auto stack = StackPool::instance().acquire(watcherStackSize);
+    initPid_ = clone(impl::execWatcher, stack.top(), flags, this);
     if (initPid_ == -1)
         throw SandboxError("failed to start watcher: " + strerror(errno));
+    pidFd_ = syscall(SYS_pidfd_open, initPid_, 0);
+    cgroupHandler_->attachTask(initPid_);
+}
+
+static bool readAll_(int fd, char *buf, std::size_t size) {
+    while (size) {
+        auto n = read(fd, buf, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        size -= n;
+    }
+    return true;
+}
+
+// pipe ends of other tasks living in the same process must not be kept open by forked helpers,
+// or those pipes would never see EOF
+static void closeInheritedFds_(const std::vector<int> &keep) {
+    std::vector<int> inherited;
+    std::error_code ec;
+    for (auto &e : std::filesystem::directory_iterator("/proc/self/fd", ec)) {
+        int fd = std::stoi(e.path().filename().string());
+        if (fd > STDERR_FILENO && std::find(keep.begin(), keep.end(), fd) == keep.end()) {
+            inherited.push_back(fd);
+        }
+    }
+    for (int fd : inherited) {
+        close(fd);
+    }
 }
 
 void Task::watcher_() {
-    signal(SIGINT, [](int a) -> void {
-        static bool interrupted = false;
-        if (interrupted) return;
-        kill(-1, SIGINT);
-    });
-    char buf[2];
-    if (read(main2WatcherPipefd_[0], buf, 2) != 2)
-        throw SandboxError("failed to read from pipe: "s + strerror(errno));
-    if (close(main2WatcherPipefd_[0])) 
-        throw SandboxError("failed to close pipe: "s + strerror(errno));
+    // handlers of a daemon that hosts this task are not meant for the watcher
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    // an exec child that failed to set up leaves the command pipe without a reader, its status tells why
+    signal(SIGPIPE, SIG_IGN);
+    // only ever taken from the signalfd, so that not even the earliest exit of the command is missed
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    if (sigprocmask(SIG_BLOCK, &mask, nullptr))
+        throw SandboxError("(watcher) failed to block signals: "s + std::strerror(errno));
+    // the fds are created afterwards, it closes whatever it doesn't know about
+    std::vector<int> keep{main2WatcherPipefd_[0], watcher2ExecPipefd_[0], watcher2ExecPipefd_[1], execPipefd_[0], execPipefd_[1], watcher2MainPipefd_[1], cpuStatFd_};
+    if (stdio_) {
+        keep.insert(keep.end(), stdio_->begin(), stdio_->end());
+    }
+    closeInheritedFds_(keep);
+    // the exec child sets up its mount namespace while we wait for the command, once it can become root
+    char ready;
+    if (!readAll_(main2WatcherPipefd_[0], &ready, 1)) {
+        // dismissed before launch, the objects of the parent we share memory image with are not ours to destroy
+        _exit(0);
+    }
+    int signalFd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (signalFd < 0)
+        throw SandboxError("(watcher) failed to watch signals: "s + std::strerror(errno));
+    // an interrupt of a watcher that isn't even prepared yet is not meant for the command
+    signalfd_siginfo info;
+    while (read(signalFd, &info, sizeof(info)) == sizeof(info));
     clone_();
+    bool interrupted = awaitCommand_(signalFd);
+    forwardCommand_();
+    // the time limits count from here, like those of TimeLimiter from the moment the command is sent
+    auto received = std::chrono::steady_clock::now();
+    auto cpuBaselineUs = cpuStatFd_ >= 0 ? TimeLimiter::readUsage(cpuStatFd_) : std::nullopt;
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    if (epollFd < 0 || epoll_ctl(epollFd, EPOLL_CTL_ADD, signalFd, &ev))
+        throw SandboxError("(watcher) failed to watch signals: "s + std::strerror(errno));
+    // hangs up once the command is exec'd (or the exec child is gone), interrupts wait for that
+    int execFd = execPipefd_[0];
+    ev.events = 0;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, execFd, &ev))
+        throw SandboxError("(watcher) failed to watch the exec: "s + std::strerror(errno));
+    ev.events = EPOLLIN;
+    // the limits hold even when whoever started the task is too busy to dispatch TimeLimiter
+    int timerFd = -1;
+    if (frozenNs_ || cpuBaselineUs) {
+        timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        if (timerFd < 0 || epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &ev))
+            throw SandboxError("(watcher) failed to watch the time limits: "s + std::strerror(errno));
+    }
     int retcode = 71;
+    WatcherReport report;
+    if (timerFd >= 0) {
+        enforceLimits_(timerFd, received, cpuBaselineUs, report.kill, report.overrunUs);
+    }
     int status;
     pid_t pid;
     while (true) {
-        pid = waitpid(-1, &status, 0);
-        if (errno == ECHILD) break;
+        pid = waitpid(-1, &status, WNOHANG);
+        if (pid < 0 && errno == ECHILD) break;
+        if (pid < 0 && errno == EINTR) continue;
         if (pid < 0) {
             throw SandboxException("(watcher) failed to await the task: "s + std::strerror(errno));
         }
+        if (pid == 0) {
+            // the exec child discards what interrupts it before the exec, those of the command wait for it
+            pollfd exec{execFd, 0, 0};
+            if (execFd >= 0 && poll(&exec, 1, 0) > 0) {
+                close(execFd);
+                execFd = -1;
+            }
+            if (interrupted && execFd < 0) {
+                // we are pid 1 of the task's pid namespace, this reaches every process of the task
+                kill(-1, SIGINT);
+                interrupted = false;
+            }
+            // everything exited is reaped, sleep until the next SIGCHLD, SIGINT or the exec
+            if (epoll_wait(epollFd, &ev, 1, -1) < 0 && errno != EINTR)
+                throw SandboxException("(watcher) failed to wait for signals: "s + std::strerror(errno));
+            while (read(signalFd, &info, sizeof(info)) == sizeof(info)) {
+                interrupted |= info.ssi_signo == SIGINT;
+            }
+            std::uint64_t expirations;
+            if (timerFd >= 0 && read(timerFd, &expirations, sizeof(expirations)) == sizeof(expirations)
+                    && report.kill == TimeLimiter::Kill::None) {
+                enforceLimits_(timerFd, received, cpuBaselineUs, report.kill, report.overrunUs);
+            }
+            continue;
+        }
+        if (pid == taskPid_) {
+            report.status = status;
+        }
         if (pid == taskPid_ && WIFEXITED(status)) {
             retcode = WEXITSTATUS(status);
         }
@@ -183,7 +742,95 @@ void Task::watcher_() {
             impl::Message() << "(watcher) pid " << pid << " stopped by signal: " << WSTOPSIG(status) << " (" << strsignal(WTERMSIG(status)) << ")";
         }
     }
-    exit(retcode);
+    // the last pid handed out in our pid namespace, where we are pid 1
+    std::ifstream("/proc/sys/kernel/ns_last_pid") >> report.lastPid;
+    [[maybe_unused]] auto res = write(watcher2MainPipefd_[1], &report, sizeof(report));
+    // like a dismissed watcher: the image leases, the status file and the rest of the parent's objects
+    // in our copy of its memory are not ours to release
+    _exit(retcode);
+}
+
+bool Task::awaitCommand_(int signalFd) {
+    // an interrupt while idle (of a zygote's terminal) is not meant for the command we get later, but
+    // cancel() only ever comes once the command is there
+    pollfd fds[2] = {{main2WatcherPipefd_[0], POLLIN, 0}, {signalFd, POLLIN, 0}};
+    while (true) {
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
+            throw SandboxError("(watcher) failed to wait for the command: "s + std::strerror(errno));
+        bool interrupted = false;
+        signalfd_siginfo info;
+        while (read(signalFd, &info, sizeof(info)) == sizeof(info)) {
+            interrupted |= info.ssi_signo == SIGINT;
+        }
+        // looked at after the signals, so a cancel() that came with the command is never dropped
+        if (poll(fds, 1, 0) > 0) {
+            return interrupted;
+        }
+    }
+}
+
+void Task::forwardCommand_() {
+    std::uint32_t size;
+    if (!readAll_(main2WatcherPipefd_[0], reinterpret_cast<char*>(&size), sizeof(size))) {
+        // dismissed before launch, the exec child goes with our pid namespace
+        _exit(0);
+    }
+    std::string msg(sizeof(size) + size, '\0');
+    std::memcpy(msg.data(), &size, sizeof(size));
+    if (!readAll_(main2WatcherPipefd_[0], msg.data() + sizeof(size), size))
+        throw SandboxError("(watcher) failed to read the command from pipe: "s + strerror(errno));
+    if (close(main2WatcherPipefd_[0]))
+        throw SandboxError("(watcher) failed to close pipe: "s + strerror(errno));
+    for (std::size_t written = 0; written < msg.size();) {
+        auto n = write(watcher2ExecPipefd_[1], msg.data() + written, msg.size() - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        // EPIPE: the exec child is gone already
+        if (n < 0)
+            break;
+        written += n;
+    }
+    if (close(watcher2ExecPipefd_[1]))
+        throw SandboxError("(watcher) failed to close pipe: "s + strerror(errno));
+}
+
+void Task::receiveCommand_() {
+    std::uint32_t size;
+    if (!readAll_(watcher2ExecPipefd_[0], reinterpret_cast<char*>(&size), sizeof(size))) {
+        // the watcher was dismissed and is gone, and so are we in a moment
+        _exit(0);
+    }
+    std::string body(size, '\0');
+    if (!readAll_(watcher2ExecPipefd_[0], body.data(), size))
+        throw SandboxError("failed to read the command from pipe: "s + strerror(errno));
+    if (close(watcher2ExecPipefd_[0]))
+        throw SandboxError("failed to close pipe: "s + strerror(errno));
+
+    std::size_t pos = 0;
+    auto take = [&](std::size_t n) {
+        if (pos + n > body.size())
+            throw SandboxError("malformed command received from pipe");
+        pos += n;
+        return body.data() + pos - n;
+    };
+    auto takeString = [&]() {
+        std::uint32_t len;
+        std::memcpy(&len, take(sizeof(len)), sizeof(len));
+        return std::string(take(len), len);
+    };
+    std::uint32_t argc;
+    std::memcpy(&argc, take(sizeof(argc)), sizeof(argc));
+    executable_ = takeString();
+    args_.clear();
+    for (std::uint32_t i = 1; i < argc; i++) {
+        args_.push_back(takeString());
+    }
+    std::uint32_t envc;
+    std::memcpy(&envc, take(sizeof(envc)), sizeof(envc));
+    env_.clear();
+    for (std::uint32_t i = 0; i < envc; i++) {
+        env_.push_back(takeString());
+    }
 }
 
 int impl::execCmd(void* arg) {
@@ -211,17 +858,15 @@ int impl::execWatcher(void* arg) {
 
 void Task::clone_() {
     int flags = SIGCHLD | CLONE_NEWNS | CLONE_NEWIPC;
-    errno = 0;
-    char* stack = reinterpret_cast<char*>(malloc(constraints_.stackSize));
-    if (!stack && errno) {
-        throw SandboxError("failed to allocate memory for task's stack: " + strerror(errno));
-    }
-    taskPid_ = clone(impl::execCmd, stack + constraints_.stackSize, flags, this);
+    // not CLONE_VM: the child runs on its own copy, ours goes back to the pool right away
+    auto stack = StackPool::instance().acquire(constraints_.stackSize);
+    taskPid_ = clone(impl::execCmd, stack.top(), flags, this);
     if (taskPid_ == -1)
         throw SandboxError("failed to clone: " + strerror(errno));
-    if (write(watcher2ExecPipefd_[1], "OK", 2) != 2)
-        throw SandboxError("failed to write to pipe: " + strerror(errno));
-    if (close(watcher2ExecPipefd_[1]))
+    if (close(watcher2ExecPipefd_[0]))
+        throw SandboxError("failed to close pipe: " + strerror(errno));
+    // the exec child holds the only write end now
+    if (close(execPipefd_[1]))
         throw SandboxError("failed to close pipe: " + strerror(errno));
 }
 
@@ -236,18 +881,113 @@ void Task::setNiceness_() {
 
 void Task::limitTime_() {
     if (constraints_.maxRealTimeSeconds) {
-        pid_t pid = fork();
-        if (pid) return;
-        cgroupHandler_->disown();
-        prctl(PR_SET_PDEATHSIG, SIGKILL);
-        using namespace std::chrono;
-        std::this_thread::sleep_for(milliseconds(static_cast<uint64_t>(*constraints_.maxRealTimeSeconds * 1000)));
-        impl::Message() << "process has exceeded its time limit";
-        if (auto res = kill(initPid_, SIGKILL); res) {
-            impl::Message() << "(out if time) failed to send SIGKILL: " << std::strerror(errno);
+        TimeLimiter::instance().add(initPid_, pidFd_, std::chrono::duration<double>(*constraints_.maxRealTimeSeconds));
+    }
+    if (cpuStatFd_ >= 0) {
+        // the watcher keeps its own copy
+        TimeLimiter::instance().addCpuLimit(initPid_, pidFd_, std::exchange(cpuStatFd_, -1),
+            std::chrono::duration<double>(*constraints_.maxCpuTimeSeconds), cpuParallelism());
+    }
+}
+
+void Task::shareLimits_() {
+    if (constraints_.maxRealTimeSeconds && !frozenNs_) {
+        void *mem = mmap(nullptr, sizeof(*frozenNs_), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            throw SandboxError("failed to map memory shared with the watcher: "s + strerror(errno));
+        frozenNs_ = new (mem) std::atomic<std::int64_t>(0);
+    }
+    if (constraints_.maxCpuTimeSeconds) {
+        int dirFd = cgroupHandler_->openDir();
+        cpuStatFd_ = dirFd >= 0 ? openat(dirFd, "cpu.stat", O_RDONLY | O_CLOEXEC) : -1;
+        auto err = errno;
+        if (dirFd >= 0) close(dirFd);
+        if (cpuStatFd_ < 0)
+            throw SandboxError("CPU time limit needs the cpu.stat of a cgroup v2 group: "s + strerror(err));
+    }
+}
+
+void Task::enforceLimits_(int timerFd, std::chrono::steady_clock::time_point received,
+        std::optional<std::uint64_t> cpuBaselineUs, TimeLimiter::Kill &killed, std::int64_t &overrunUs) {
+    using namespace std::chrono;
+    auto now = steady_clock::now();
+    std::optional<steady_clock::time_point> next;
+    if (auto &limit = constraints_.maxRealTimeSeconds) {
+        auto deadline = received + duration_cast<nanoseconds>(duration<double>(*limit)) + nanoseconds(frozenNs_->load());
+        if (now >= deadline) {
+            killed = TimeLimiter::Kill::RealTime;
+            overrunUs = duration_cast<microseconds>(now - deadline).count();
         }
-        exit(0);
+        next = deadline;
     }
+    auto usage = cpuBaselineUs ? TimeLimiter::readUsage(cpuStatFd_) : std::nullopt;
+    if (usage && killed == TimeLimiter::Kill::None) {
+        auto limit = duration_cast<microseconds>(duration<double>(*constraints_.maxCpuTimeSeconds));
+        microseconds used(*usage - *cpuBaselineUs);
+        if (used >= limit) {
+            killed = TimeLimiter::Kill::CpuTime;
+            overrunUs = (used - limit).count();
+        }
+        // the same schedule as TimeLimiter: the rest can't be used up sooner than with every CPU busy
+        auto at = now + std::max<nanoseconds>(duration_cast<nanoseconds>((limit - used) / std::max(cpuParallelism(), 1.0)), milliseconds(1));
+        next = next ? std::min(*next, at) : at;
+    }
+    if (killed != TimeLimiter::Kill::None) {
+        if (watcherVerbose_) {
+            impl::Message() << "(watcher) the command has exceeded its " << (killed == TimeLimiter::Kill::RealTime ? "" : "CPU ") << "time limit";
+        }
+        // we are pid 1 of the task's pid namespace, this reaches every process of the task
+        kill(-1, SIGKILL);
+        return;
+    }
+    if (next) {
+        auto ns = std::max<std::int64_t>(duration_cast<nanoseconds>(*next - now).count(), 1);
+        itimerspec spec{};
+        spec.it_value.tv_sec = ns / 1'000'000'000;
+        spec.it_value.tv_nsec = ns % 1'000'000'000;
+        timerfd_settime(timerFd, 0, &spec, nullptr);
+    }
+}
+
+void Task::monitor_() {
+    int dirFd = cgroupHandler_->openDir();
+    try {
+        monitored_ = CGroupMonitor::instance().add(initPid_, pidFd_, dirFd);
+    } catch (...) {
+        if (dirFd >= 0) close(dirFd);
+        throw;
+    }
+    if (dirFd >= 0) close(dirFd);
+}
+
+void Task::startSampling_() {
+    if (!constraints_.sampleFile) {
+        return;
+    }
+    int dirFd = cgroupHandler_->openDir();
+    if (dirFd < 0)
+        throw SandboxError("sampling needs a cgroup v2 group: "s + strerror(errno));
+    try {
+        Sampler::instance().add(initPid_, taskId_, dirFd, constraints_.sampleInterval, *constraints_.sampleFile);
+    } catch (...) {
+        close(dirFd);
+        throw;
+    }
+    close(dirFd);
+}
+
+double Task::cpuParallelism() {
+    // the cpuset, if any, is already applied to the watcher's affinity
+    cpu_set_t set;
+    double cpus = sched_getaffinity(initPid_, sizeof(set), &set) ? 1 : CPU_COUNT(&set);
+    if (auto &bw = constraints_.cpuBandwidth) {
+        cpus = std::min(cpus, static_cast<double>(bw->quotaUs) / bw->periodUs);
+    }
+    return cpus;
+}
+
+std::optional<std::uint64_t> Task::cpuUsage() {
+    return cgroupHandler_ ? cgroupHandler_->readStat("cpu.stat", "usage_usec") : std::nullopt;
 }
 
 void Task::clearCapabilities_() {
@@ -277,13 +1017,115 @@ void Task::prepareProcfs_() {
         throw SandboxError("failed to mount proc: "s + strerror(errno));
 }
 
+void Task::mountImage_() {
+    if (constraints_.imageMode == TaskConstraints::ImageMode::Copy) {
+        if (mount(root_.c_str(), root_.c_str(), "ext4", MS_BIND, ""))
+            throw SandboxError("failed to mount image at " + root_.string() + ": " + strerror(errno));
+        return;
+    }
+    if (constraints_.imageMode == TaskConstraints::ImageMode::OverlayTmpfs) {
+        if (mount("tmpfs", overlayDir_.c_str(), "tmpfs", 0, tmpfsOptions_("0755").c_str()))
+            throw SandboxError("failed to mount tmpfs at " + overlayDir_.string() + ": " + strerror(errno));
+        for (auto dir : {"upper", "work"}) {
+            if (mkdir((overlayDir_ / dir).c_str(), 0755))
+                throw SandboxError("failed to mkdir " + (overlayDir_ / dir).string() + ": " + strerror(errno));
+        }
+        for (auto &m : mappings_) {
+            createMountPoint_(overlayDir_ / "upper", m);
+        }
+    }
+    mountOverlay_();
+}
+
+void Task::createMountPoint_(const std::filesystem::path &base, const TaskConstraints::FileMapping &m) {
+    auto target = base / m.to.relative_path();
+    try {
+        if (std::filesystem::is_directory(m.from)) {
+            std::filesystem::create_directories(target);
+        } else {
+            std::filesystem::create_directories(target.parent_path());
+            if (!std::filesystem::exists(target)) {
+                std::ofstream{target};
+            }
+        }
+    } catch (std::exception &e) {
+        throw SandboxException("failed to create mount point for "s + m.to.string() + ": "s + e.what());
+    }
+}
+
+void Task::mountMappings_() {
+    for (auto &m : mappings_) {
+        auto target = root_ / m.to.relative_path();
+        if (mount(m.from.c_str(), target.c_str(), nullptr, MS_BIND | MS_REC, nullptr))
+            throw SandboxError("failed to bind " + m.from.string() + " to " + m.to.string() + ": " + strerror(errno));
+        if (m.writable)
+            continue;
+        // a remount inside a user namespace must keep the locked flags of the source mount
+        struct statvfs st;
+        if (statvfs(m.from.c_str(), &st))
+            throw SandboxError("failed to statvfs " + m.from.string() + ": " + strerror(errno));
+        unsigned long flags = MS_BIND | MS_REMOUNT | MS_RDONLY;
+        if (st.f_flag & ST_NOSUID) flags |= MS_NOSUID;
+        if (st.f_flag & ST_NODEV) flags |= MS_NODEV;
+        if (st.f_flag & ST_NOEXEC) flags |= MS_NOEXEC;
+        if (st.f_flag & ST_NOATIME) flags |= MS_NOATIME;
+        if (st.f_flag & ST_NODIRATIME) flags |= MS_NODIRATIME;
+        if (st.f_flag & ST_RELATIME) flags |= MS_RELATIME;
+        if (mount(nullptr, target.c_str(), nullptr, flags, nullptr))
+            throw SandboxError("failed to remount " + m.to.string() + " read-only: " + strerror(errno));
+    }
+}
+
+void Task::mountOverlay_() {
+    auto lower = std::filesystem::absolute(imageSource_).string();
+    auto upper = (overlayDir_ / "upper").string();
+    auto work = (overlayDir_ / "work").string();
+    for (auto &p : {lower, upper, work}) {
+        if (p.find_first_of(",:") != std::string::npos)
+            throw SandboxError("overlay layer path must not contain ',' or ':': " + p);
+    }
+    // userxattr lets overlayfs keep its metadata in user.* xattrs, which is required inside a user namespace
+    auto opts = "lowerdir=" + lower + ",upperdir=" + upper + ",workdir=" + work + ",userxattr";
+    if (mount("overlay", root_.c_str(), "overlay", 0, opts.c_str()))
+        throw SandboxError("failed to mount overlay at " + root_.string() + ": " + strerror(errno));
+}
+
+void Task::mountScratch_() {
+    if (!constraints_.scratchDir)
+        return;
+    auto &dir = *constraints_.scratchDir;
+    // without an image the root is the host's, a mount point made there would outlive the task
+    if (!constraints_.fsImage) {
+        struct stat st;
+        if (stat(dir.c_str(), &st) || !S_ISDIR(st.st_mode))
+            throw SandboxError("--scratch without --fs-image needs an existing directory to mount over: " + dir.string());
+    } else if (mkdir(dir.c_str(), 0755) && errno != EEXIST) {
+        throw SandboxError("failed to mkdir " + dir.string() + ": " + strerror(errno));
+    }
+    if (mount("tmpfs", dir.c_str(), "tmpfs", MS_NOSUID | MS_NODEV, tmpfsOptions_("1777").c_str()))
+        throw SandboxError("failed to mount scratch tmpfs at " + dir.string() + ": " + strerror(errno));
+}
+
+std::string Task::tmpfsOptions_(const char *mode) {
+    auto opts = "mode="s + mode;
+    if (constraints_.tmpfsMaxBytes)
+        opts += ",size=" + std::to_string(*constraints_.tmpfsMaxBytes);
+    if (constraints_.tmpfsMaxInodes)
+        opts += ",nr_inodes=" + std::to_string(*constraints_.tmpfsMaxInodes);
+    return opts;
+}
+
 void Task::prepareMntns_() {
-    if (constraints_.fsImage == std::nullopt) 
+    if (constraints_.fsImage == std::nullopt) {
+        mountScratch_();
+        if (chdir(constraints_.workDir.c_str()))
+            throw SandboxError("failed to chdir to working directory: " + strerror(errno));
         return;
-    std::string mnt = root_;
-    if (mount(root_.c_str(), mnt.c_str(), "ext4", MS_BIND, ""))
-        throw SandboxError("failed to mount image at " + mnt + ": " + strerror(errno));
+    }
+    mountImage_();
+    mountMappings_();
 
+    std::string mnt = root_;
     if (chdir(mnt.c_str()))
         throw SandboxError("failed to chdir to image mounted at " + mnt + ": " + strerror(errno));
     
@@ -302,6 +1144,8 @@ void Task::prepareMntns_() {
     if (umount2(put_old.c_str(), MNT_DETACH))
         throw SandboxError("failed to umount " + put_old + ": " + strerror(errno));
 
+    mountScratch_();
+
     if (chdir(constraints_.workDir.c_str()))
         throw SandboxError("failed to chdir to working directory: " + strerror(errno));
 }
@@ -340,27 +1184,120 @@ void Task::prepareUserns_(pid_t pid) {
 }
 
 void Task::configureCGroup_() {
-    cgroupHandler_ = std::make_unique<CGroupHandler>(taskId_.c_str());
-    
+    auto &pool = CGroupPool::instance();
+    if (pool.enabled()) {
+        // limits go straight to the already existing group
+        cgroupHandler_ = pool.acquire();
+    } else {
+        cgroupHandler_ = std::make_unique<CGroupHandler>(taskId_.c_str());
+    }
+    if (CGroupHandler::backend() == CGroupHandler::Backend::Native) {
+        // the freezer may run in another group than this process
+        statusFile_.recordCGroup(CGroupHandler::root() / cgroupHandler_->name());
+    }
+
     if (constraints_.maxMemoryBytes) {
-        cgroupHandler_->limitMemory(*constraints_.maxMemoryBytes);
+        cgroupHandler_->limitMemory(*constraints_.maxMemoryBytes, constraints_.maxSwapBytes);
     }
     if (constraints_.maxForks) {
         cgroupHandler_->limitProcesses(*constraints_.maxForks);
     }
+    auto &allocator = CoreAllocator::instance();
+    if (constraints_.exclusiveCores) {
+        coreLease_.emplace(allocator.allocate(*constraints_.exclusiveCores));
+        impl::Message() << "Task got CPUs " << coreLease_->cpus();
+    } else if (constraints_.cpus) {
+        coreLease_.emplace(allocator.share(CoreAllocator::parseCpuList(*constraints_.cpus)));
+        if (coreLease_->cpus() != CoreAllocator::formatCpuList(CoreAllocator::parseCpuList(*constraints_.cpus))) {
+            impl::Message() << "Warning: some of CPUs " << *constraints_.cpus << " are held exclusively by other tasks, the task runs on "
+                << coreLease_->cpus();
+        }
+    } else {
+        // keeps off the cores leased to other tasks, now and later
+        coreLease_.emplace(allocator.share({}, [cg = cgroupHandler_.get()](const std::string &cpus) { cg->limitCpus(cpus); }));
+    }
+    if (!coreLease_->cpus().empty()) {
+        cgroupHandler_->limitCpus(coreLease_->cpus());
+    }
+    if (constraints_.cpuBandwidth) {
+        cgroupHandler_->limitCpuBandwidth(constraints_.cpuBandwidth->quotaUs, constraints_.cpuBandwidth->periodUs);
+    }
+    if (constraints_.cpuWeight) {
+        cgroupHandler_->setCpuWeight(*constraints_.cpuWeight);
+    }
     if (constraints_.freezable) {
         cgroupHandler_->addFreezerController();
     }
-    cgroupHandler_->create();
+    if (!pool.enabled()) {
+        cgroupHandler_->create();
+    }
+}
+
+void Task::limitIo_() {
+    if (!constraints_.ioMax && !constraints_.ioWeight)
+        return;
+    std::vector<std::filesystem::path> paths;
+    if (constraints_.fsImage) {
+        // the loop device of an image file, or the disk of the image dir, and the disk of the task's copy or upper layer
+        paths = {imageSource_, root_};
+        if (!overlayDir_.empty()) {
+            paths.push_back(overlayDir_);
+        }
+        for (auto &m : mappings_) {
+            paths.push_back(m.from);
+        }
+    } else {
+        paths.push_back(std::filesystem::absolute(constraints_.workDir));
+    }
+    std::set<dev_t> disks;
+    for (auto &p : paths) {
+        if (auto disk = CGroupHandler::blockDevice(p)) {
+            disks.insert(*disk);
+        }
+    }
+    if (disks.empty()) {
+        impl::Message() << "Warning: no disk behind the task's files, its I/O is not limited";
+        return;
+    }
+    std::string limits;
+    if (auto &io = constraints_.ioMax) {
+        std::pair<const char*, std::optional<std::uint64_t>> fields[] = {
+            {"rbps", io->rbps}, {"wbps", io->wbps}, {"riops", io->riops}, {"wiops", io->wiops}};
+        for (auto &[key, value] : fields) {
+            if (value) {
+                limits += (limits.empty() ? ""s : " "s) + key + "=" + std::to_string(*value);
+            }
+        }
+    }
+    std::string names;
+    for (auto disk : disks) {
+        if (!limits.empty()) {
+            cgroupHandler_->limitIo(disk, limits);
+        }
+        names += (names.empty() ? "" : ", ") + std::to_string(major(disk)) + ":" + std::to_string(minor(disk));
+    }
+    if (constraints_.ioWeight) {
+        cgroupHandler_->setIoWeight(*constraints_.ioWeight);
+    }
+    impl::Message() << "Task I/O is limited on disks " << names;
 }
 
 void Task::exec_() {
-    char buf[2];
-    if (read(watcher2ExecPipefd_[0], buf, 2) != 2)
-        throw SandboxError("failed to read from pipe: "s + strerror(errno));
-    if (close(watcher2ExecPipefd_[0])) 
+    // EOF on the command pipe must mean that the watcher is gone
+    if (close(watcher2ExecPipefd_[1]) || close(main2WatcherPipefd_[0]))
         throw SandboxError("failed to close pipe: "s + strerror(errno));
 
+    if (stdio_) {
+        for (int fd = 0; fd < 3; fd++) {
+            if (dup2((*stdio_)[fd], fd) < 0)
+                throw SandboxError("failed to redirect stdio: "s + strerror(errno));
+        }
+        for (int fd : std::set<int>(stdio_->begin(), stdio_->end())) {
+            if (fd > STDERR_FILENO)
+                close(fd);
+        }
+    }
+
     if (setgid(0) == -1)
         throw SandboxError("failed to setgid: "s + strerror(errno));
     if (setuid(0) == -1)
@@ -371,11 +1308,35 @@ void Task::exec_() {
     if (!constraints_.preserveCapabilities)
         clearCapabilities_();
 
+    // all of the above is done before the command comes, from here on it is only the exec
+    if (write(execPipefd_[1], "", 1) != 1)
+        throw SandboxError("failed to write to pipe: "s + strerror(errno));
+    receiveCommand_();
+    // pinToCpu() moves the watcher, which may be after we were cloned
+    cpu_set_t cpus;
+    if (!sched_getaffinity(getppid(), sizeof(cpus), &cpus))
+        sched_setaffinity(0, sizeof(cpus), &cpus);
+
     std::vector<const char*> argv(1 + args_.size() + 1);
     argv[0] = executable_.c_str();
     for (auto i = 0; i < args_.size(); i++) {
         argv[1 + i] = args_[i].c_str();
     }
+    std::vector<char*> envp;
+    for (auto &e : env_) {
+        envp.push_back(e.data());
+    }
+    envp.push_back(nullptr);
+    // execvp() looks the executable up in the PATH of the command's environment then
+    environ = envp.data();
+    // ignoring discards an interrupt of the idle sandbox, the watcher holds back those of the command
+    // until we exec; the watcher's blocked and ignored signals would outlive exec
+    signal(SIGINT, SIG_IGN);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, nullptr);
     auto res = execvp(executable_.c_str(), const_cast<char* const*>(argv.data()));
     if (res < 0) {
         throw SandboxError("failed to start the task: "s + std::strerror(errno));
@@ -383,14 +1344,74 @@ void Task::exec_() {
 }
 
 RunAudit Task::getAudit() {
-    throw SandboxError("not implemented");
+    if (!audit_) {
+        throw SandboxError("task " + taskId_ + " is not over yet");
+    }
+    return *audit_;
+}
+
+void Task::collectAudit_(int status, const struct rusage &usage, TimeLimiter::Kill kill, bool oomKilled,
+        std::optional<std::uint64_t> pidsSpawned) {
+    using Termination = RunAudit::Termination;
+    RunAudit audit;
+    audit.taskId = taskId_;
+    audit.wallTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - launchedAt_);
+    auto toUs = [](const timeval &tv) { return std::chrono::microseconds(tv.tv_sec * 1'000'000LL + tv.tv_usec); };
+    audit.userTime = toUs(usage.ru_utime);
+    audit.systemTime = toUs(usage.ru_stime);
+    audit.maxRssBytes = usage.ru_maxrss * 1024ULL;
+    audit.majorFaults = usage.ru_majflt;
+    audit.minorFaults = usage.ru_minflt;
+    audit.voluntaryContextSwitches = usage.ru_nvcsw;
+    audit.involuntaryContextSwitches = usage.ru_nivcsw;
+    audit.preemptedTime = preemptedTime_;
+    audit.preemptions = preemptions_;
+    audit.pidsSpawned = pidsSpawned;
+
+    if (WIFEXITED(status)) {
+        audit.exitCode = WEXITSTATUS(status);
+    } else if (WIFSIGNALED(status)) {
+        audit.signal = WTERMSIG(status);
+    }
+
+    auto &cg = *cgroupHandler_;
+    auto counter = [&](const char *file, const char *key) -> std::optional<std::uint64_t> {
+        auto value = cg.readStat(file, key);
+        if (!value) return std::nullopt;
+        auto base = cg.baseline(file + ":"s + key);
+        return *value > base ? *value - base : 0;
+    };
+    audit.cgroupCpuUsageUs = counter("cpu.stat", "usage_usec");
+    audit.cgroupUserUs = counter("cpu.stat", "user_usec");
+    audit.cgroupSystemUs = counter("cpu.stat", "system_usec");
+    audit.oomKills = counter("memory.events", "oom_kill");
+    audit.pidsLimitHits = counter("pids.events", "max");
+    audit.memoryPeakBytes = cg.readStat("memory.peak");
+    if (auto io = cg.readIoBytes()) {
+        audit.ioReadBytes = io->first - std::min(io->first, cg.baseline("io.stat:rbytes"));
+        audit.ioWriteBytes = io->second - std::min(io->second, cg.baseline("io.stat:wbytes"));
+    }
+
+    if (kill == TimeLimiter::Kill::RealTime) {
+        audit.termination = Termination::TimeLimit;
+    } else if (kill == TimeLimiter::Kill::CpuTime) {
+        audit.termination = Termination::CpuTimeLimit;
+    } else if (oomKilled || (audit.signal == SIGKILL && audit.oomKills.value_or(0) > 0)) {
+        audit.termination = Termination::OomKill;
+    } else if (audit.exitCode.value_or(0) != 0 && audit.pidsLimitHits.value_or(0) > 0) {
+        audit.termination = Termination::PidsLimit;
+    } else if (audit.signal) {
+        audit.termination = Termination::Signal;
+    }
+    audit_ = std::move(audit);
 }
 
 std::string Task::generateTaskId_() {
     static const std::string alphabet = "0123456789abcdef";
     static const int length = 8;
     
-    static std::mt19937 gen(time(nullptr));
+    // seeded per process, sandboxes started within the same second must not get the same ids
+    static std::mt19937 gen(std::random_device{}());
     
     std::string result;
     for (int i = 0; i < length; i++) {
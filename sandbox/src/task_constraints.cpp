@@ -5,29 +5,63 @@ namespace sandbox
 
 TaskConstraints::TaskConstraints(
     std::optional<double> maxRealTimeSeconds,
+    std::optional<double> maxCpuTimeSeconds,
     std::optional<std::size_t> maxMemoryBytes, 
+    std::optional<std::size_t> maxSwapBytes,
     std::size_t stackSize,
     std::optional<std::size_t> maxForks,
     std::optional<int> niceness,
+    std::optional<std::string> cpus,
+    std::optional<std::size_t> exclusiveCores,
+    std::optional<CpuBandwidth> cpuBandwidth,
+    std::optional<unsigned> cpuWeight,
+    std::optional<IoLimit> ioMax,
+    std::optional<unsigned> ioWeight,
+    Priority priority,
     bool newNetwork,
     bool freezable,
     bool preserveCapabilities,
     std::optional<std::filesystem::path> fsImage,
+    ImageMode imageMode,
+    std::optional<std::filesystem::path> imageCacheDir,
+    std::optional<std::size_t> imageCacheMaxBytes,
+    std::optional<std::filesystem::path> scratchDir,
+    std::optional<std::size_t> tmpfsMaxBytes,
+    std::optional<std::size_t> tmpfsMaxInodes,
     std::filesystem::path workDir,
     std::vector<FileMapping> fileMapping,
+    std::optional<std::filesystem::path> sampleFile,
+    std::chrono::milliseconds sampleInterval,
     uid_t uid,
     gid_t gid
 ) : maxRealTimeSeconds{maxRealTimeSeconds}
+  , maxCpuTimeSeconds{maxCpuTimeSeconds}
   , maxMemoryBytes{maxMemoryBytes}
+  , maxSwapBytes{maxSwapBytes}
   , stackSize{stackSize}
   , maxForks{maxForks}
   , niceness{niceness}
+  , cpus{std::move(cpus)}
+  , exclusiveCores{exclusiveCores}
+  , cpuBandwidth{cpuBandwidth}
+  , cpuWeight{cpuWeight}
+  , ioMax{ioMax}
+  , ioWeight{ioWeight}
+  , priority{priority}
   , newNetwork{newNetwork}
   , freezable{freezable}
   , preserveCapabilities{preserveCapabilities}
   , fsImage{fsImage}
+  , imageMode{imageMode}
+  , imageCacheDir{imageCacheDir}
+  , imageCacheMaxBytes{imageCacheMaxBytes}
+  , scratchDir{scratchDir}
+  , tmpfsMaxBytes{tmpfsMaxBytes}
+  , tmpfsMaxInodes{tmpfsMaxInodes}
   , workDir{workDir}
   , fileMapping{std::move(fileMapping)}
+  , sampleFile{std::move(sampleFile)}
+  , sampleInterval{sampleInterval}
   , uid{uid}
   , gid{gid}
 {}
@@ -0,0 +1,64 @@
+#include "task_pool.h"
+#include "exceptions.h"
+#include "msg.h"
+
+#include <algorithm>
+
+namespace sandbox
+{
+
+TaskPool::TaskPool(TaskConstraints constraints, std::size_t size, std::optional<double> refillRate, bool watcherVerbose)
+    : constraints_{std::move(constraints)}
+    , size_{size}
+    , refillRate_{refillRate}
+    , watcherVerbose_{watcherVerbose}
+    , refillBudget_(size)
+    , lastRefill_{std::chrono::steady_clock::now()}
+{}
+
+TaskPool::~TaskPool() {
+    for (auto &task : idle_) {
+        task->dismiss();
+        try {
+            task->cleanupImageDir();
+        } catch (SandboxException &e) {
+            impl::Message() << "Warning: failed to remove image dir of a pooled task: " << e.what();
+        } catch (std::exception &e) {
+            impl::Message() << "Warning: failed to remove image dir of a pooled task: " << e.what();
+        }
+    }
+}
+
+std::unique_ptr<Task> TaskPool::acquire() {
+    if (idle_.empty()) {
+        auto task = std::make_unique<Task>(constraints_, watcherVerbose_);
+        task->prepare();
+        return task;
+    }
+    auto task = std::move(idle_.front());
+    idle_.pop_front();
+    return task;
+}
+
+void TaskPool::refill() {
+    auto now = std::chrono::steady_clock::now();
+    if (refillRate_) {
+        std::chrono::duration<double> elapsed = now - lastRefill_;
+        refillBudget_ = std::min<double>(size_, refillBudget_ + elapsed.count() * *refillRate_);
+    } else {
+        refillBudget_ = size_;
+    }
+    lastRefill_ = now;
+    while (idle_.size() < size_ && refillBudget_ >= 1) {
+        auto task = std::make_unique<Task>(constraints_, watcherVerbose_);
+        task->prepare();
+        idle_.push_back(std::move(task));
+        refillBudget_ -= 1;
+    }
+}
+
+std::size_t TaskPool::idle() const {
+    return idle_.size();
+}
+
+} // namespace sandbox
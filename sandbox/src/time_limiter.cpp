@@ -0,0 +1,245 @@
+#include "time_limiter.h"
+#include "exceptions.h"
+#include "msg.h"
+
+#include <unistd.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <syscall.h>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <sstream>
+
+using namespace std::string_literals;
+
+namespace sandbox
+{
+
+enum class EventKind : std::uint64_t {
+    Exit = 0,
+    RealTime = 1,
+    CpuTime = 2
+};
+
+// the shortest interval between two reads of cpu.stat, bounds the overshoot of CPU time limits
+constexpr auto minCpuCheckInterval = std::chrono::milliseconds(1);
+
+// epoll data carries the pid and what the event is about
+static std::uint64_t eventData_(pid_t pid, EventKind kind) {
+    return (std::uint64_t(pid) << 2) | static_cast<std::uint64_t>(kind);
+}
+
+static void armTimer_(int timerFd, std::chrono::nanoseconds after) {
+    auto ns = after.count();
+    itimerspec spec{};
+    spec.it_value.tv_sec = ns / 1'000'000'000;
+    spec.it_value.tv_nsec = ns % 1'000'000'000;
+    if (ns <= 0) {
+        // a zero it_value would disarm the timer
+        spec.it_value.tv_sec = 0;
+        spec.it_value.tv_nsec = 1;
+    }
+    if (timerfd_settime(timerFd, 0, &spec, nullptr)) {
+        throw SandboxError("failed to arm timer: "s + std::strerror(errno));
+    }
+}
+
+TimeLimiter& TimeLimiter::instance() {
+    static TimeLimiter limiter;
+    return limiter;
+}
+
+TimeLimiter::TimeLimiter() {
+    epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd_ < 0) {
+        throw SandboxError("failed to create epoll instance: "s + std::strerror(errno));
+    }
+}
+
+TimeLimiter::~TimeLimiter() {
+    while (!limits_.empty()) {
+        remove(limits_.begin()->first);
+    }
+    close(epollFd_);
+}
+
+void TimeLimiter::add(pid_t pid, int pidFd, std::chrono::duration<double> limit) {
+    auto after = std::chrono::duration_cast<std::chrono::nanoseconds>(limit);
+    int timerFd = newTimer_(eventData_(pid, EventKind::RealTime));
+    auto &l = limitsOf_(pid, pidFd);
+    l.timerFd = timerFd;
+    l.at = std::chrono::steady_clock::now() + after;
+    try {
+        armTimer_(timerFd, after);
+    } catch (...) {
+        remove(pid);
+        throw;
+    }
+}
+
+void TimeLimiter::addCpuLimit(pid_t pid, int pidFd, int cpuStatFd, std::chrono::duration<double> limit, double parallelism) {
+    auto baseline = readUsage(cpuStatFd);
+    if (!baseline) {
+        close(cpuStatFd);
+        throw SandboxError("failed to read usage_usec from cpu.stat");
+    }
+    int timerFd;
+    try {
+        timerFd = newTimer_(eventData_(pid, EventKind::CpuTime));
+    } catch (...) {
+        close(cpuStatFd);
+        throw;
+    }
+    auto &l = limitsOf_(pid, pidFd);
+    l.cpuTimerFd = timerFd;
+    l.cpuStatFd = cpuStatFd;
+    l.cpuLimit = std::chrono::duration_cast<std::chrono::microseconds>(limit);
+    l.cpuBaselineUs = *baseline;
+    l.parallelism = std::max(parallelism, 1.0);
+    try {
+        // nothing can be used up faster than with every allowed CPU busy
+        armTimer_(timerFd, std::chrono::duration_cast<std::chrono::nanoseconds>(l.cpuLimit / l.parallelism));
+    } catch (...) {
+        remove(pid);
+        throw;
+    }
+}
+
+void TimeLimiter::remove(pid_t pid) {
+    auto it = limits_.find(pid);
+    if (it == limits_.end()) {
+        return;
+    }
+    auto &l = it->second;
+    // closing a timer drops it from the epoll set, the pidfd belongs to the task and stays open
+    for (int fd : {l.timerFd, l.cpuTimerFd, l.cpuStatFd}) {
+        if (fd >= 0) close(fd);
+    }
+    if (l.pidFd >= 0) {
+        epoll_ctl(epollFd_, EPOLL_CTL_DEL, l.pidFd, nullptr);
+    }
+    limits_.erase(it);
+}
+
+TimeLimiter::Kill TimeLimiter::takeKill(pid_t pid) {
+    auto it = killed_.find(pid);
+    if (it == killed_.end()) {
+        return Kill::None;
+    }
+    auto kill = it->second;
+    killed_.erase(it);
+    return kill;
+}
+
+void TimeLimiter::postpone(pid_t pid, std::chrono::nanoseconds by) {
+    auto it = limits_.find(pid);
+    if (it == limits_.end() || it->second.timerFd < 0) {
+        return;
+    }
+    auto &l = it->second;
+    l.at += by;
+    armTimer_(l.timerFd, l.at - std::chrono::steady_clock::now());
+}
+
+int TimeLimiter::fd() const {
+    return epollFd_;
+}
+
+void TimeLimiter::dispatch() {
+    epoll_event events[64];
+    int n = epoll_wait(epollFd_, events, 64, 0);
+    for (int i = 0; i < n; i++) {
+        pid_t pid = events[i].data.u64 >> 2;
+        auto kind = static_cast<EventKind>(events[i].data.u64 & 3);
+        auto it = limits_.find(pid);
+        if (it == limits_.end()) {
+            continue;
+        }
+        auto &l = it->second;
+        if (kind == EventKind::RealTime) {
+            auto late = std::chrono::steady_clock::now() - l.at;
+            kill_(pid, l);
+            killed_[pid] = Kill::RealTime;
+            impl::Message() << "process has exceeded its time limit (killed "
+                << std::chrono::duration_cast<std::chrono::microseconds>(late).count() << "us late)";
+        } else if (kind == EventKind::CpuTime) {
+            std::uint64_t expirations;
+            [[maybe_unused]] auto res = read(l.cpuTimerFd, &expirations, sizeof(expirations));
+            auto usage = readUsage(l.cpuStatFd);
+            if (!usage) {
+                // the group goes away with the task, whose exit is about to be reported by the pidfd
+                armTimer_(l.cpuTimerFd, minCpuCheckInterval);
+                continue;
+            }
+            std::chrono::microseconds used(*usage - l.cpuBaselineUs);
+            if (used < l.cpuLimit) {
+                // the closer to the limit, the more often we look
+                auto left = std::chrono::duration_cast<std::chrono::nanoseconds>((l.cpuLimit - used) / l.parallelism);
+                armTimer_(l.cpuTimerFd, std::max<std::chrono::nanoseconds>(left, minCpuCheckInterval));
+                continue;
+            }
+            kill_(pid, l);
+            killed_[pid] = Kill::CpuTime;
+            impl::Message() << "process has exceeded its CPU time limit (used " << used.count() << "us of " << l.cpuLimit.count() << "us)";
+        }
+        remove(pid);
+    }
+}
+
+TimeLimiter::Limits& TimeLimiter::limitsOf_(pid_t pid, int pidFd) {
+    auto [it, inserted] = limits_.try_emplace(pid);
+    if (inserted && pidFd >= 0) {
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = eventData_(pid, EventKind::Exit);
+        if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, pidFd, &ev)) {
+            limits_.erase(it);
+            throw SandboxError("failed to watch task: "s + std::strerror(errno));
+        }
+        it->second.pidFd = pidFd;
+    }
+    return it->second;
+}
+
+int TimeLimiter::newTimer_(std::uint64_t eventData) {
+    int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (timerFd < 0) {
+        throw SandboxError("failed to create timer: "s + std::strerror(errno));
+    }
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = eventData;
+    if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, timerFd, &ev)) {
+        close(timerFd);
+        throw SandboxError("failed to watch timer: "s + std::strerror(errno));
+    }
+    return timerFd;
+}
+
+void TimeLimiter::kill_(pid_t pid, const Limits &l) {
+    int res = l.pidFd >= 0
+        ? syscall(SYS_pidfd_send_signal, l.pidFd, SIGKILL, nullptr, 0)
+        : kill(pid, SIGKILL);
+    if (res) {
+        impl::Message() << "(out if time) failed to send SIGKILL: " << std::strerror(errno);
+    }
+}
+
+std::optional<std::uint64_t> TimeLimiter::readUsage(int cpuStatFd) {
+    char buf[1024];
+    auto n = pread(cpuStatFd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) {
+        return std::nullopt;
+    }
+    std::stringstream ss(std::string(buf, n));
+    std::string key;
+    std::uint64_t value;
+    while (ss >> key >> value) {
+        if (key == "usage_usec") return value;
+    }
+    return std::nullopt;
+}
+
+} // namespace sandbox
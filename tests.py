@@ -1,7 +1,14 @@
 #!/bin/env python
 import unittest
 import os
-from subprocess import Popen, PIPE
+import time
+import shutil
+import json
+import re
+import signal
+import pwd
+import glob
+from subprocess import Popen, PIPE, TimeoutExpired
 
 sandbox_executable = "./build/sandbox/sandbox"
 common_options = ''
@@ -63,11 +70,365 @@ class TestSandbox(unittest.TestCase):
         finally: 
             os.system('rm -rf test_data')
 
+    def test_file_mapping_modes(self):
+        os.mkdir('test_data')
+        try:
+            output, stderr = self.get_sandbox_output('-r -i rootfs -a test_data:/mnt', '/bin/sh', "-c 'echo x > /mnt/new_file'")
+            self.assertIn('Read-only file system', stderr)
+            self.assertFalse(os.path.exists('test_data/new_file'))
+
+            output, stderr = self.get_sandbox_output('-r -i rootfs --image-mode overlay-tmpfs -a test_data:/mnt:rw -u 0 -g 0', '/bin/sh', "-c 'echo x > /mnt/new_file'")
+            self.assertTrue(os.path.exists('test_data/new_file'))
+        finally:
+            os.system('rm -rf test_data')
+
+    def test_overlay_image(self):
+        for mode in ['overlay', 'overlay-tmpfs']:
+            output, stderr = self.get_sandbox_output(f'-r -i rootfs --image-mode {mode}', '/bin/sh', "-c 'echo written > /overlay_probe && cat /overlay_probe'")
+            self.assertEqual('written\n', output)
+            self.assertFalse(os.path.exists('rootfs/overlay_probe'))
+
+    def test_image_cache(self):
+        try:
+            for expect_build in [True, False]:
+                output, stderr = self.get_sandbox_output('-r -i rootfs --image-mode overlay --image-cache test_cache', '/bin/cat', '/etc/hostname')
+                self.assertEqual(expect_build, 'is not cached' in stderr)
+            self.assertEqual(1, len([e for e in os.listdir('test_cache') if not e.startswith('.')]))
+        finally:
+            os.system('rm -rf test_cache')
+
+    def test_deferred_cleanup(self):
+        output, stderr = self.get_sandbox_output('-r -i rootfs', '/bin/true', '')
+        self.assertEqual([], [e for e in os.listdir('.') if e.startswith('sandbox-task-')])
+        time.sleep(5)
+        self.assertEqual([], os.listdir('.sandbox-trash'))
+
+    @unittest.skipIf(shutil.which('mksquashfs') is None, 'mksquashfs is not installed')
+    def test_image_file(self):
+        os.system('mksquashfs rootfs test_rootfs.sqfs -noappend -quiet')
+        try:
+            for mode in ['overlay', 'overlay-tmpfs']:
+                output, stderr = self.get_sandbox_output(f'-r -i test_rootfs.sqfs --image-mode {mode}', '/bin/sh', "-c 'echo written > /probe && cat /probe'")
+                self.assertEqual('written\n', output)
+        finally:
+            os.system('umount .sandbox-images/test_rootfs.sqfs-*; rm -rf test_rootfs.sqfs .sandbox-images')
+
+    def test_scratch(self):
+        output, stderr = self.get_sandbox_output('-r -i rootfs --scratch /scratch --tmpfs-size 1048576', '/bin/sh', "-c 'head -c 2000000 /dev/zero > /scratch/big'")
+        self.assertIn('No space left on device', stderr)
+
+        output, stderr = self.get_sandbox_output('-r -i rootfs --scratch /scratch --tmpfs-inodes 3', '/bin/sh', "-c 'touch /scratch/1 /scratch/2 /scratch/3 /scratch/4'")
+        self.assertIn('No space left on device', stderr)
+
+    def test_zygote(self):
+        cmd = f'{sandbox_executable} {common_options} --zygote 2'
+        with Popen(cmd, shell=True, stdin=PIPE, stdout=PIPE, stderr=PIPE, env={**os.environ, 'ZYGOTE_TEST': 'env'}) as proc:
+            output, stderr = proc.communicate(b'./build/examples/echo42/echo42\n/bin/echo hello\n/usr/bin/printenv ZYGOTE_TEST\n'
+                                              b'/bin/echo "two  spaces" \'a "b"\' c\\ d\n/bin/echo "unterminated\n')
+        self.assertEqual('42\nhello\nenv\ntwo  spaces a "b" c d\n', output.decode('utf-8'))
+        self.assertEqual(4, stderr.decode('utf-8').count("Task exec'd in"))
+        self.assertIn('Bad command: unterminated double quote', stderr.decode('utf-8'))
+        self.assertIn('Start-to-exec latency of 4 tasks', stderr.decode('utf-8'))
+
+    def test_cgroup_pool(self):
+        cmd = f'{sandbox_executable} {common_options} --zygote 2 --cgroup-pool 2'
+        with Popen(cmd, shell=True, stdin=PIPE, stdout=PIPE, stderr=PIPE) as proc:
+            output, stderr = proc.communicate(b'/bin/cat /proc/self/cgroup\n' * 6)
+        groups = output.decode('utf-8').split()
+        self.assertEqual(6, len(groups))
+        for group in groups:
+            self.assertIn('sandbox-pool-', group)
+        # released groups are handed out again
+        self.assertLess(len(set(groups)), 6)
+
+    def test_sandboxd(self):
+        sandboxd = './build/sandbox/sandboxd'
+        with Popen(f'{sandboxd} --socket test_sandboxd.sock', shell=True, stdout=PIPE, stderr=PIPE) as daemon:
+            try:
+                time.sleep(1)
+                procs = [Popen(f'{sandboxd} --socket test_sandboxd.sock --run {common_options} -- /bin/sh -c "echo {i}; exit {i}"', shell=True, stdout=PIPE, stderr=PIPE) for i in range(5)]
+                for i, proc in enumerate(procs):
+                    output, stderr = proc.communicate()
+                    self.assertEqual(f'{i}\n', output.decode('utf-8'))
+                    self.assertEqual(i, proc.returncode)
+            finally:
+                daemon.terminate()
+
+    def test_preemption(self):
+        sandboxd = './build/sandbox/sandboxd'
+        busy = '/bin/sh -c "end=\\$((\\$(date +%s) + 2)); while [ \\$(date +%s) -lt \\$end ]; do :; done"'
+        with Popen(f'{sandboxd} --socket test_preemption.sock --cpu-capacity 1', shell=True, stdout=PIPE, stderr=PIPE) as daemon:
+            try:
+                time.sleep(1)
+                run = f'{sandboxd} --socket test_preemption.sock --audit test_preemption.json --run {common_options}'
+                batch = Popen(f'{run} --priority batch -- {busy}', shell=True, stdout=PIPE, stderr=PIPE)
+                time.sleep(0.5)
+                latency = Popen(f'{run} --priority latency -- {busy}', shell=True, stdout=PIPE, stderr=PIPE)
+                latency.communicate()
+                batch.communicate()
+                self.assertEqual(0, batch.returncode)
+                with open('test_preemption.json') as f:
+                    audits = [json.loads(line) for line in f]
+                # the latency task ends first, the batch one waited for it frozen
+                self.assertEqual(0, audits[0]['preemptions'])
+                self.assertEqual(1, audits[1]['preemptions'])
+                self.assertGreater(audits[1]['preempted_us'], 1000000)
+            finally:
+                daemon.terminate()
+                _, stderr = daemon.communicate()
+                if os.path.exists('test_preemption.json'):
+                    os.remove('test_preemption.json')
+            self.assertIn('Preempted batch task', stderr.decode('utf-8'))
+
+    def test_sandboxd_peers(self):
+        sandboxd = './build/sandbox/sandboxd'
+        # started directly, so that terminate() reaches the daemon and not a shell
+        with Popen([sandboxd, '--socket', 'test_peers.sock'], stdout=PIPE, stderr=PIPE) as daemon:
+            try:
+                time.sleep(1)
+                self.assertEqual(0o600, os.stat('test_peers.sock').st_mode & 0o777)
+                # opened up by hand, a client that isn't root still can't act as root through the daemon
+                os.chmod('test_peers.sock', 0o666)
+                nobody = f'-u {pwd.getpwnam("nobody").pw_uid} -g {pwd.getpwnam("nobody").pw_gid}'
+                # nor as another user, whose files it could reach through the task
+                for options in ['-u 0', '-u 5000 -g 5000', f'{nobody} -g 5000', f'{nobody} --preserve-capabilities',
+                                f'{nobody} -a /tmp:/tmp:rw']:
+                    client = Popen(f'{sandboxd} --socket test_peers.sock --run {common_options} {options} -- /bin/true',
+                                   shell=True, stdout=PIPE, stderr=PIPE, user='nobody')
+                    _, stderr = client.communicate()
+                    self.assertEqual(1, client.returncode)
+                    self.assertIn('only root may', stderr.decode('utf-8'))
+            finally:
+                daemon.terminate()
+                daemon.communicate()
+
+    def test_sandboxd_client_cwd(self):
+        sandboxd = os.path.abspath('./build/sandbox/sandboxd')
+        socket = os.path.abspath('test_cwd.sock')
+        os.makedirs('test_cwd', exist_ok=True)
+        os.chmod('test_cwd', 0o755)
+        with Popen([sandboxd, '--socket', socket], stdout=PIPE, stderr=PIPE) as daemon:
+            try:
+                time.sleep(1)
+                # the task runs where the client is, not where sandboxd was started
+                client = Popen(f'{sandboxd} --socket {socket} --run {common_options} -- /bin/pwd',
+                               shell=True, stdout=PIPE, stderr=PIPE, cwd='test_cwd')
+                output, _ = client.communicate()
+                self.assertEqual(0, client.returncode)
+                self.assertEqual(os.path.abspath('test_cwd'), output.decode('utf-8').strip())
+            finally:
+                daemon.terminate()
+                daemon.communicate()
+                shutil.rmtree('test_cwd')
+
+    def test_batch(self):
+        batch = './build/sandbox/sandbox-batch'
+        with open('test_batch_manifest', 'w') as manifest:
+            manifest.write('# comment\n/bin/false\n\n')
+            for i in range(8):
+                manifest.write(f'-t 5 -- /bin/echo {i}\n')
+            manifest.write('/bin/echo "two  spaces" \'and a "quote"\'\n')
+        try:
+            with Popen(f'{batch} -j 4 -o test_batch_results --output-dir test_batch_output test_batch_manifest -- {common_options}', shell=True, stdout=PIPE, stderr=PIPE) as proc:
+                _, stderr = proc.communicate()
+            self.assertIn('10 tasks (1 failed or unfinished)', stderr.decode('utf-8'))
+            with open('test_batch_results') as f:
+                results = [line.split('\t') for line in f.read().splitlines()]
+            self.assertEqual(['2', '1'], results[0][:2])
+            for i, result in enumerate(results[1:9]):
+                self.assertEqual([str(i + 4), '0'], result[:2])
+                with open(f'test_batch_output/{i + 4}.out') as f:
+                    self.assertEqual(f'{i}\n', f.read())
+            with open('test_batch_output/12.out') as f:
+                self.assertEqual('two  spaces and a "quote"\n', f.read())
+        finally:
+            for path in ['test_batch_manifest', 'test_batch_results']:
+                if os.path.exists(path):
+                    os.remove(path)
+            shutil.rmtree('test_batch_output', ignore_errors=True)
+
+    def test_batch_network(self):
+        batch = './build/sandbox/sandbox-batch'
+        with open('test_network_manifest', 'w') as manifest:
+            manifest.write('/bin/readlink /proc/self/ns/net\n--new-network -- /bin/readlink /proc/self/ns/net\n/bin/readlink /proc/self/ns/net\n')
+        try:
+            # one at a time, the last line starts after the one with its own network
+            with Popen(f'{batch} -j 1 --output-dir test_network_output test_network_manifest -- {common_options}', shell=True, stdout=PIPE, stderr=PIPE) as proc:
+                proc.communicate()
+            self.assertEqual(0, proc.returncode)
+            outputs = []
+            for line in range(1, 4):
+                with open(f'test_network_output/{line}.out') as f:
+                    outputs.append(f.read().strip())
+            host = os.readlink('/proc/self/ns/net')
+            self.assertEqual([host, host], [outputs[0], outputs[2]])
+            self.assertNotEqual(host, outputs[1])
+        finally:
+            if os.path.exists('test_network_manifest'):
+                os.remove('test_network_manifest')
+            shutil.rmtree('test_network_output', ignore_errors=True)
+
+    def test_batch_pressure(self):
+        batch = './build/sandbox/sandbox-batch'
+        tasks = os.cpu_count() * 4
+        with open('test_pressure_manifest', 'w') as manifest:
+            for _ in range(tasks):
+                manifest.write('-t 2 -- /usr/bin/sha256sum /dev/zero\n')
+        try:
+            with Popen(f'{batch} -j {tasks} --max-cpu-pressure 20 -o test_pressure_results test_pressure_manifest -- {common_options}', shell=True, stdout=PIPE, stderr=PIPE) as proc:
+                _, stderr = proc.communicate()
+            stderr = stderr.decode('utf-8')
+            # the CPUs are oversubscribed fourfold, the gate has to back off but still run every task
+            self.assertIn('Pressure gate: cpu stalls above 20%', stderr)
+            self.assertNotIn('throttled by pressure for 0s', stderr)
+            with open('test_pressure_results') as f:
+                self.assertEqual(tasks, sum(1 for line in f if 'not run' not in line))
+        finally:
+            for path in ['test_pressure_manifest', 'test_pressure_results']:
+                if os.path.exists(path):
+                    os.remove(path)
+
+    def test_io_max(self):
+        output, stderr = self.get_sandbox_output('--io-max wbps=4194304', './build/examples/iohammer/iohammer', '8')
+        self.assertIn('Task I/O is limited on disks', stderr)
+        # "wrote 8 MB at <MB/s> MB/s, ..."
+        self.assertLess(float(output.split()[4]), 8)
+
+    def test_cpus(self):
+        output, _ = self.get_sandbox_output('--cpus 0 --cpu-max 50000/100000 --cpu-weight 50', '/bin/grep', 'Cpus_allowed_list /proc/self/status')
+        self.assertEqual('Cpus_allowed_list:\t0', output.strip())
+
+        output, stderr = self.get_sandbox_output('--cpus auto', '/bin/grep', 'Cpus_allowed_list /proc/self/status')
+        cpus = output.split()[-1]
+        self.assertIn(f'Task got CPUs {cpus}', stderr)
+
+        # one more task than there are cores waits for a core instead of failing
+        batch = './build/sandbox/sandbox-batch'
+        tasks = os.cpu_count() + 1
+        with open('test_cpus_manifest', 'w') as manifest:
+            for _ in range(tasks):
+                manifest.write('--cpus auto -t 5 -- /bin/sleep 0.5\n')
+        try:
+            with Popen(f'{batch} -j {tasks} -o test_cpus_results test_cpus_manifest -- {common_options}', shell=True, stdout=PIPE, stderr=PIPE) as proc:
+                _, stderr = proc.communicate()
+            self.assertIn(f'{tasks} tasks (0 failed or unfinished)', stderr.decode('utf-8'))
+        finally:
+            for path in ['test_cpus_manifest', 'test_cpus_results']:
+                if os.path.exists(path):
+                    os.remove(path)
+
     def test_time(self):
         executable = './build/examples/sleep30/sleep30'
         output, stderr = self.get_sandbox_output('-t 1', executable, '')
         self.assertIn('(Sandbox) process has exceeded its time limit', stderr)
 
+    def test_cpu_time(self):
+        start = time.monotonic()
+        _, stderr = self.get_sandbox_output('--cpu-time-limit 0.5 -t 10', '/bin/sh', '-c "while :; do :; done"')
+        self.assertIn('(Sandbox) process has exceeded its CPU time limit', stderr)
+        self.assertLess(time.monotonic() - start, 5)
+
+        # a sleeping task uses no CPU time, the wall clock limit stops it
+        _, stderr = self.get_sandbox_output('--cpu-time-limit 0.1 -t 1', './build/examples/sleep30/sleep30', '')
+        self.assertIn('(Sandbox) process has exceeded its time limit', stderr)
+        self.assertNotIn('CPU time limit', stderr)
+
+    def test_audit(self):
+        def audit(options, executable, args):
+            if os.path.exists('test_audit.json'):
+                os.remove('test_audit.json')
+            self.get_sandbox_output(f'--audit test_audit.json {options}', executable, args)
+            with open('test_audit.json') as f:
+                return json.loads(f.read())
+        try:
+            result = audit('', './build/examples/echo42/echo42', '')
+            self.assertEqual('exit', result['termination'])
+            self.assertEqual(0, result['exit_code'])
+            self.assertGreaterEqual(result['pids_spawned'], 1)
+            self.assertGreater(result['wall_time_us'], 0)
+
+            result = audit('-m 50000000', './build/examples/eat100mb/eat100mb', '')
+            self.assertEqual('oom_kill', result['termination'])
+            self.assertEqual(9, result['signal'])
+            self.assertLessEqual(result['memory_peak_bytes'], 50000000)
+
+            result = audit('-t 1', './build/examples/sleep30/sleep30', '')
+            self.assertEqual('time_limit', result['termination'])
+        finally:
+            if os.path.exists('test_audit.json'):
+                os.remove('test_audit.json')
+
+    def test_oom_teardown(self):
+        # the shell survives the OOM kill of its child, the task is stopped anyway instead of sleeping on
+        start = time.monotonic()
+        _, stderr = self.get_sandbox_output('-m 50000000 -t 20', '/bin/sh',
+                                            '-c "./build/examples/eat100mb/eat100mb; sleep 30"')
+        self.assertIn('(Sandbox) process has exceeded its memory limit', stderr)
+        self.assertNotIn('exceeded its time limit', stderr)
+        self.assertLess(time.monotonic() - start, 10)
+
+    def test_sampler(self):
+        if os.path.exists('test_samples.csv'):
+            os.remove('test_samples.csv')
+        try:
+            _, stderr = self.get_sandbox_output('--sample test_samples.csv --sample-interval 20 -t 10', '/bin/sh',
+                                                '-c "i=0; while [ $i -lt 200000 ]; do i=$((i+1)); done"')
+            self.assertIn('(Sandbox) Sampler: ', stderr)
+            with open('test_samples.csv') as f:
+                lines = f.read().splitlines()
+            self.assertEqual('task,t_us,memory_current,cpu_usage_us,cpu_user_us,cpu_system_us,io_rbytes,io_wbytes,pids_current',
+                             lines[0])
+            samples = [line.split(',') for line in lines[1:]]
+            self.assertGreaterEqual(len(samples), 3)
+            times = [int(s[1]) for s in samples]
+            self.assertEqual(sorted(times), times)
+            # CPU time only grows, the last sample is taken after the task is over
+            usage = [int(s[3]) for s in samples]
+            self.assertEqual(sorted(usage), usage)
+            self.assertGreater(usage[-1], 0)
+        finally:
+            if os.path.exists('test_samples.csv'):
+                os.remove('test_samples.csv')
+
+    def test_freezer(self):
+        # no shell in between, SIGINT has to reach the sandbox so that it removes its status file
+        # a memory limit disables swap unless --memory-swap says otherwise
+        tasks = [Popen([sandbox_executable, *common_options.split(), '-t', '20', *memory, '--', './build/examples/sleep30/sleep30'],
+                       stdout=PIPE, stderr=PIPE)
+                 for memory in [[], ['-m', '100000000'], ['-m', '100000000', '--memory-swap', 'max']]]
+        try:
+            status_files = []
+            for task in tasks:
+                for line in task.stderr:
+                    match = re.search(r'Starting task (sandbox-task-[0-9a-f]+)', line.decode('utf-8'))
+                    if match:
+                        status_files.append(match.group(1))
+                        break
+            for _ in range(50):
+                if all(os.path.isfile(f) for f in status_files):
+                    break
+                time.sleep(0.1)
+            self.assertEqual(len(tasks), len(set(status_files)))
+            for options, verb, memory in [('', 'Froze', None), ('--thaw', 'Thawed', None),
+                                          ('--reclaim', 'Froze', 'Reclaimed'), ('--thaw --prefetch', 'Thawed', 'Prefetched')]:
+                with Popen(f'./build/sandbox/freezer {options} {" ".join(status_files)}', shell=True, stdout=PIPE) as proc:
+                    output, _ = proc.communicate()
+                self.assertEqual(0, proc.returncode)
+                self.assertIn(f'{verb} 3 of 3 tasks', output.decode('utf-8'))
+                if memory:
+                    self.assertIn(f'{memory} ', output.decode('utf-8'))
+                if memory == 'Reclaimed' and glob.glob('/sys/fs/cgroup/*/memory.swap.max'):
+                    self.assertEqual(1, output.decode('utf-8').count('memory.swap.max is 0'))
+        finally:
+            for task in tasks:
+                task.send_signal(signal.SIGINT)
+            for task in tasks:
+                try:
+                    task.communicate(timeout=10)
+                except TimeoutExpired:
+                    task.kill()
+                    task.communicate()
+
     def test_daemon(self):
         executable = './build/examples/daemon/daemon'
         output, stderr = self.get_sandbox_output('', executable, '')